@@ -102,6 +102,7 @@ int initialize_cpu(const char *cpu_type)
 void reset_cpu(void)
 {
     atomic_or(&cpu.pending_exceptions, EX_RESET); // schedule a reset
+    cpu_request_exit();
 }
 
 static int cpu_startup_thread_entry(void *args)
@@ -136,10 +137,17 @@ static Uint32 speedtimer(Uint32 interval, void *param)
     printf("%d cycles/sec, ",
            delta_perf_counter.count[CYCLE_COUNT]);
 #endif
-    printf("%7d ins/sec, %7d ins decodes/sec, exceptions/sec %5d\n",
+    printf("%7d ins/sec, %7d ins decodes/sec, %7d predecodes/sec, exceptions/sec %5d\n",
            delta_perf_counter.count[INS_COUNT],
            delta_perf_counter.count[INS_DECODE],
+           delta_perf_counter.count[INS_PREDECODE],
            delta_perf_counter.count[EXCEPTIONS]);
+    printf("%7d codepage hits/sec, %7d misses/sec, %7d evictions/sec, %7d written/sec, %7d from the decode cache/sec\n",
+           delta_perf_counter.count[CODEPAGE_HIT],
+           delta_perf_counter.count[CODEPAGE_MISS],
+           delta_perf_counter.count[CODEPAGE_EVICT],
+           delta_perf_counter.count[CODEPAGE_WRITTEN],
+           delta_perf_counter.count[CODEPAGE_CACHED]);
 #if COUNT_MMU_OPS
     printf("%7d slow mmu translates/sec, %7d ins fetches, %7d mmu reads, %7d mmu writes, %7d fastpath, %7d slowpath\n",
            delta_perf_counter.count[MMU_SLOW_TRANSLATE],
@@ -171,6 +179,11 @@ static Uint32 speedtimer(Uint32 interval, void *param)
         printf("\tuop arith opcode %2d (%s): %d\n", i, dp_op_to_str(i), delta_perf_counter.count[UOP_ARITH_OPCODE + i]);
     }
 #endif
+#if COUNT_FUSED_UOPS
+    for (i=0; i < NUM_FUSED_UOPS; i++) {
+        printf("\tfused uop %3d (%s): %d\n", FUSED_UOP_FIRST + i, uop_opcode_to_str(FUSED_UOP_FIRST + i), delta_perf_counter.count[FUSED_UOP_BASE + i]);
+    }
+#endif
 
     return interval;
 }
@@ -311,10 +324,23 @@ void put_reg_user(int num, reg_t data)
     }
 }
 
+/*
+ * Ask the cpu to come out to the top of the dispatch loop and look at
+ * pending_exceptions. This is the only word the dispatch loop and translated
+ * code test at the end of a block, so anything that sets a pending exception
+ * bit raises it afterwards, from whichever thread. The dispatch loop clears it
+ * before it reads pending_exceptions, so a bit set in between is not lost.
+ */
+void cpu_request_exit(void)
+{
+    atomic_set(&cpu.exit_request, 1);
+}
+
 void raise_irq(void)
 {
     CPU_TRACE(5, "raise_irq\n");
     atomic_or(&cpu.pending_exceptions, EX_IRQ);
+    cpu_request_exit();
 }
 
 void lower_irq(void)
@@ -327,6 +353,7 @@ void raise_fiq(void)
 {
     CPU_TRACE(5, "raise_fiq\n");
     atomic_or(&cpu.pending_exceptions, EX_FIQ);
+    cpu_request_exit();
 }
 
 void lower_fiq(void)
@@ -339,12 +366,14 @@ void signal_data_abort(armaddr_t addr)
 {
     CPU_TRACE(4, "data abort at 0x%08x\n", addr);
     atomic_or(&cpu.pending_exceptions, EX_DATA_ABT);
+    cpu_request_exit();
 }
 
 void signal_prefetch_abort(armaddr_t addr)
 {
     CPU_TRACE(4, "prefetch abort at 0x%08x\n", addr);
     atomic_or(&cpu.pending_exceptions, EX_PREFETCH);
+    cpu_request_exit();
 }
 
 void install_coprocessor(int cp_num, struct arm_coprocessor *coproc)
@@ -469,6 +498,9 @@ bool process_pending_exceptions(void)
 
     CPU_TRACE(5, "process_pending_exceptions: pending ex 0x%x\n", cpu.pending_exceptions);
 
+    // the exception entries save cpsr into spsr
+    flush_lazy_flags();
+
     // system reset
     if (cpu.pending_exceptions & EX_RESET) {
         // go to a default state
@@ -608,6 +640,8 @@ bool process_pending_exceptions(void)
 
 void dump_cpu(void)
 {
+    flush_lazy_flags();
+
     printf("cpu_dump: ins %d\n", get_instruction_count());
     printf("r0:   0x%08x r1:   0x%08x r2:   0x%08x r3:   0x%08x\n", cpu.r[0], cpu.r[1], cpu.r[2], cpu.r[3]);
     printf("r4:   0x%08x r5:   0x%08x r6:   0x%08x r7:   0x%08x\n", cpu.r[4], cpu.r[5], cpu.r[6], cpu.r[7]);
@@ -643,8 +677,14 @@ void dump_registers(void)
 
 void shutdown_cpu(void)
 {
-    // push a quit message to the SDL event loop
     SDL_Event event;
+
+#if WITH_DECODE_CACHE
+    // the main thread may be the one to exit, so save while still on the cpu thread
+    uop_save_decode_cache();
+#endif
+
+    // push a quit message to the SDL event loop
     event.type = SDL_QUIT;
     SDL_PushEvent(&event);
 
@@ -28,9 +28,13 @@
 
 typedef void (*decode_stage_func)(struct uop *op);
 
+__THREAD_LOCAL armaddr_t decode_r15;
+__THREAD_LOCAL bool decode_speculative;
+__THREAD_LOCAL bool decode_failed;
+
 static void bad_decode(struct uop *op)
 {
-    panic_cpu("bad_decode: ins 0x%08x at 0x%08x\n", op->undecoded.raw_instruction, cpu.pc - 4);
+    DECODE_PANIC("bad_decode: ins 0x%08x at 0x%08x\n", op->undecoded.raw_instruction, decode_r15 - 8);
 }
 
 // opcode[27:25] == 0b000
@@ -23,6 +23,7 @@
 #include <stdio.h>
 
 #include <arm/arm.h>
+#include <arm/decoder.h>
 #include <arm/mmu.h>
 #include <arm/ops.h>
 #include <util/atomic.h>
@@ -95,7 +96,7 @@ void op_branch(struct uop *op)
         L = 1; // force a link
     }
 
-    pc = get_reg(PC);
+    pc = decode_r15;
     if (L) {
         op->flags |= UOPBFLAGS_LINK;
         op->b_immediate.link_target = pc - 4;
@@ -103,7 +104,7 @@ void op_branch(struct uop *op)
     op->b_immediate.target = (pc + offset) & 0xfffffffe;
 
     // this translates to branch immediate
-    if ((op->b_immediate.target >> MMU_PAGESIZE_SHIFT) == ((pc - 8) >> MMU_PAGESIZE_SHIFT))
+    if ((op->b_immediate.target >> CODEPAGE_SHIFT) == ((pc - 8) >> CODEPAGE_SHIFT))
         op->opcode = B_IMMEDIATE_LOCAL; // it's within the current codepage
     else
         op->opcode = B_IMMEDIATE; // outside the current codepage
@@ -143,6 +144,7 @@ void op_bx(struct uop *op)
     op->flags |= UOPBFLAGS_SETTHUMB_COND;
     op->b_reg.reg = Rm;
     op->b_reg.link_offset = -4;
+    op->b_reg.target_cp = NULL;
 
     if (L)
         op->flags |= UOPBFLAGS_LINK;
@@ -485,8 +487,8 @@ void op_data_processing(struct uop *op)
 imm_longform:
             CPU_TRACE(6, "\t\tIMM_SHIFT: opcode %d (%s) Rd %d Rn %d Rm %d shift_imm %d shift_op 0x%x\n", opcode, dp_op_to_str(opcode), Rd, Rn, Rm, shift_imm, shift_op);
 
-            /* translates to the relatively slow DATA_PROCESSING_IMM_SHIFT */
-            op->opcode = DATA_PROCESSING_IMM_SHIFT;
+            /* translates to DATA_PROCESSING_IMM_SHIFT, specialized on the shift type and S bit */
+            op->opcode = uop_dp_shift_opcode(FALSE, shift_op, S);
             op->data_processing_imm_shift.dp_opcode = opcode;
             if (S)
                 op->flags |= UOPDPFLAGS_S_BIT;
@@ -551,8 +553,8 @@ imm_longform:
 
             CPU_TRACE(6, "\t\tREG_SHIFT: opcode %d (%s) Rd %d Rn %d Rm %d Rs %d shift_op %d\n", opcode, dp_op_to_str(opcode), Rd, Rn, Rm, Rs, shift_op);
 
-            /* translates to the relatively slow DATA_PROCESSING_REG_SHIFT */
-            op->opcode = DATA_PROCESSING_REG_SHIFT;
+            /* translates to DATA_PROCESSING_REG_SHIFT, specialized on the shift type and S bit */
+            op->opcode = uop_dp_shift_opcode(TRUE, shift_op, S);
             if (S)
                 op->flags |= UOPDPFLAGS_S_BIT;
             op->data_processing_reg_shift.dp_opcode = opcode;
@@ -740,6 +742,10 @@ void op_swap(struct uop *op)
     op->swp.mem_reg = Rn;
     op->swp.b = B;
 
+    // the counts below are taken at decode time, leave them to the cpu thread
+    if (decode_speculative)
+        return;
+
 #if COUNT_CYCLES
     // XXX cycle count
     if (get_core() == ARM7) {
@@ -773,7 +779,7 @@ void op_load_store(struct uop *op)
 
     // look for an unhandled form (user mode access)
     if (!P && W) {
-        panic_cpu("op_load_store: user mode access unhandled\n");
+        DECODE_PANIC("op_load_store: user mode access unhandled\n");
     }
 
     // look for a particular case that decodes to a very simple uop
@@ -788,7 +794,7 @@ void op_load_store(struct uop *op)
         offset = ins & 0xfff;
         if (!U)
             offset = -offset;
-        op->load_immediate.address = get_reg(PC) + offset;
+        op->load_immediate.address = decode_r15 + offset;
 
         CPU_TRACE(5, "\t\tload_store: L %d, W %d, B %d, Rd %d addr 0x%x\n",
                   L?1:0, W?1:0, B?1:0, Rd, op->load_immediate.address);
@@ -915,7 +921,7 @@ void op_misc_load_store(struct uop *op)
             if (!U)
                 offset = -offset;
 
-            op->load_immediate.address = get_reg(PC) + offset;
+            op->load_immediate.address = decode_r15 + offset;
 
             CPU_TRACE(5, "\t\tmisc_load_store: IMMEDIATE L %d, W %d, D %d, H %d, Rd %d addr 0x%x\n",
                       L?1:0, W?1:0, D?1:0, H?1:0, Rd, op->load_immediate.address);
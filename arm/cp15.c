@@ -136,7 +136,10 @@ static void op_cp15_reg_transfer(word ins, void *data)
                         goto done;
                     case 5: // various forms of ICache invalidation
                     case 7: // invalidate Icache + Dcache
-                        flush_all_codepages();
+                        if (opcode_2 == 1) // just the line at the address in Rd
+                            flush_codepage_range(get_reg(Rd), 1);
+                        else
+                            invalidate_all_codepages();
                         goto done;
                     case 6: // invalidate dcache
                         goto done;
@@ -167,10 +170,8 @@ static void op_cp15_reg_transfer(word ins, void *data)
                 switch (CRm) {
                     case 7: // unified TLB
                     case 5: // instruction TLB
-                        flush_all_codepages();
-                    // fall through
                     case 6: // data TLB
-                        mmu_invalidate_tcache();
+                        mmu_invalidate_tcache(); // codepages are checked against the new mapping as they're used
                         goto done;
                 }
             }
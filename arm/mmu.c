@@ -61,6 +61,7 @@ enum mmu_domain_check_results {
 #define TCACHE_PRESENT     0x1
 #define TCACHE_WRITE       0x2
 #define TCACHE_PRIVILEDGED 0x4
+#define TCACHE_CODE        0x8 // write entry for a page with cached code in it, see mmu_code_written()
 
 struct translation_cache_entry {
     unsigned int flags;
@@ -164,6 +165,9 @@ void mmu_invalidate_tcache(void)
 {
     int i;
 
+    /* codepages are tagged with the physical page they were loaded from */
+    unmap_all_codepages();
+
     for (i = 0; i < NUM_TCACHE_ENTRIES; i++)  {
         mmu.tcache_user_read[i].flags = 0;
     }
@@ -230,12 +234,36 @@ static void add_tcache_entry(armaddr_t vaddr, armaddr_t paddr, bool write, bool
         ent->flags |= TCACHE_WRITE;
     if (priviledged)
         ent->flags |= TCACHE_PRIVILEDGED;
+    if (write && codepage_at_paddr(paddr))
+        ent->flags |= TCACHE_CODE;
     ent->flags |= TCACHE_PRESENT;
 
 //  printf("add_tcache_entry: vaddr 0x%x paddr 0x%x write %d priviledged %d hostaddr_delta 0x%x paddr_delta 0x%x\n",
 //      vaddr, paddr, write, priviledged, ent->hostaddr_delta, ent->paddr_delta);
 }
 
+void mmu_track_code_page(armaddr_t paddr)
+{
+    int i;
+
+    /* write entries added from here on check for themselves */
+    for (i = 0; i < NUM_TCACHE_ENTRIES; i++)  {
+        if (mmu.tcache_user_write[i].vaddr + mmu.tcache_user_write[i].paddr_delta == paddr)
+            mmu.tcache_user_write[i].flags |= TCACHE_CODE;
+    }
+    for (i = 0; i < NUM_TCACHE_ENTRIES; i++)  {
+        if (mmu.tcache_priviledged_write[i].vaddr + mmu.tcache_priviledged_write[i].paddr_delta == paddr)
+            mmu.tcache_priviledged_write[i].flags |= TCACHE_CODE;
+    }
+}
+
+/* a store went through a TCACHE_CODE entry, stop checking once there's no code left in the page */
+static __NO_INLINE void mmu_code_written(struct translation_cache_entry *ent, armaddr_t address, armaddr_t len)
+{
+    if (!codepage_written(address + ent->paddr_delta, len))
+        ent->flags &= ~TCACHE_CODE;
+}
+
 static enum mmu_domain_check_results mmu_domain_check(int domain)
 {
     /* check domain permissions */
@@ -470,6 +498,65 @@ static inline struct translation_cache_entry *mmu_tcache_lookup(armaddr_t addres
     return NULL;
 }
 
+/* whole page instruction fetches, for the codepage cache */
+bool mmu_get_instruction_page(armaddr_t address, armaddr_t *paddr, const void **host, bool priviledged)
+{
+    struct translation_cache_entry *tcache_ent;
+
+    address &= ~(TCACHE_PAGESIZE-1);
+
+    mmu_inc_perf_counter(MMU_INS_FETCH);
+
+    /* do a translation lookup */
+    tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
+    if (!tcache_ent) {
+        /* do a slow lookup which will add the translation cache entry */
+        mmu_slow_translate(address, INSTRUCTION_FETCH, FALSE, priviledged);
+        if (mmu.fault)
+            return TRUE;
+
+        tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
+        ASSERT(tcache_ent != NULL);
+    }
+
+    *paddr = address + tcache_ent->paddr_delta;
+    if (tcache_ent->hostaddr_delta != 0) {
+        mmu_inc_perf_counter(MMU_FASTPATH);
+        *host = (const void *)(address + tcache_ent->hostaddr_delta);
+    } else {
+        mmu_inc_perf_counter(MMU_SLOWPATH);
+        *host = NULL;
+    }
+    return FALSE;
+}
+
+bool mmu_probe_instruction(armaddr_t address, armaddr_t *paddr, bool priviledged)
+{
+    struct translation_cache_entry *tcache_ent;
+
+    tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
+    if (tcache_ent == NULL)
+        return TRUE;
+
+    *paddr = address + tcache_ent->paddr_delta;
+    return FALSE;
+}
+
+bool mmu_probe_instruction_page(armaddr_t address, armaddr_t *paddr, const void **host, bool priviledged)
+{
+    struct translation_cache_entry *tcache_ent;
+
+    address &= ~(TCACHE_PAGESIZE-1);
+
+    tcache_ent = mmu_tcache_lookup(address, FALSE, priviledged);
+    if (tcache_ent == NULL)
+        return TRUE;
+
+    *paddr = address + tcache_ent->paddr_delta;
+    *host = (tcache_ent->hostaddr_delta != 0) ? (const void *)(address + tcache_ent->hostaddr_delta) : NULL;
+    return FALSE;
+}
+
 /* instruction fetches */
 bool mmu_read_instruction_word(armaddr_t address, word *data, bool priviledged)
 {
@@ -488,7 +575,7 @@ bool mmu_read_instruction_word(armaddr_t address, word *data, bool priviledged)
         } else {
             /* slow path, must call into system layer to get memory */
             mmu_inc_perf_counter(MMU_SLOWPATH);
-            *data = sys_read_mem_word(address);
+            *data = sys_read_mem_word(address + tcache_ent->paddr_delta);
             return FALSE;
         }
     }
@@ -678,13 +765,14 @@ bool mmu_write_mem_word(armaddr_t address, word data)
             /* fast path, can read directly from host memory */
             mmu_inc_perf_counter(MMU_FASTPATH);
             WRITE_MEM_WORD((void *)(address + tcache_ent->hostaddr_delta), data);
-            return FALSE;
         } else {
             /* slow path, must call into system layer to get memory */
             mmu_inc_perf_counter(MMU_SLOWPATH);
             sys_write_mem_word(address + tcache_ent->paddr_delta, data);
-            return FALSE;
         }
+        if (unlikely(tcache_ent->flags & TCACHE_CODE))
+            mmu_code_written(tcache_ent, address, 4);
+        return FALSE;
     }
 
     /* do a slow lookup which will add a translation cache entry for the next time */
@@ -693,6 +781,7 @@ bool mmu_write_mem_word(armaddr_t address, word data)
         return TRUE;
 
     sys_write_mem_word(address, data);
+    codepage_written(address, 4);
     return FALSE;
 }
 
@@ -720,13 +809,14 @@ bool mmu_write_mem_halfword(armaddr_t address, halfword data)
             /* fast path, can read directly from host memory */
             mmu_inc_perf_counter(MMU_FASTPATH);
             WRITE_MEM_HALFWORD((void *)(address + tcache_ent->hostaddr_delta), data);
-            return FALSE;
         } else {
             /* slow path, must call into system layer to get memory */
             mmu_inc_perf_counter(MMU_SLOWPATH);
             sys_write_mem_halfword(address + tcache_ent->paddr_delta, data);
-            return FALSE;
         }
+        if (unlikely(tcache_ent->flags & TCACHE_CODE))
+            mmu_code_written(tcache_ent, address, 2);
+        return FALSE;
     }
 
     /* do a slow lookup which will add a translation cache entry for the next time */
@@ -735,6 +825,7 @@ bool mmu_write_mem_halfword(armaddr_t address, halfword data)
         return TRUE;
 
     sys_write_mem_halfword(address, data);
+    codepage_written(address, 2);
     return FALSE;
 }
 
@@ -752,13 +843,14 @@ bool mmu_write_mem_byte(armaddr_t address, byte data)
             /* fast path, can read directly from host memory */
             mmu_inc_perf_counter(MMU_FASTPATH);
             WRITE_MEM_BYTE((void *)(address + tcache_ent->hostaddr_delta), data);
-            return FALSE;
         } else {
             /* slow path, must call into system layer to get memory */
             mmu_inc_perf_counter(MMU_SLOWPATH);
             sys_write_mem_byte(address + tcache_ent->paddr_delta, data);
-            return FALSE;
         }
+        if (unlikely(tcache_ent->flags & TCACHE_CODE))
+            mmu_code_written(tcache_ent, address, 1);
+        return FALSE;
     }
 
     /* do a slow lookup which will add a translation cache entry for the next time */
@@ -767,6 +859,7 @@ bool mmu_write_mem_byte(armaddr_t address, byte data)
         return TRUE;
 
     sys_write_mem_byte(address, data);
+    codepage_written(address, 1);
     return FALSE;
 }
 
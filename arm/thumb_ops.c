@@ -23,6 +23,7 @@
 #include <stdio.h>
 
 #include <arm/arm.h>
+#include <arm/decoder.h>
 #include <arm/mmu.h>
 #include <arm/ops.h>
 
@@ -280,7 +281,7 @@ void thumb_op_literal_load(struct uop *op)
     Rd = BITS_SHIFT(ins, 10, 8);
     immed = BITS(ins, 7, 0);
     immed *= 4;
-    addr = (get_reg(PC) & 0xfffffffc) + immed;
+    addr = (decode_r15 & 0xfffffffc) + immed;
 
     CPU_TRACE(5, "\t\tthumb_op_literal_load: Rd %d, immed %d, addr 0x%x\n",
               Rd, immed, addr);
@@ -511,8 +512,7 @@ void thumb_op_add_to_sp_pc(struct uop *op)
         op->simple_dp_imm.dest_reg = Rd;
         op->simple_dp_imm.source_reg = SP;
     } else {
-        panic_cpu("thumb_op_add_to_sp_pc unimplemented form\n");
-        put_reg(Rd, (get_reg(15) & 0xfffffffc) + immed);
+        DECODE_PANIC("thumb_op_add_to_sp_pc unimplemented form\n");
     }
 }
 
@@ -653,7 +653,7 @@ void thumb_op_conditional_branch(struct uop *op)
     immed = BITS(ins, 7, 0);
     immed <<= 1;
     immed = SIGN_EXTEND(immed, 8);
-    pc = get_reg(PC);
+    pc = decode_r15;
     target = pc + immed;
 
     CPU_TRACE(5, "\t\tthumb_op_conditional_branch: cond 0x%x, immediate %d, target %d\n", cond, immed, target);
@@ -664,7 +664,7 @@ void thumb_op_conditional_branch(struct uop *op)
     op->b_immediate.target = target;
     op->b_immediate.link_target = 0;
     op->b_immediate.target_cp = NULL;
-    if ((op->b_immediate.target >> MMU_PAGESIZE_SHIFT) == ((pc - 8) >> MMU_PAGESIZE_SHIFT))
+    if ((op->b_immediate.target >> CODEPAGE_SHIFT) == ((pc - 4) >> CODEPAGE_SHIFT))
         op->opcode = B_IMMEDIATE_LOCAL; // it's within the current codepage
     else
         op->opcode = B_IMMEDIATE; // outside the current codepage
@@ -682,7 +682,7 @@ void thumb_op_branch(struct uop *op)
     immed_11 = BITS(ins, 10, 0);
     immed_11 <<= 1;
     immed_11 = SIGN_EXTEND(immed_11, 11);
-    pc = get_reg(PC);
+    pc = decode_r15;
     target = pc + immed_11;
 
     CPU_TRACE(5, "\t\tthumb_op_branch: immediate %d, target 0x%08x\n", immed_11, target);
@@ -693,7 +693,7 @@ void thumb_op_branch(struct uop *op)
     op->b_immediate.target = target;
     op->b_immediate.link_target = 0;
     op->b_immediate.target_cp = NULL;
-    if ((op->b_immediate.target >> MMU_PAGESIZE_SHIFT) == ((pc - 8) >> MMU_PAGESIZE_SHIFT))
+    if ((op->b_immediate.target >> CODEPAGE_SHIFT) == ((pc - 4) >> CODEPAGE_SHIFT))
         op->opcode = B_IMMEDIATE_LOCAL; // it's within the current codepage
     else
         op->opcode = B_IMMEDIATE; // outside the current codepage
@@ -716,6 +716,7 @@ void thumb_op_bx_reg(struct uop *op)
     op->opcode = B_REG;
     op->flags = UOPBFLAGS_SETTHUMB_COND;
     op->b_reg.reg = Rm;
+    op->b_reg.target_cp = NULL;
 
     // if this is blx...
     if (L) {
@@ -749,7 +750,7 @@ void thumb_op_bl_blx(struct uop *op)
 
             // emit as an immediate mov to LR (r14)
             op->opcode = MOV_IMM;
-            op->simple_dp_imm.immediate = get_reg(PC) + offset;
+            op->simple_dp_imm.immediate = decode_r15 + offset;
             op->simple_dp_imm.dest_reg = LR;
             op->simple_dp_imm.source_reg = 0;
             break;
@@ -776,6 +777,6 @@ void thumb_op_bl_blx(struct uop *op)
             break;
         case 0: // invalid, covered by the unconditional branch instruction
         default:
-            panic_cpu("bad decode of bl/blx instruction\n");
+            DECODE_PANIC("bad decode of bl/blx instruction\n");
     }
 }
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <options.h>
+#include <arm/arm.h>
+
+/*
+ * Decode cache.
+ *
+ * The decoded ops of the codepages are written out to a file when the
+ * emulator exits, and the next run maps the file and takes the ops from it
+ * for any codepage it loads with the same instructions at the same address.
+ * Entries are found by the address, the instruction set and the hash of the
+ * instructions the codepage was loaded from (cp->hash), and are only used
+ * once the instructions they hold have been compared against the ones just
+ * loaded. Only the header is checked up front.
+ *
+ * The file is only good for the build that wrote it: the header holds the
+ * layout of the ops and which decode passes made them, and
+ * DECODE_CACHE_VERSION has to go up whenever a decoder changes what it
+ * makes of an instruction. A file that doesn't match is ignored, and
+ * replaced on the way out.
+ *
+ * The file is a header and then one entry after another, each made up of
+ * struct decode_cache_entry, the raw instructions a word each and the ops.
+ */
+
+bool uop_decode_cache; // set with 'decode_cache = <file>' in [cpu]
+
+#if WITH_DECODE_CACHE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DECODE_CACHE_MAGIC    'ADCC'
+#define DECODE_CACHE_VERSION  1
+#define DECODE_CACHE_MAX_SIZE (64*1024*1024) // old entries that don't fit in this are dropped
+
+struct decode_cache_header {
+    word magic;
+    word version;
+    word uop_size;
+    word num_opcodes;
+    word codepage_shift;
+    word passes; // the decode time passes that ran over the ops
+    word isa;
+    word core;
+    word count;  // entries after the header
+    word pad;
+};
+
+/* an entry in the table the file is looked up through, and the one used to drop duplicates on the way out */
+struct decode_cache_slot {
+    const struct decode_cache_entry *entry;
+    dword hash;
+    armaddr_t vaddr;
+    bool thumb;
+    bool used;
+};
+
+static struct {
+    char *path;
+
+    // the file from the last run
+    void *map;
+    size_t map_size;
+    unsigned int count;
+    struct decode_cache_slot *index;
+    unsigned int index_size;
+
+    // the one being written
+    FILE *out;
+    char *out_path;
+    size_t out_size;
+    unsigned int out_count;
+    struct decode_cache_slot *seen;
+    unsigned int seen_size;
+} dcache;
+
+static void decode_cache_fill_header(struct decode_cache_header *header, unsigned int count)
+{
+    memset(header, 0, sizeof(*header));
+    header->magic = DECODE_CACHE_MAGIC;
+    header->version = DECODE_CACHE_VERSION;
+    header->uop_size = sizeof(struct uop);
+    header->num_opcodes = MAX_UOP_OPCODE;
+    header->codepage_shift = CODEPAGE_SHIFT;
+    header->passes = (DEAD_FLAGS_PASS ? 1 : 0) | (FUSE_UOPS ? 2 : 0) | (COND_RUNS ? 4 : 0);
+    header->isa = get_isa();
+    header->core = get_core();
+    header->count = count;
+}
+
+static size_t decode_cache_entry_size(bool thumb)
+{
+    unsigned int count = thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM;
+
+    return sizeof(struct decode_cache_entry) + count * (sizeof(word) + sizeof(struct uop));
+}
+
+/* the slot for the key in a table, or the free one it would go into */
+static struct decode_cache_slot *decode_cache_slot(struct decode_cache_slot *table, unsigned int size,
+        dword hash, armaddr_t vaddr, bool thumb)
+{
+    unsigned int i = (unsigned int)(hash ^ (hash >> 32) ^ vaddr ^ thumb) & (size - 1);
+
+    while (table[i].used && (table[i].hash != hash || table[i].vaddr != vaddr || table[i].thumb != thumb))
+        i = (i + 1) & (size - 1);
+
+    return &table[i];
+}
+
+static unsigned int decode_cache_table_size(unsigned int count)
+{
+    unsigned int size = 64;
+
+    while (size < count * 2)
+        size *= 2;
+
+    return size;
+}
+
+/* map the file and index its entries, leaving everything empty if it isn't there or isn't for this build */
+static void decode_cache_map(void)
+{
+    struct decode_cache_header expected;
+    const struct decode_cache_header *header;
+    const byte *ptr, *end;
+    struct stat st;
+    unsigned int count, i;
+    int fd;
+
+    fd = open(dcache.path, O_RDONLY);
+    if (fd < 0)
+        return; // nothing saved yet
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct decode_cache_header)) {
+        close(fd);
+        return;
+    }
+
+    dcache.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (dcache.map == MAP_FAILED) {
+        dcache.map = NULL;
+        return;
+    }
+    dcache.map_size = st.st_size;
+
+    header = dcache.map;
+    decode_cache_fill_header(&expected, header->count);
+    if (memcmp(header, &expected, sizeof(expected))) {
+        printf("decode cache '%s' was written by a different build, not using it\n", dcache.path);
+        munmap(dcache.map, dcache.map_size);
+        dcache.map = NULL;
+        return;
+    }
+
+    // no more than could fit in the file
+    count = header->count;
+    if (count > (dcache.map_size - sizeof(*header)) / decode_cache_entry_size(FALSE))
+        count = (dcache.map_size - sizeof(*header)) / decode_cache_entry_size(FALSE);
+
+    dcache.index_size = decode_cache_table_size(count);
+    dcache.index = calloc(dcache.index_size, sizeof(struct decode_cache_slot));
+    if (dcache.index == NULL) {
+        munmap(dcache.map, dcache.map_size);
+        dcache.map = NULL;
+        return;
+    }
+
+    // a short file just has fewer entries
+    ptr = (const byte *)dcache.map + sizeof(struct decode_cache_header);
+    end = (const byte *)dcache.map + dcache.map_size;
+    for (i = 0; i < count; i++) {
+        const struct decode_cache_entry *e = (const struct decode_cache_entry *)ptr;
+        struct decode_cache_slot *slot;
+
+        if ((size_t)(end - ptr) < sizeof(*e) || e->thumb > 1 || (size_t)(end - ptr) < decode_cache_entry_size(e->thumb))
+            break;
+
+        slot = decode_cache_slot(dcache.index, dcache.index_size, e->hash, e->vaddr, e->thumb);
+        if (!slot->used) {
+            slot->entry = e;
+            slot->hash = e->hash;
+            slot->vaddr = e->vaddr;
+            slot->thumb = e->thumb;
+            slot->used = TRUE;
+        }
+        ptr += decode_cache_entry_size(e->thumb);
+    }
+    dcache.count = i;
+
+    UOP_TRACE(2, "decode cache '%s': %u entries\n", dcache.path, dcache.count);
+}
+
+void uop_set_decode_cache(const char *path)
+{
+    if (path == NULL || path[0] == '\0' || uop_decode_cache)
+        return;
+
+    dcache.path = strdup(path);
+    if (dcache.path == NULL)
+        return;
+
+    decode_cache_map();
+
+    // written back from the cpu thread on the way out
+    atexit(&uop_save_decode_cache);
+    uop_decode_cache = TRUE;
+}
+
+/* the entry saved for the instructions with this hash at vaddr, NULL if there isn't one */
+const struct decode_cache_entry *decode_cache_find(armaddr_t vaddr, bool thumb, dword hash)
+{
+    struct decode_cache_slot *slot;
+
+    if (dcache.index == NULL)
+        return NULL;
+
+    slot = decode_cache_slot(dcache.index, dcache.index_size, hash, vaddr, thumb);
+
+    return slot->used ? slot->entry : NULL;
+}
+
+/* start writing a new file next to the old one, for up to count codepages */
+bool decode_cache_save_begin(unsigned int count)
+{
+    struct decode_cache_header header;
+    size_t len = strlen(dcache.path) + sizeof(".tmp");
+
+    dcache.out_path = malloc(len);
+    if (dcache.out_path == NULL)
+        return FALSE;
+    snprintf(dcache.out_path, len, "%s.tmp", dcache.path);
+
+    dcache.seen_size = decode_cache_table_size(count + dcache.count);
+    dcache.seen = calloc(dcache.seen_size, sizeof(struct decode_cache_slot));
+    dcache.out = fopen(dcache.out_path, "wb");
+    if (dcache.seen == NULL || dcache.out == NULL) {
+        printf("could not write decode cache '%s'\n", dcache.out_path);
+        if (dcache.out != NULL)
+            fclose(dcache.out);
+        free(dcache.seen);
+        free(dcache.out_path);
+        return FALSE;
+    }
+
+    // the count is filled in at the end
+    decode_cache_fill_header(&header, 0);
+    fwrite(&header, sizeof(header), 1, dcache.out);
+    dcache.out_size = sizeof(header);
+    dcache.out_count = 0;
+
+    return TRUE;
+}
+
+static void decode_cache_write(const struct decode_cache_entry *e, const word *raw, const struct uop *ops)
+{
+    unsigned int count = e->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM;
+    struct decode_cache_slot *slot;
+
+    if (dcache.out_size + decode_cache_entry_size(e->thumb) > DECODE_CACHE_MAX_SIZE)
+        return;
+
+    // the same instructions loaded at the same address twice, or again from the old file
+    slot = decode_cache_slot(dcache.seen, dcache.seen_size, e->hash, e->vaddr, e->thumb);
+    if (slot->used)
+        return;
+    slot->hash = e->hash;
+    slot->vaddr = e->vaddr;
+    slot->thumb = e->thumb;
+    slot->used = TRUE;
+
+    fwrite(e, sizeof(*e), 1, dcache.out);
+    fwrite(raw, sizeof(word), count, dcache.out);
+    fwrite(ops, sizeof(struct uop), count, dcache.out);
+    dcache.out_size += decode_cache_entry_size(e->thumb);
+    dcache.out_count++;
+}
+
+/* add a codepage, raw being the instructions it was loaded from */
+void decode_cache_save(const struct uop_codepage *cp, const word *raw)
+{
+    static struct uop ops[NUM_CODEPAGE_INS_THUMB];
+    unsigned int count = cp->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM;
+    struct decode_cache_entry e;
+    unsigned int i;
+
+    // the codepages the branches went to last are only good for this run
+    memcpy(ops, cp->ops, count * sizeof(struct uop));
+    for (i = 0; i < count; i++) {
+        if (ops[i].opcode == B_IMMEDIATE)
+            ops[i].b_immediate.target_cp = NULL;
+        else if (ops[i].opcode == B_REG)
+            ops[i].b_reg.target_cp = NULL;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.hash = cp->hash;
+    e.decoded = cp->decoded;
+    e.vaddr = cp->vaddr;
+    e.thumb = cp->thumb;
+    decode_cache_write(&e, raw, ops);
+}
+
+/* carry over what's left of the old file and put the new one in its place */
+void decode_cache_save_end(void)
+{
+    struct decode_cache_header header;
+    const byte *ptr;
+    unsigned int i;
+    bool failed;
+
+    ptr = (const byte *)dcache.map + sizeof(struct decode_cache_header);
+    for (i = 0; i < dcache.count; i++) {
+        const struct decode_cache_entry *e = (const struct decode_cache_entry *)ptr;
+        unsigned int count = e->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM;
+
+        decode_cache_write(e, DECODE_CACHE_RAW(e), DECODE_CACHE_OPS(e, count));
+        ptr += decode_cache_entry_size(e->thumb);
+    }
+
+    decode_cache_fill_header(&header, dcache.out_count);
+    fseek(dcache.out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, dcache.out);
+
+    failed = ferror(dcache.out) != 0;
+    if (fclose(dcache.out) != 0)
+        failed = TRUE;
+    if (failed || rename(dcache.out_path, dcache.path) < 0) {
+        printf("could not write decode cache '%s'\n", dcache.out_path);
+        unlink(dcache.out_path);
+    } else {
+        UOP_TRACE(2, "decode cache '%s': saved %u entries\n", dcache.path, dcache.out_count);
+    }
+
+    free(dcache.seen);
+    free(dcache.out_path);
+    dcache.seen = NULL;
+    dcache.out = NULL;
+}
+
+#else
+
+void uop_set_decode_cache(const char *path)
+{
+    if (path != NULL && path[0] != '\0')
+        printf("decode cache not built in, ignoring '%s'\n", path);
+}
+
+#endif
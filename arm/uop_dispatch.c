@@ -25,10 +25,12 @@
 #include <stdlib.h>
 #include <debug.h>
 #include <options.h>
+#include <sys/sys.h>
 #include <arm/arm.h>
 #include <arm/decoder.h>
 #include <util/atomic.h>
 #include <util/math.h>
+#include <util/endian.h>
 
 #define ASSERT_VALID_REG(x) ASSERT((x) < 16);
 
@@ -148,12 +150,82 @@
             break; \
     }
 
+static bool uop_use_jit;
+
+/* cleared by the fast dispatch variant, see uop_set_dispatch() */
+bool uop_count_cycles = TRUE;
+
+#if COUNT_CYCLES
+#define UOP_COUNT_CYCLES(n) do { if (uop_count_cycles) add_to_perf_counter(CYCLE_COUNT, n); } while (0)
+#else
+#define UOP_COUNT_CYCLES(n) do { } while (0)
+#endif
+
+/*
+ * Handlers are inlined into the dispatch loop, except for the rare ones,
+ * which are kept out of line along with the rare paths of the common ones
+ * so the loop stays small enough for the host's L1 icache. 'make
+ * handler-sizes' builds with UOP_HANDLER_SIZES set, which moves all of
+ * them out of line to get the size of each one.
+ */
+#if UOP_HANDLER_SIZES
+#define __UOP_HANDLER __NO_INLINE
+#else
+#define __UOP_HANDLER inline __ALWAYS_INLINE
+#endif
+#define __UOP_COLD_HANDLER __NO_INLINE __COLD
+
 void uop_init(void)
 {
-    memset(cpu.codepage_hash, 0, sizeof(cpu.codepage_hash));
+    memset(cpu.codepage_dir, 0, sizeof(cpu.codepage_dir));
     cpu.curr_cp = NULL;
 }
 
+static int uop_dispatch_loop_fast(void);
+static int uop_dispatch_loop_count(void);
+static int uop_dispatch_loop_trace(void);
+
+static int (*uop_dispatch_variant)(void) = &uop_dispatch_loop_count;
+
+/*
+ * Pick which instance of the dispatch loop to run:
+ * fast  - no cycle counting and no per op tracing or stats
+ * count - count cycles, and whatever COUNT_UOPS/COUNT_ARM_OPS compiled in (default)
+ * trace - count, and honor the per op trace levels (uop level 8, cpu level 10)
+ */
+void uop_set_dispatch(const char *variant)
+{
+    if (!strcmp(variant, "fast")) {
+        uop_dispatch_variant = &uop_dispatch_loop_fast;
+        uop_count_cycles = FALSE;
+        return;
+    }
+
+    uop_count_cycles = TRUE;
+    if (!strcmp(variant, "trace")) {
+        uop_dispatch_variant = &uop_dispatch_loop_trace;
+    } else {
+        if (strcmp(variant, "count"))
+            printf("unknown dispatch variant '%s', using count\n", variant);
+        uop_dispatch_variant = &uop_dispatch_loop_count;
+    }
+}
+
+void uop_set_engine(const char *engine)
+{
+    if (!strcmp(engine, "jit")) {
+#if WITH_JIT
+        if (jit_init() >= 0) {
+            uop_use_jit = TRUE;
+            return;
+        }
+#endif
+        printf("jit not available on this host, falling back to the interpreter\n");
+    } else if (strcmp(engine, "interp")) {
+        printf("unknown cpu engine '%s', using the interpreter\n", engine);
+    }
+}
+
 const char *uop_opcode_to_str(int opcode)
 {
 #define OP_TO_STR(op) case op: return #op
@@ -183,6 +255,9 @@ const char *uop_opcode_to_str(int opcode)
             OP_TO_STR(DATA_PROCESSING_REG_S);
             OP_TO_STR(DATA_PROCESSING_IMM_SHIFT);
             OP_TO_STR(DATA_PROCESSING_REG_SHIFT);
+#define DP_SHIFT_UOP_TO_STR(opcode, handler, form, shift, s) OP_TO_STR(opcode);
+            DP_SHIFT_UOP_LIST(DP_SHIFT_UOP_TO_STR)
+#undef DP_SHIFT_UOP_TO_STR
             OP_TO_STR(MOV_IMM);
             OP_TO_STR(MOV_IMM_NZ);
             OP_TO_STR(MOV_REG);
@@ -232,16 +307,55 @@ const char *uop_opcode_to_str(int opcode)
             OP_TO_STR(COPROC_DOUBLE_REG_TRANSFER);
             OP_TO_STR(COPROC_DATA_PROCESSING);
             OP_TO_STR(COPROC_LOAD_STORE);
+            OP_TO_STR(CMP_IMM_BRANCH_LOCAL);
+            OP_TO_STR(CMP_REG_BRANCH_LOCAL);
+            OP_TO_STR(ADD_IMM_S_BRANCH_LOCAL);
+            OP_TO_STR(LOAD_ADD_IMM);
+            OP_TO_STR(MOV_IMM_MOV);
+            OP_TO_STR(MOV_REG_MOV);
         default:
             return "UNKNOWN";
     }
 #undef OP_TO_STR
 }
 
-/* codepage cache */
+/*
+ * Codepage cache. Codepages are carved out of chunks of CP_PREALLOCATE at a
+ * time, and the chunks are never given back, so a pointer to a codepage
+ * always points at one, if maybe not the one it was cached for. Once the
+ * chunks add up to the budget set with uop_set_codecache_size() a new
+ * codepage is made by evicting an old one of the same kind, picked by a
+ * clock sweep over every codepage slot. The budget can be overshot by a
+ * chunk for a kind (arm or thumb) that has no slots to evict from.
+ */
+#define CP_PREALLOCATE (16 << (MMU_PAGESIZE_SHIFT - CODEPAGE_SHIFT))
+#define ARM_CP_SIZE (sizeof(struct uop_codepage) + sizeof(struct uop) * (NUM_CODEPAGE_INS_ARM + 1))
+#define THUMB_CP_SIZE (sizeof(struct uop_codepage) + sizeof(struct uop) * (NUM_CODEPAGE_INS_THUMB + 1))
+
+#define CP_NO_ADDRESS 1 // never a codepage address, marks a free slot or one that isn't mapped
+
+static struct codecache {
+    size_t size;    // bytes in chunks
+    size_t budget;  // 0 for no limit
+
+    struct uop_codepage **slots; // every codepage ever allocated
+    unsigned int slot_count;
+    unsigned int slot_max;
+    unsigned int hand;           // of the clock
+
+    unsigned int epoch; // bumped by every icache invalidate, see invalidate_all_codepages()
+} codecache;
+
+void uop_set_codecache_size(int mb)
+{
+    codecache.budget = (mb > 0) ? (size_t)mb * 1024 * 1024 : 0;
+}
+
 static void free_codepage(struct uop_codepage *cp)
 {
-    UOP_TRACE(7, "free_codepage: cp %p, thumb %d, address 0x%x\n", cp, cp->thumb, cp->address);
+    UOP_TRACE(7, "free_codepage: cp %p, thumb %d, address 0x%x\n", cp, cp->thumb, cp->vaddr);
+    cp->address = CP_NO_ADDRESS;
+    cp->vaddr = CP_NO_ADDRESS;
     if (cp->thumb) {
         cp->next = cpu.free_cp_thumb;
         cpu.free_cp_thumb = cp;
@@ -251,187 +365,413 @@ static void free_codepage(struct uop_codepage *cp)
     }
 }
 
-#define CP_PREALLOCATE 16
-#define ARM_CP_SIZE (sizeof(struct uop_codepage) + sizeof(struct uop) * (NUM_CODEPAGE_INS_ARM + 1))
-#define THUMB_CP_SIZE (sizeof(struct uop_codepage) + sizeof(struct uop) * (NUM_CODEPAGE_INS_THUMB + 1))
+static bool evict_codepage(bool thumb);
 
-static struct uop_codepage *alloc_codepage_arm(void)
+/* carve a new chunk of codepages, returns FALSE if out of memory */
+static bool grow_codepages(bool thumb)
 {
+    size_t cp_size = thumb ? THUMB_CP_SIZE : ARM_CP_SIZE;
+    uint8_t *cp_buf;
+    int i;
+
+    if (codecache.slot_count + CP_PREALLOCATE > codecache.slot_max) {
+        unsigned int max = codecache.slot_max ? codecache.slot_max * 2 : 256;
+        struct uop_codepage **slots = realloc(codecache.slots, max * sizeof(struct uop_codepage *));
+        if (slots == NULL)
+            return FALSE;
+        codecache.slots = slots;
+        codecache.slot_max = max;
+    }
+
+    cp_buf = malloc(cp_size * CP_PREALLOCATE);
+    if (cp_buf == NULL)
+        return FALSE;
+    codecache.size += cp_size * CP_PREALLOCATE;
+
+    for (i=0; i < CP_PREALLOCATE; i++) {
+        struct uop_codepage *cp = (struct uop_codepage *)(cp_buf + (i * cp_size));
+
+        cp->thumb = thumb;
+        cp->pc_inc = thumb ? 2 : 4;
+        cp->pc_shift = thumb ? 1 : 2;
+        cp->referenced = FALSE;
+#if WITH_JIT
+        cp->jit_entry = NULL;
+        cp->jit_chain_in = NULL;
+#endif
+        codecache.slots[codecache.slot_count++] = cp;
+        free_codepage(cp);
+    }
+
+    return TRUE;
+}
+
+static struct uop_codepage *alloc_codepage(bool thumb)
+{
+    struct uop_codepage **free_cp = thumb ? &cpu.free_cp_thumb : &cpu.free_cp_arm;
     struct uop_codepage *cp;
 
-    if (cpu.free_cp_arm == NULL) {
-        int i;
+    if (*free_cp == NULL) {
+        bool full = codecache.budget != 0 &&
+            codecache.size + (thumb ? THUMB_CP_SIZE : ARM_CP_SIZE) * CP_PREALLOCATE > codecache.budget;
 
-        uint8_t *cp_buf = malloc(ARM_CP_SIZE * CP_PREALLOCATE);
-        if (cp_buf == NULL)
+        if (!(full && evict_codepage(thumb)) && !grow_codepages(thumb))
             return NULL;
-
-        for (i=0; i < CP_PREALLOCATE; i++) {
-            cp = (struct uop_codepage *)(cp_buf + (i * ARM_CP_SIZE));
-            cp->thumb = FALSE;
-            cp->pc_inc = 4;
-            cp->pc_shift = 2;
-            free_codepage(cp);
-        }
     }
 
-    ASSERT(cpu.free_cp_arm != NULL);
-    cp = cpu.free_cp_arm;
-    cpu.free_cp_arm = cp->next;
+    ASSERT(*free_cp != NULL);
+    cp = *free_cp;
+    *free_cp = cp->next;
     cp->next = NULL;
+    cp->referenced = TRUE;
 
-    ASSERT(cp->thumb == FALSE);
+    ASSERT(cp->thumb == thumb);
 
     return cp;
 }
 
-static struct uop_codepage *alloc_codepage_thumb(void)
+#define PC_TO_CPPC(pc) &cpu.curr_cp->ops[((pc) % CODEPAGE_SIZE) >> (cpu.curr_cp->pc_shift)];
+
+/*
+ * Codepages are found through a two level table per instruction set. The
+ * address bits from CODEPAGE_DIR_SHIFT up index the directory, and the bits
+ * from CODEPAGE_SHIFT up to CODEPAGE_DIR_SHIFT the table of codepages under
+ * it. Tables are only allocated for the regions of the directory that have
+ * had code run in them, and are kept until the emulator exits.
+ *
+ * Each entry is a chain of the codepages loaded from that virtual address,
+ * one per physical page it was mapped to, so the same address in different
+ * processes gets its own codepage and each survives switching between them.
+ * Whenever the mmu translation may have changed, unmap_all_codepages()
+ * marks them all as unmapped (address is CP_NO_ADDRESS). The first lookup
+ * after that checks the chain against the current translation and moves
+ * the one that matches to the front with its address back. Only the front
+ * of a chain is ever mapped.
+ */
+#define CODEPAGE_TABLE_INDEX(address) (((address) >> CODEPAGE_SHIFT) % CODEPAGE_TABLE_SIZE)
+
+/* where the chain of codepages for address starts, allocating the table for it if need be */
+static struct uop_codepage **codepage_slot(armaddr_t address, bool thumb)
 {
-    struct uop_codepage *cp;
+    struct uop_codepage ***table = &cpu.codepage_dir[thumb][address >> CODEPAGE_DIR_SHIFT];
 
-    if (cpu.free_cp_thumb == NULL) {
-        int i;
+    if (*table == NULL) {
+        *table = calloc(CODEPAGE_TABLE_SIZE, sizeof(struct uop_codepage *));
+        if (*table == NULL)
+            panic_cpu("could not allocate new codepage table!\n");
+    }
 
-        uint8_t *cp_buf = malloc(THUMB_CP_SIZE * CP_PREALLOCATE);
-        if (cp_buf == NULL)
-            return NULL;
+    return &(*table)[CODEPAGE_TABLE_INDEX(address)];
+}
 
-        for (i=0; i < CP_PREALLOCATE; i++) {
-            cp = (struct uop_codepage *)(cp_buf + (i * THUMB_CP_SIZE));
-            cp->thumb = TRUE;
-            cp->pc_inc = 2;
-            cp->pc_shift = 1;
-            free_codepage(cp);
-        }
+/* same for the chain of codepages of either kind loaded from the physical page paddr */
+static struct uop_codepage **codepage_pslot(armaddr_t paddr)
+{
+    struct uop_codepage ***table = &cpu.codepage_pdir[paddr >> CODEPAGE_DIR_SHIFT];
+
+    if (*table == NULL) {
+        *table = calloc(CODEPAGE_TABLE_SIZE, sizeof(struct uop_codepage *));
+        if (*table == NULL)
+            panic_cpu("could not allocate new codepage table!\n");
     }
 
-    ASSERT(cpu.free_cp_thumb != NULL);
-    cp = cpu.free_cp_thumb;
-    cpu.free_cp_thumb = cp->next;
-    cp->next = NULL;
+    return &(*table)[CODEPAGE_TABLE_INDEX(paddr)];
+}
 
-    ASSERT(cp->thumb == TRUE);
-    return cp;
+/*
+ * Hash of one instruction at index in a codepage. A codepage's hash is the sum
+ * of these over the whole page, so it can be kept up to date one instruction
+ * at a time. Changing any one instruction always changes the sum.
+ */
+static inline dword codepage_hash_ins(word ins, unsigned int index)
+{
+    dword x = ins | ((dword)index << 32);
+
+    x ^= x >> 29;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 32;
+    return x;
 }
 
-#define PC_TO_CPPC(pc) &cpu.curr_cp->ops[((pc) % MMU_PAGESIZE) >> (cpu.curr_cp->pc_shift)];
+/* is the page in memory still what cp was loaded from */
+static bool codepage_unchanged(struct uop_codepage *cp)
+{
+    const byte *host = sys_get_mem_ptr(cp->paddr);
+    dword hash = 0;
+    unsigned int i;
+
+    if (cp->thumb) {
+        for (i = 0; i < NUM_CODEPAGE_INS_THUMB; i++)
+            hash += codepage_hash_ins(host ? READ_MEM_HALFWORD(host + i*2) : sys_read_mem_halfword(cp->paddr + i*2), i);
+    } else {
+        for (i = 0; i < NUM_CODEPAGE_INS_ARM; i++)
+            hash += codepage_hash_ins(host ? READ_MEM_WORD(host + i*4) : sys_read_mem_word(cp->paddr + i*4), i);
+    }
+
+    return hash == cp->hash;
+}
 
-static inline unsigned int codepage_hash(armaddr_t address, bool thumb)
+static void remove_codepage(struct uop_codepage *cp);
+
+/*
+ * Find the codepage in the chain at slot that was loaded from paddr, and map
+ * it. A codepage from before the last icache invalidate is checked against
+ * memory first, and thrown away if it changed.
+ */
+static struct uop_codepage *map_codepage(struct uop_codepage **slot, armaddr_t paddr)
 {
-    unsigned int hash = (address / MMU_PAGESIZE);
-    if (thumb)
-        hash = ~hash; // XXX come up with something better
-    return hash % CODEPAGE_HASHSIZE;
+    struct uop_codepage *cp, **prev;
+
+    for (prev = slot; (cp = *prev) != NULL; prev = &cp->next) {
+        if (cp->paddr == (paddr & ~(CODEPAGE_SIZE-1))) {
+            if (cp->epoch != codecache.epoch) {
+                if (!codepage_unchanged(cp)) {
+                    UOP_TRACE(5, "map_codepage: cp %p, address 0x%x changed\n", cp, cp->vaddr);
+                    remove_codepage(cp);
+                    return NULL;
+                }
+                cp->epoch = codecache.epoch;
+            }
+            *prev = cp->next;
+            cp->next = *slot;
+            *slot = cp;
+            cp->address = cp->vaddr;
+            return cp;
+        }
+    }
+
+    return NULL;
 }
 
 static struct uop_codepage *lookup_codepage(armaddr_t pc, bool thumb)
 {
-    armaddr_t cp_addr = pc & ~(MMU_PAGESIZE-1);
-    unsigned int hash;
+    struct uop_codepage **table = cpu.codepage_dir[thumb][pc >> CODEPAGE_DIR_SHIFT];
     struct uop_codepage *cp;
+    armaddr_t paddr;
 
-    hash = codepage_hash(cp_addr, thumb);
+    if (table == NULL)
+        return NULL;
 
-    // search the hash chain for our codepage
-    cp = cpu.codepage_hash[hash];
-    while (cp != NULL) {
-        if (cp->address == cp_addr && cp->thumb == thumb)
-            return cp;
-        cp = cp->next;
+    cp = table[CODEPAGE_TABLE_INDEX(pc)];
+    if (cp == NULL)
+        return NULL;
+
+    if (unlikely(cp->address == CP_NO_ADDRESS)) {
+        // the mapping changed since it was last used, if it isn't in the tlb let load_codepage() fault it in
+        if (mmu_probe_instruction(pc, &paddr, arm_in_priviledged()))
+            return NULL;
+        cp = map_codepage(&table[CODEPAGE_TABLE_INDEX(pc)], paddr);
+        if (cp == NULL)
+            return NULL;
     }
 
-    return NULL;
+    inc_perf_counter(CODEPAGE_HIT);
+    cp->referenced = TRUE;
+
+    return cp;
 }
 
-static bool load_codepage_arm(armaddr_t pc, armaddr_t cp_addr, bool priviledged, struct uop_codepage **_cp, int *last_ins_index)
+/*
+ * Fill in a new codepage from the page at paddr, which is at host in host
+ * memory if it is plain memory. Every op starts out as a copy of the same
+ * undecoded op with the instruction dropped in, and the hash is summed up on
+ * the way through.
+ */
+static struct uop_codepage *load_codepage_arm(armaddr_t cp_addr, armaddr_t paddr, const byte *host, int *last_ins_index)
 {
+    const struct uop undecoded = {
+        .opcode = DECODE_ME_ARM,
+        .cond = COND_AL,
+        .reads_pc = TRUE, // the decoders read r15
+    };
     struct uop_codepage *cp;
+    dword hash = 0;
     int i;
 
-    cp = alloc_codepage_arm();
+    cp = alloc_codepage(FALSE);
     if (!cp)
         panic_cpu("could not allocate new codepage!\n");
 
-    // load and fill in the default codepage
     cp->address = cp_addr;
     for (i=0; i < NUM_CODEPAGE_INS_ARM; i++) {
-        cp->ops[i].opcode = DECODE_ME_ARM;
-        cp->ops[i].cond = COND_AL;
-        cp->ops[i].flags = 0;
-        if (mmu_read_instruction_word(cp_addr + i*4, &cp->ops[i].undecoded.raw_instruction, priviledged)) {
-            UOP_TRACE(4, "load_codepage: mmu translation made arm codepage load fail\n");
-            free(cp);
-            return TRUE;
-        }
+        word ins = host ? READ_MEM_WORD(host + i*4) : sys_read_mem_word(paddr + i*4);
+
+        cp->ops[i] = undecoded;
+        cp->ops[i].undecoded.raw_instruction = ins;
+        hash += codepage_hash_ins(ins, i);
     }
+    cp->hash = hash;
     *last_ins_index = NUM_CODEPAGE_INS_ARM;
 
-    *_cp = cp;
-
-    return FALSE;
+    return cp;
 }
 
-static bool load_codepage_thumb(armaddr_t pc, armaddr_t cp_addr, bool priviledged, struct uop_codepage **_cp, int *last_ins_index)
+static struct uop_codepage *load_codepage_thumb(armaddr_t cp_addr, armaddr_t paddr, const byte *host, int *last_ins_index)
 {
+    const struct uop undecoded = {
+        .opcode = DECODE_ME_THUMB,
+        .cond = COND_AL,
+        .reads_pc = TRUE, // the decoders read r15
+    };
     struct uop_codepage *cp;
+    dword hash = 0;
     int i;
 
-    cp = alloc_codepage_thumb();
+    cp = alloc_codepage(TRUE);
     if (!cp)
         panic_cpu("could not allocate new codepage!\n");
 
-    // load and fill in the default codepage
     cp->address = cp_addr;
     for (i=0; i < NUM_CODEPAGE_INS_THUMB; i++) {
-        halfword hword;
-
-        cp->ops[i].opcode = DECODE_ME_THUMB;
-        cp->ops[i].cond = COND_AL;
-        cp->ops[i].flags = 0;
-        if (mmu_read_instruction_halfword(cp_addr + i*2, &hword, priviledged)) {
-            UOP_TRACE(4, "load_codepage: mmu translation made thumb codepage load fail\n");
-            free(cp);
-            return TRUE;
-        }
-        cp->ops[i].undecoded.raw_instruction = hword;
+        halfword ins = host ? READ_MEM_HALFWORD(host + i*2) : sys_read_mem_halfword(paddr + i*2);
+
+        cp->ops[i] = undecoded;
+        cp->ops[i].undecoded.raw_instruction = ins;
+        hash += codepage_hash_ins(ins, i);
     }
+    cp->hash = hash;
     *last_ins_index = NUM_CODEPAGE_INS_THUMB;
 
-    *_cp = cp;
+    return cp;
+}
 
-    return FALSE;
+#if WITH_DECODE_CACHE
+/* the same instructions were loaded at the same address in an earlier run, take the ops it decoded */
+static void decode_cache_fill(struct uop_codepage *cp)
+{
+    int count = cp->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM;
+    const struct decode_cache_entry *e;
+    const word *raw;
+    int i;
+
+    e = decode_cache_find(cp->vaddr, cp->thumb, cp->hash);
+    if (e == NULL)
+        return;
+
+    raw = DECODE_CACHE_RAW(e);
+    for (i = 0; i < count; i++) {
+        if (cp->ops[i].undecoded.raw_instruction != raw[i])
+            return;
+    }
+
+    UOP_TRACE(5, "decode_cache_fill: cp %p, address 0x%x\n", cp, cp->vaddr);
+    memcpy(cp->ops, DECODE_CACHE_OPS(e, count), count * sizeof(struct uop));
+    cp->decoded = e->decoded;
+    inc_perf_counter(CODEPAGE_CACHED);
 }
+#endif
 
-static bool load_codepage(armaddr_t pc, bool thumb, bool priviledged, struct uop_codepage **_cp)
+/* load a new codepage for cp_addr from paddr, and put it at the front of the chain in slot */
+static struct uop_codepage *new_codepage(struct uop_codepage **slot, armaddr_t cp_addr, bool thumb, armaddr_t paddr, const void *host)
 {
-    armaddr_t cp_addr = pc & ~(MMU_PAGESIZE-1);
-    struct uop_codepage *cp;
-    unsigned int hash;
+    struct uop_codepage *cp, **pslot;
     int last_ins_index;
-    bool ret;
 
-    UOP_TRACE(4, "load_codepage: pc 0x%x\n", pc);
+    inc_perf_counter(CODEPAGE_MISS);
 
     // load and fill in the appropriate codepage
     if (thumb)
-        ret = load_codepage_thumb(pc, cp_addr, priviledged, &cp, &last_ins_index);
+        cp = load_codepage_thumb(cp_addr, paddr, host, &last_ins_index);
     else
-        ret = load_codepage_arm(pc, cp_addr, priviledged, &cp, &last_ins_index);
-    if (ret)
-        return TRUE; // there was some sort of error loading the new codepage
+        cp = load_codepage_arm(cp_addr, paddr, host, &last_ins_index);
+
+#if WITH_JIT
+    cp->jit_entry = NULL;
+    cp->jit_gen = 0;
+    cp->jit_stale = FALSE;
+    cp->jit_chain_in = NULL;
+#endif
 
     // fill in the last instruction to branch to next codepage
     cp->ops[last_ins_index].opcode = B_IMMEDIATE;
     cp->ops[last_ins_index].cond = COND_AL;
     cp->ops[last_ins_index].flags = 0;
-    cp->ops[last_ins_index].b_immediate.target = cp->address + MMU_PAGESIZE;
+    cp->ops[last_ins_index].cond_run = 0;
+    cp->ops[last_ins_index].reads_pc = FALSE;
+    cp->ops[last_ins_index].b_immediate.target = cp->address + CODEPAGE_SIZE;
     cp->ops[last_ins_index].b_immediate.link_target = 0;
     cp->ops[last_ins_index].b_immediate.target_cp = NULL;
 
-    // add it to the codepage hashtable
-    hash = codepage_hash(cp_addr, thumb);
-    cp->next = cpu.codepage_hash[hash];
-    cpu.codepage_hash[hash] = cp;
+    // add it to the front of the chain for its address, anything else there is unmapped
+    cp->vaddr = cp_addr;
+    cp->paddr = paddr;
+    cp->next = *slot;
+    *slot = cp;
+
+    // and have stores to the physical page checked against it
+    cp->decoded = 0;
+    cp->epoch = codecache.epoch;
+    if (!codepage_at_paddr(cp->paddr))
+        mmu_track_code_page(cp->paddr & ~(MMU_PAGESIZE-1));
+    pslot = codepage_pslot(cp->paddr);
+    cp->pnext = *pslot;
+    *pslot = cp;
+
+#if WITH_DECODE_CACHE
+    if (uop_decode_cache)
+        decode_cache_fill(cp);
+#endif
+
+    return cp;
+}
+
+#if WITH_PREDECODE
+/*
+ * Hand a codepage that was just loaded over to the predecode thread, if
+ * there is room for it. Otherwise it's decoded as it runs like always.
+ */
+static void queue_predecode(struct uop_codepage *cp, bool follow)
+{
+    struct uop_predecode *p = predecode_slot();
+
+    if (p == NULL)
+        return;
+
+    p->cp = cp;
+    p->address = cp->vaddr;
+    p->thumb = cp->thumb;
+    p->follow = follow;
+    memcpy(p->ops, cp->ops, (cp->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM) * sizeof(struct uop));
+    predecode_queue();
+}
+#endif
+
+static bool load_codepage(armaddr_t pc, bool thumb, bool priviledged, struct uop_codepage **_cp)
+{
+    armaddr_t cp_addr = pc & ~(CODEPAGE_SIZE-1);
+    struct uop_codepage *cp, **slot;
+    armaddr_t paddr;
+    const void *host;
+
+    UOP_TRACE(4, "load_codepage: pc 0x%x\n", pc);
+
+    if (mmu_get_instruction_page(cp_addr, &paddr, &host, priviledged)) {
+        UOP_TRACE(4, "load_codepage: mmu translation made codepage load fail\n");
+        return TRUE;
+    }
+
+    // the codepage is just a piece of the page
+    paddr += cp_addr & (MMU_PAGESIZE-1);
+    if (host != NULL)
+        host = (const byte *)host + (cp_addr & (MMU_PAGESIZE-1));
+
+    // this mapping may have been seen before
+    slot = codepage_slot(cp_addr, thumb);
+    if (*slot != NULL && (*slot)->address == CP_NO_ADDRESS) {
+        cp = map_codepage(slot, paddr);
+        if (cp != NULL) {
+            inc_perf_counter(CODEPAGE_HIT);
+            cp->referenced = TRUE;
+            *_cp = cp;
+            return FALSE;
+        }
+    }
+
+    cp = new_codepage(slot, cp_addr, thumb, paddr, host);
+#if WITH_PREDECODE
+    if (uop_predecode)
+        queue_predecode(cp, TRUE);
+#endif
 
     *_cp = cp;
 
@@ -461,73 +801,1062 @@ static bool set_codepage(armaddr_t pc)
     return FALSE;
 }
 
-void flush_all_codepages(void)
+/*
+ * Return address stack. Branches with link push where the call will return
+ * to, and returns (anything that writes the pc other than a call) check the
+ * top entry before falling back to recomputing cp_pc or looking up the
+ * codepage again. Entries point at cached codepages, so the stack is
+ * emptied whenever the cache is flushed.
+ */
+#define RAS_SIZE 16 // must be a power of 2
+
+static struct ras_entry {
+    armaddr_t pc;
+    struct uop_codepage *cp;
+    struct uop *cp_pc;
+} ras[RAS_SIZE];
+static unsigned int ras_top;
+
+static inline __ALWAYS_INLINE void ras_push(armaddr_t pc)
 {
-    int i;
+    struct ras_entry *e;
+
+    // calls in the last op of a codepage return to the next one, don't bother with those
+    if (unlikely((pc >> CODEPAGE_SHIFT) != (cpu.curr_cp->address >> CODEPAGE_SHIFT)))
+        return;
+
+    ras_top = (ras_top + 1) % RAS_SIZE;
+    e = &ras[ras_top];
+    e->pc = pc;
+    e->cp = cpu.curr_cp;
+    e->cp_pc = PC_TO_CPPC(pc);
+}
+
+/* if pc is where the last call returns to, switch straight to it and return TRUE */
+static inline __ALWAYS_INLINE bool ras_pop(armaddr_t pc)
+{
+    struct ras_entry *e = &ras[ras_top];
+
+    if (e->pc != pc || e->cp == NULL || e->cp->thumb != (get_condition(PSR_THUMB) ? TRUE : FALSE))
+        return FALSE;
+
+    UOP_TRACE(9, "UOP: return to 0x%x predicted\n", pc);
+    e->cp->referenced = TRUE;
+    cpu.curr_cp = e->cp;
+    cpu.cp_pc = e->cp_pc;
+    e->cp = NULL;
+    ras_top = (ras_top - 1) % RAS_SIZE;
+    return TRUE;
+}
+
+/*
+ * Indirect branch target cache. B_REG keeps the codepage it last branched
+ * to in the uop, which covers the common case of a site that always goes
+ * to the same page. Sites with more than one target, and ops that write the
+ * pc some other way (ldr pc, add pc, pc, ...), share a table keyed by site
+ * and target address that hands back the codepage and uop to continue at.
+ */
+#define IBC_SIZE 1024 // must be a power of 2
+#define IBC_HASH(site, pc) ((((uintptr_t)(site) / sizeof(struct uop)) ^ ((pc) >> 1)) % IBC_SIZE)
+
+static struct ibc_entry {
+    struct uop *site;
+    armaddr_t pc;
     struct uop_codepage *cp;
+    struct uop *cp_pc;
+} ibc[IBC_SIZE];
+
+/*
+ * The op at site branched to pc in another codepage. Returns TRUE if the
+ * target codepage was found and curr_cp and cp_pc are set up to run it.
+ * slot is the site's own single entry cache, if it has one.
+ */
+static inline __ALWAYS_INLINE bool ibc_branch(struct uop *site, struct uop_codepage **slot, armaddr_t pc)
+{
+    bool thumb = get_condition(PSR_THUMB) ? TRUE : FALSE;
+    struct ibc_entry *e;
+    struct uop_codepage *cp;
+
+    if (slot) {
+        cp = *slot;
+        if (likely(cp != NULL && cp->address == (pc & ~(CODEPAGE_SIZE-1)) && cp->thumb == thumb)) {
+            cp->referenced = TRUE;
+            cpu.curr_cp = cp;
+            cpu.cp_pc = PC_TO_CPPC(pc);
+            return TRUE;
+        }
+    }
+
+    e = &ibc[IBC_HASH(site, pc)];
+    if (e->site == site && e->pc == pc && e->cp->thumb == thumb) {
+        e->cp->referenced = TRUE;
+        cpu.curr_cp = e->cp;
+        cpu.cp_pc = e->cp_pc;
+        return TRUE;
+    }
+
+    cp = lookup_codepage(pc, thumb);
+    if (cp == NULL)
+        return FALSE; // let the dispatch loop load it
+
+    cpu.curr_cp = cp;
+    cpu.cp_pc = PC_TO_CPPC(pc);
+
+    if (slot && *slot == NULL) {
+        *slot = cp;
+    } else {
+        e->site = site;
+        e->pc = pc;
+        e->cp = cp;
+        e->cp_pc = cpu.cp_pc;
+    }
+    return TRUE;
+}
+
+/* for translated code, which does its own branches with link */
+void uop_push_return(armaddr_t pc)
+{
+    ras_push(pc);
+}
+
+static struct uop_codepage *written_cp; // the running codepage, once a store hits its decoded ops
+
+/*
+ * Take cp out of the cache. Branches cached in other codepages (b_immediate
+ * and b_reg target_cp) check the address of the codepage they point at before
+ * using it, which a free slot never matches, so only the return stack, the
+ * indirect branch cache and translated code need to forget about it here.
+ */
+static void remove_codepage(struct uop_codepage *cp)
+{
+    struct uop *last = cp->ops + (cp->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM);
+    struct uop_codepage **prev;
+    unsigned int i;
+
+    for (prev = codepage_slot(cp->vaddr, cp->thumb); *prev != cp; prev = &(*prev)->next)
+        ;
+    *prev = cp->next;
+    for (prev = codepage_pslot(cp->paddr); *prev != cp; prev = &(*prev)->pnext)
+        ;
+    *prev = cp->pnext;
+
+    for (i = 0; i < RAS_SIZE; i++) {
+        if (ras[i].cp == cp)
+            ras[i].cp = NULL;
+    }
+    for (i = 0; i < IBC_SIZE; i++) {
+        if (ibc[i].cp == cp || (ibc[i].site >= cp->ops && ibc[i].site <= last))
+            ibc[i].site = NULL;
+    }
+
+#if WITH_JIT
+    jit_evict(cp);
+#endif
+
+    if (cp == cpu.curr_cp)
+        cpu.curr_cp = NULL;
+    if (cp == written_cp)
+        written_cp = NULL;
+
+    free_codepage(cp);
+}
+
+/*
+ * Make a free codepage of the given kind by evicting one that has not been
+ * entered since the clock hand last went past it. Returns FALSE if there was
+ * nothing to evict.
+ */
+static bool evict_codepage(bool thumb)
+{
+    struct uop_codepage *cp;
+    unsigned int i;
+
+    // two times around clears every referenced bit on the way
+    for (i = 0; i < codecache.slot_count * 2; i++) {
+        cp = codecache.slots[codecache.hand];
+        codecache.hand = (codecache.hand + 1) % codecache.slot_count;
+
+        if (cp->thumb != thumb || cp->vaddr == CP_NO_ADDRESS || cp == cpu.curr_cp)
+            continue;
+        if (cp->referenced) {
+            cp->referenced = FALSE;
+            continue;
+        }
+
+        UOP_TRACE(5, "evict_codepage: cp %p, thumb %d, address 0x%x\n", cp, cp->thumb, cp->vaddr);
+        inc_perf_counter(CODEPAGE_EVICT);
+        remove_codepage(cp);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Keep the codepages, but make each one check the current translation of its
+ * address before it is used again. Anything that skips lookup_codepage() to
+ * get to a codepage forgets about them here, apart from the target_cp caches,
+ * which check the address of the codepage before they use it.
+ */
+void unmap_all_codepages(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < codecache.slot_count; i++) {
+        struct uop_codepage *cp = codecache.slots[i];
+
+        if (cp->address != CP_NO_ADDRESS) {
+            cp->address = CP_NO_ADDRESS;
+#if WITH_JIT
+            jit_unmap(cp);
+#endif
+        }
+    }
+
+    cpu.curr_cp = NULL;
+    memset(ras, 0, sizeof(ras));
+    memset(ibc, 0, sizeof(ibc));
+}
+
+/*
+ * The guest invalidated its icache. Rather than throw every codepage away,
+ * unmap them all and have map_codepage() check each one against memory the
+ * next time it's used. Stores by the cpu are already caught as they happen
+ * (see codepage_written()), so this is mostly for pages loaded some other way.
+ */
+void invalidate_all_codepages(void)
+{
+    UOP_TRACE(5, "invalidate_all_codepages: epoch %u\n", codecache.epoch + 1);
+
+    codecache.epoch++;
+    unmap_all_codepages();
+}
+
+/* throw away the codepages of both instruction sets that cover [address, address + len) */
+void flush_codepage_range(armaddr_t address, armaddr_t len)
+{
+    armaddr_t page = address & ~(CODEPAGE_SIZE-1);
+    armaddr_t pages = ((address & (CODEPAGE_SIZE-1)) + len + CODEPAGE_SIZE - 1) >> CODEPAGE_SHIFT;
+    int thumb;
+
+    UOP_TRACE(5, "flush_codepage_range: address 0x%x, len 0x%x\n", address, len);
 
-    /* XXX make this smarter */
-    for (i=0; i < CODEPAGE_HASHSIZE; i++) {
-        cp = cpu.codepage_hash[i];
+    for (; pages > 0; pages--, page += CODEPAGE_SIZE) {
+        for (thumb = 0; thumb < 2; thumb++) {
+            struct uop_codepage **table = cpu.codepage_dir[thumb][page >> CODEPAGE_DIR_SHIFT];
 
-        while (cp != NULL) {
-            struct uop_codepage *temp = cp;
-            cp = cp->next;
-            free_codepage(temp);
+            // every mapping of it
+            while (table != NULL && table[CODEPAGE_TABLE_INDEX(page)] != NULL)
+                remove_codepage(table[CODEPAGE_TABLE_INDEX(page)]);
         }
-        cpu.codepage_hash[i] = NULL;
+    }
+}
+
+/* any codepage in the mmu page at paddr */
+bool codepage_at_paddr(armaddr_t paddr)
+{
+    struct uop_codepage **table = cpu.codepage_pdir[paddr >> CODEPAGE_DIR_SHIFT];
+    unsigned int i;
+
+    if (table == NULL)
+        return FALSE;
+
+    for (i = CODEPAGE_TABLE_INDEX(paddr & ~(MMU_PAGESIZE-1)); i <= CODEPAGE_TABLE_INDEX(paddr | (MMU_PAGESIZE-1)); i++) {
+        if (table[i] != NULL)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Self modifying code. The mmu passes on stores to physical pages that have
+ * codepages loaded from them. Codepages keep a copy of every instruction in
+ * the page from when they were loaded, so the ones that haven't been decoded
+ * yet are just read again. A store to a CODEPAGE_LINE_SIZE line with decoded
+ * ops in it throws the codepage away. The running codepage is only thrown away
+ * at the end of the block (see uop_remove_written()), until then it carries
+ * on with what it already decoded, much like a real core with the old code
+ * already fetched.
+ */
+static void codepage_piece_written(armaddr_t paddr, armaddr_t len)
+{
+    struct uop_codepage **table = cpu.codepage_pdir[paddr >> CODEPAGE_DIR_SHIFT];
+    struct uop_codepage *cp, *next;
+    armaddr_t offset = paddr & (CODEPAGE_SIZE-1);
+    armaddr_t end = offset + len;
+    dword lines;
+    unsigned int i;
+
+    if (table == NULL)
+        return;
+
+    lines = (((dword)2 << ((end - 1) >> CODEPAGE_LINE_SHIFT)) - 1) & ~(((dword)1 << (offset >> CODEPAGE_LINE_SHIFT)) - 1);
+
+    for (cp = table[CODEPAGE_TABLE_INDEX(paddr)]; cp != NULL; cp = next) {
+        next = cp->pnext;
+
+        UOP_TRACE(6, "codepage_written: cp %p, paddr 0x%x, len %d, decoded 0x%llx\n", cp, paddr, len, (unsigned long long)cp->decoded);
+
+        for (i = offset >> cp->pc_shift; i <= (end - 1) >> cp->pc_shift; i++) {
+            struct uop *op = &cp->ops[i];
+            word ins;
+
+            if (op->opcode == DECODE_ME_ARM)
+                ins = sys_read_mem_word(cp->paddr + (i << 2));
+            else if (op->opcode == DECODE_ME_THUMB)
+                ins = sys_read_mem_halfword(cp->paddr + (i << 1));
+            else
+                continue;
+            cp->hash += codepage_hash_ins(ins, i) - codepage_hash_ins(op->undecoded.raw_instruction, i);
+            op->undecoded.raw_instruction = ins;
+        }
+
+        if (cp->decoded & lines) {
+            inc_perf_counter(CODEPAGE_WRITTEN);
+            if (cp != cpu.curr_cp) {
+                remove_codepage(cp);
+            } else if (written_cp != cp) {
+                if (written_cp != NULL)
+                    remove_codepage(written_cp);
+                written_cp = cp;
+                cpu_request_exit();
+            }
+        }
+    }
+}
+
+bool codepage_written(armaddr_t paddr, armaddr_t len)
+{
+    if (!codepage_at_paddr(paddr))
+        return FALSE;
+
+    // one codepage at a time, a store can straddle two
+    while (len > 0) {
+        armaddr_t piece = CODEPAGE_SIZE - (paddr & (CODEPAGE_SIZE-1));
+
+        if (piece > len)
+            piece = len;
+        codepage_piece_written(paddr, piece);
+        paddr += piece;
+        len -= piece;
+    }
+
+    return TRUE;
+}
+
+/* the block that wrote over its own codepage is done, get rid of it */
+static __NO_INLINE __COLD void uop_remove_written(void)
+{
+    UOP_TRACE(5, "uop_remove_written: cp %p, address 0x%x\n", written_cp, written_cp->vaddr);
+    remove_codepage(written_cp);
+}
+
+void flush_all_codepages(void)
+{
+    int thumb, i, j;
+
+    for (thumb = 0; thumb < 2; thumb++) {
+        for (i=0; i < CODEPAGE_DIR_SIZE; i++) {
+            struct uop_codepage **table = cpu.codepage_dir[thumb][i];
+
+            if (table == NULL)
+                continue;
+
+            for (j=0; j < CODEPAGE_TABLE_SIZE; j++) {
+                while (table[j] != NULL) {
+                    struct uop_codepage *cp = table[j];
+
+                    table[j] = cp->next;
+                    free_codepage(cp);
+                }
+            }
+        }
+    }
+    for (i=0; i < CODEPAGE_DIR_SIZE; i++) {
+        if (cpu.codepage_pdir[i] != NULL)
+            memset(cpu.codepage_pdir[i], 0, CODEPAGE_TABLE_SIZE * sizeof(struct uop_codepage *));
     }
 
     /* force a reload of the current codepage */
     cpu.curr_cp = NULL;
+    written_cp = NULL;
+    memset(ras, 0, sizeof(ras));
+    memset(ibc, 0, sizeof(ibc));
+
+#if WITH_JIT
+    jit_flush();
+#endif
+}
+
+#if WITH_DECODE_CACHE
+static __THREAD_LOCAL bool on_cpu_thread; // set by uop_dispatch_loop()
+
+/*
+ * Write the codepages with decoded ops in them out to the decode cache.
+ * Only on the cpu thread, anywhere else they could be changing under it.
+ * Only the codepages still in step with memory are written: the
+ * instructions read back have to add up to the hash the codepage kept.
+ */
+void uop_save_decode_cache(void)
+{
+    static bool saved;
+    word raw[NUM_CODEPAGE_INS_THUMB];
+    dword hash;
+    unsigned int i, j;
+
+    if (!uop_decode_cache || !on_cpu_thread || saved)
+        return;
+    saved = TRUE;
+
+    if (!decode_cache_save_begin(codecache.slot_count))
+        return;
+
+    for (i = 0; i < codecache.slot_count; i++) {
+        struct uop_codepage *cp = codecache.slots[i];
+        const byte *host;
+
+        if (cp->vaddr == CP_NO_ADDRESS || cp->decoded == 0 || cp->epoch != codecache.epoch)
+            continue;
+
+        host = sys_get_mem_ptr(cp->paddr);
+        if (host == NULL)
+            continue;
+
+        hash = 0;
+        if (cp->thumb) {
+            for (j = 0; j < NUM_CODEPAGE_INS_THUMB; j++) {
+                raw[j] = READ_MEM_HALFWORD(host + j*2);
+                hash += codepage_hash_ins(raw[j], j);
+            }
+        } else {
+            for (j = 0; j < NUM_CODEPAGE_INS_ARM; j++) {
+                raw[j] = READ_MEM_WORD(host + j*4);
+                hash += codepage_hash_ins(raw[j], j);
+            }
+        }
+        if (hash != cp->hash)
+            continue;
+
+        decode_cache_save(cp, raw);
+    }
+
+    decode_cache_save_end();
+}
+#endif
+
+#if DEAD_FLAGS_PASS
+/*
+ * Dead flag elimination. Every time an op is decoded, walk back over the
+ * straight line of ALU ops leading up to it, and rewrite any op whose flag
+ * results are always overwritten before anything reads them into a form
+ * that leaves the flags alone (ADD_REG_S -> ADD_REG, CMP_REG_S -> NOP, ...).
+ * Ops that can branch, fault or read the flags in some other way end the
+ * walk, and so does anything not decoded yet. Asynchronous exceptions are
+ * only taken at the end of a block, which never falls between two of
+ * these, so nothing else can see the difference.
+ */
+#define DEAD_FLAGS_WALK 16 // how far back to look
+
+#define FLAGS_NZ    (PSR_CC_NEG|PSR_CC_ZERO)
+#define FLAGS_NZC   (PSR_CC_NEG|PSR_CC_ZERO|PSR_CC_CARRY)
+
+static inline bool dp_reads_carry(int dp_opcode)
+{
+    return dp_opcode == AOP_ADC || dp_opcode == AOP_SBC || dp_opcode == AOP_RSC;
+}
+
+static inline bool dp_arith(int dp_opcode)
+{
+    return (dp_opcode >= AOP_SUB && dp_opcode <= AOP_RSC) || dp_opcode == AOP_CMP || dp_opcode == AOP_CMN;
+}
+
+static inline bool dp_test(int dp_opcode)
+{
+    return dp_opcode >= AOP_TST && dp_opcode <= AOP_CMN;
+}
+
+/*
+ * Work out which flags op reads, which it may write and which it always
+ * writes. Returns FALSE for anything but a plain ALU op that can't touch r15.
+ */
+static bool uop_flag_usage(const struct uop *op, word *reads, word *writes, word *kills)
+{
+    *reads = 0;
+    *writes = 0;
+
+    switch (op->opcode) {
+        case NOP:
+        case MOV_IMM:
+        case MOV_REG:
+        case ADD_IMM:
+        case ADD_REG:
+        case AND_IMM:
+        case ORR_IMM:
+        case LSL_IMM:
+        case LSL_REG:
+        case LSR_IMM:
+        case LSR_REG:
+        case ASR_IMM:
+        case ASR_REG:
+        case ROR_REG:
+            break;
+        case MOV_IMM_NZ:
+        case TST_REG_S:
+        case ORR_REG_S:
+        case AND_REG_S:
+        case EOR_REG_S:
+        case BIC_REG_S:
+        case MVN_REG_S:
+            *writes = FLAGS_NZ;
+            break;
+        case CMP_IMM_S:
+        case CMP_REG_S:
+        case CMN_REG_S:
+        case ADD_IMM_S:
+        case ADD_REG_S:
+        case SUB_REG_S:
+        case NEG_REG_S:
+            *writes = PSR_CC_NZCV;
+            break;
+        case ADC_REG_S:
+            *reads = PSR_CC_CARRY;
+            *writes = PSR_CC_NZCV;
+            break;
+        case LSL_IMM_S:
+        case LSR_IMM_S:
+        case ASR_IMM_S:
+        case LSL_REG_S:
+        case LSR_REG_S:
+        case ASR_REG_S:
+        case ROR_REG_S:
+            // a shift by zero passes the old carry through
+            *reads = PSR_CC_CARRY;
+            *writes = FLAGS_NZC;
+            break;
+        case DATA_PROCESSING_IMM:
+        case DATA_PROCESSING_REG:
+            if (op->data_processing_imm.dest_reg == PC)
+                return FALSE;
+            if (dp_reads_carry(op->data_processing_imm.dp_opcode))
+                *reads = PSR_CC_CARRY;
+            break;
+        case DATA_PROCESSING_IMM_S:
+        case DATA_PROCESSING_REG_S:
+            if (op->data_processing_imm.dest_reg == PC)
+                return FALSE; // restores cpsr from spsr
+            if (dp_reads_carry(op->data_processing_imm.dp_opcode))
+                *reads = PSR_CC_CARRY;
+            if (dp_arith(op->data_processing_imm.dp_opcode))
+                *writes = PSR_CC_NZCV;
+            else if (op->opcode == DATA_PROCESSING_IMM_S && (op->flags & UOPDPFLAGS_SET_CARRY_FROM_SHIFTER))
+                *writes = FLAGS_NZC;
+            else
+                *writes = FLAGS_NZ;
+            break;
+        case DATA_PROCESSING_IMM_SHIFT:
+        case DATA_PROCESSING_REG_SHIFT:
+        DP_SHIFT_UOP_LIST(DP_SHIFT_UOP_CASE)
+            if (op->data_processing_imm_shift.dest_reg == PC)
+                return FALSE;
+            // rrx and shifts by zero read the carry
+            *reads = PSR_CC_CARRY;
+            if (op->flags & UOPDPFLAGS_S_BIT)
+                *writes = dp_arith(op->data_processing_imm_shift.dp_opcode) ? PSR_CC_NZCV : FLAGS_NZC;
+            break;
+        default:
+            return FALSE;
+    }
+
+    // flags that are always overwritten, whatever was in them before
+    *kills = *writes & ~*reads;
+
+    // a conditional op reads the flags and may not write anything
+    if (op->cond != COND_AL) {
+        *reads = PSR_CC_NZCV;
+        *kills = 0;
+    }
+
+    return TRUE;
+}
+
+/* rewrite op so it doesn't touch the flags, returns FALSE if there is no such form */
+static bool uop_drop_flags(struct uop *op)
+{
+    switch (op->opcode) {
+        case MOV_IMM_NZ: op->opcode = MOV_IMM; break;
+        case ADD_IMM_S: op->opcode = ADD_IMM; break;
+        case ADD_REG_S: op->opcode = ADD_REG; break;
+        case LSL_IMM_S: op->opcode = LSL_IMM; break;
+        case LSR_IMM_S:
+        case ASR_IMM_S:
+            // thumb encodes a shift by 32 as 0, which the non S forms take as no shift at all
+            if (op->simple_dp_imm.immediate == 0)
+                return FALSE;
+            op->opcode = (op->opcode == LSR_IMM_S) ? LSR_IMM : ASR_IMM;
+            break;
+        case LSL_REG_S: op->opcode = LSL_REG; break;
+        case LSR_REG_S: op->opcode = LSR_REG; break;
+        case ASR_REG_S: op->opcode = ASR_REG; break;
+        case ROR_REG_S: op->opcode = ROR_REG; break;
+        case CMP_IMM_S:
+        case CMP_REG_S:
+        case CMN_REG_S:
+        case TST_REG_S:
+            op->opcode = NOP;
+            break;
+        case DATA_PROCESSING_IMM_S:
+        case DATA_PROCESSING_REG_S:
+            // the non S forms don't know about the test ops
+            if (dp_test(op->data_processing_imm.dp_opcode))
+                op->opcode = NOP;
+            else
+                op->opcode = (op->opcode == DATA_PROCESSING_IMM_S) ? DATA_PROCESSING_IMM : DATA_PROCESSING_REG;
+            break;
+        case DATA_PROCESSING_IMM_SHIFT:
+        case DATA_PROCESSING_REG_SHIFT:
+            // keep the op itself, a register shift costs a cycle either way
+            op->flags &= ~UOPDPFLAGS_S_BIT;
+            break;
+        DP_SHIFT_UOP_LIST(DP_SHIFT_UOP_CASE)
+            op->flags &= ~UOPDPFLAGS_S_BIT;
+            op->opcode = uop_dp_shift_opcode(op->opcode >= DP_REG_SHIFT_LSL, op->data_processing_imm_shift.shift_opcode, FALSE);
+            break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* op was just decoded in cp, see if it makes the flags of the ops before it dead */
+static void uop_dead_flags(struct uop_codepage *cp, struct uop *op)
+{
+    word dead, reads, writes, kills;
+    struct uop *prev;
+
+    if (!uop_flag_usage(op, &reads, &writes, &kills) || kills == 0)
+        return;
+    dead = kills;
+
+    for (prev = op - 1; prev >= cp->ops && prev > op - DEAD_FLAGS_WALK; prev--) {
+        if (!uop_flag_usage(prev, &reads, &writes, &kills))
+            break;
+
+        if (writes != 0 && (writes & ~dead) == 0 && uop_drop_flags(prev)) {
+            UOP_TRACE(7, "dead flags: dropping flag update of op %d in codepage 0x%x\n",
+                      (int)(prev - cp->ops), cp->address);
+            kills = 0;
+        }
+
+        dead = (dead | kills) & ~reads;
+        if (dead == 0)
+            break;
+    }
 }
+#endif
 
-static inline __ALWAYS_INLINE void uop_decode_me_arm(struct uop *op)
+#if FUSE_UOPS
+/*
+ * Macro fusion. When an op is decoded, see if it makes a common pair with
+ * the op before it, and if so turn the first op into a fused op that runs
+ * both. The fused op reads the second half out of the op after it, which
+ * stays as it is for anything that branches to it directly.
+ */
+static void uop_fuse(struct uop_codepage *cp, struct uop *op)
+{
+    struct uop *first = op - 1;
+    int fused;
+
+    if (first < cp->ops)
+        return;
+
+    switch (first->opcode) {
+        case CMP_IMM_S:
+        case CMP_REG_S:
+        case ADD_IMM_S:
+            if (op->opcode != B_IMMEDIATE_LOCAL)
+                return;
+            fused = (first->opcode == CMP_IMM_S) ? CMP_IMM_BRANCH_LOCAL :
+                    (first->opcode == CMP_REG_S) ? CMP_REG_BRANCH_LOCAL : ADD_IMM_S_BRANCH_LOCAL;
+            break;
+        case LOAD_IMMEDIATE_OFFSET:
+            // post increment of the base register
+            if (op->opcode != ADD_IMM || op->cond != COND_AL ||
+                    first->load_store_immediate_offset.target_reg == PC ||
+                    op->simple_dp_imm.dest_reg != first->load_store_immediate_offset.source_reg ||
+                    op->simple_dp_imm.source_reg != first->load_store_immediate_offset.source_reg)
+                return;
+            fused = LOAD_ADD_IMM;
+            break;
+        case MOV_IMM:
+        case MOV_REG:
+            if ((op->opcode != MOV_IMM && op->opcode != MOV_REG) || op->cond != COND_AL)
+                return;
+            fused = (first->opcode == MOV_IMM) ? MOV_IMM_MOV : MOV_REG_MOV;
+            break;
+        default:
+            return;
+    }
+
+    UOP_TRACE(7, "fusing %s and %s into %s\n", uop_opcode_to_str(first->opcode), uop_opcode_to_str(op->opcode), uop_opcode_to_str(fused));
+    first->opcode = fused;
+}
+#endif
+
+#if COND_RUNS
+/* ops that leave the flags alone, so the op after them can share their condition check */
+static bool uop_keeps_flags(const struct uop *op)
+{
+    switch (op->opcode) {
+        case NOP:
+        case LOAD_IMMEDIATE_WORD:
+        case LOAD_IMMEDIATE_HALFWORD:
+        case LOAD_IMMEDIATE_BYTE:
+        case LOAD_IMMEDIATE_OFFSET:
+        case LOAD_SCALED_REG_OFFSET:
+        case STORE_IMMEDIATE_OFFSET:
+        case STORE_SCALED_REG_OFFSET:
+        case LOAD_MULTIPLE:
+        case STORE_MULTIPLE:
+        case DATA_PROCESSING_IMM:
+        case DATA_PROCESSING_REG:
+        case MOV_IMM:
+        case MOV_REG:
+        case ADD_IMM:
+        case ADD_REG:
+        case AND_IMM:
+        case ORR_IMM:
+        case LSL_IMM:
+        case LSL_REG:
+        case LSR_IMM:
+        case LSR_REG:
+        case ASR_IMM:
+        case ASR_REG:
+        case ROR_REG:
+        case COUNT_LEADING_ZEROS:
+            return TRUE;
+        case DATA_PROCESSING_IMM_SHIFT:
+        case DATA_PROCESSING_REG_SHIFT:
+        DP_SHIFT_UOP_LIST(DP_SHIFT_UOP_CASE)
+            return !(op->flags & UOPDPFLAGS_S_BIT);
+        case MULTIPLY:
+        case MULTIPLY_LONG:
+            return !(op->flags & UOPMULFLAGS_S_BIT);
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * Predicated runs. Consecutive decoded ops with the same condition, where
+ * none but the last can change the flags, are tagged with the number of ops
+ * left in the run after them. The dispatch loop checks the condition at the
+ * first op of a run and then either skips the whole run or runs the rest of
+ * it without checking again. Called on each op as it is decoded, it joins it
+ * to the runs on either side.
+ */
+static void uop_cond_run(struct uop_codepage *cp, struct uop *op)
+{
+    struct uop *ops = cp->ops;
+    struct uop *next = op + 1;
+    struct uop *prev;
+    int run;
+
+    op->cond_run = 0;
+    if (op->cond == COND_AL || op->cond == COND_SPECIAL)
+        return;
+
+    // the synthetic branch at the end of the page is always COND_AL, so next is in range
+    if (next->cond == op->cond && next->opcode != DECODE_ME_ARM && next->opcode != DECODE_ME_THUMB &&
+            uop_keeps_flags(op) && next->cond_run < 255)
+        op->cond_run = next->cond_run + 1;
+
+    run = op->cond_run;
+    for (prev = op - 1; prev >= ops && run < 255; prev--) {
+        if (prev->cond != op->cond || prev->opcode == DECODE_ME_ARM || prev->opcode == DECODE_ME_THUMB ||
+                !uop_keeps_flags(prev))
+            break;
+        prev->cond_run = ++run;
+    }
+}
+#endif
+
+/*
+ * Does the op read r15? The dispatch loop only writes the current value of
+ * r15 into r[PC] for the ops that do, so anything that isn't known to
+ * leave it alone says yes.
+ */
+static bool uop_reads_pc(const struct uop *op)
+{
+    switch (op->opcode) {
+        case NOP:
+        case B_IMMEDIATE:
+        case B_IMMEDIATE_LOCAL:
+        case LOAD_IMMEDIATE_WORD:
+        case LOAD_IMMEDIATE_HALFWORD:
+        case LOAD_IMMEDIATE_BYTE:
+        case MOV_IMM:
+        case MOV_IMM_NZ:
+            return FALSE;
+        case B_REG:
+            return op->b_reg.reg == PC || (op->flags & UOPBFLAGS_LINK);
+        case B_REG_OFFSET:
+            return op->b_reg_offset.reg == PC || (op->flags & UOPBFLAGS_LINK);
+        case LOAD_IMMEDIATE_OFFSET:
+            return op->load_store_immediate_offset.source_reg == PC;
+        case STORE_IMMEDIATE_OFFSET:
+            return op->load_store_immediate_offset.source_reg == PC || op->load_store_immediate_offset.target_reg == PC;
+        case LOAD_SCALED_REG_OFFSET:
+            return op->load_store_scaled_reg_offset.source_reg == PC || op->load_store_scaled_reg_offset.source2_reg == PC;
+        case STORE_SCALED_REG_OFFSET:
+            return op->load_store_scaled_reg_offset.source_reg == PC || op->load_store_scaled_reg_offset.source2_reg == PC ||
+                   op->load_store_scaled_reg_offset.target_reg == PC;
+        case LOAD_MULTIPLE:
+        case LOAD_MULTIPLE_S:
+            return op->load_store_multiple.base_reg == PC;
+        case STORE_MULTIPLE:
+        case STORE_MULTIPLE_S:
+            return op->load_store_multiple.base_reg == PC || (op->load_store_multiple.reg_bitmap & 0x8000);
+        case DATA_PROCESSING_IMM:
+        case DATA_PROCESSING_IMM_S:
+            return op->data_processing_imm.source_reg == PC;
+        case DATA_PROCESSING_REG:
+        case DATA_PROCESSING_REG_S:
+            return op->data_processing_reg.source_reg == PC || op->data_processing_reg.source2_reg == PC;
+        case DATA_PROCESSING_IMM_SHIFT:
+        case DATA_PROCESSING_REG_SHIFT:
+        DP_SHIFT_UOP_LIST(DP_SHIFT_UOP_CASE)
+            return op->data_processing_reg_shift.source_reg == PC || op->data_processing_reg_shift.source2_reg == PC ||
+                   (uop_dp_shift_generic(op->opcode) == DATA_PROCESSING_REG_SHIFT && op->data_processing_reg_shift.shift_reg == PC);
+        case CMP_IMM_S:
+        case ADD_IMM:
+        case ADD_IMM_S:
+        case AND_IMM:
+        case ORR_IMM:
+        case LSL_IMM:
+        case LSL_IMM_S:
+        case LSR_IMM:
+        case LSR_IMM_S:
+        case ASR_IMM:
+        case ASR_IMM_S:
+            return op->simple_dp_imm.source_reg == PC;
+        case MOV_REG:
+        case CMP_REG_S:
+        case CMN_REG_S:
+        case TST_REG_S:
+        case ADD_REG:
+        case ADD_REG_S:
+        case ADC_REG_S:
+        case SUB_REG_S:
+        case SBC_REG_S:
+        case ORR_REG_S:
+        case LSL_REG:
+        case LSL_REG_S:
+        case LSR_REG:
+        case LSR_REG_S:
+        case ASR_REG:
+        case ASR_REG_S:
+        case ROR_REG:
+        case ROR_REG_S:
+        case AND_REG_S:
+        case EOR_REG_S:
+        case BIC_REG_S:
+        case NEG_REG_S:
+        case MVN_REG_S:
+            return op->simple_dp_reg.source_reg == PC || op->simple_dp_reg.source2_reg == PC;
+        case MULTIPLY:
+            return op->mul.source_reg == PC || op->mul.source2_reg == PC ||
+                   ((op->flags & UOPMULFLAGS_ACCUMULATE) && op->mul.accum_reg == PC);
+        case MULTIPLY_LONG:
+            return op->mull.source_reg == PC || op->mull.source2_reg == PC ||
+                   ((op->flags & UOPMULFLAGS_ACCUMULATE) && (op->mull.destlo_reg == PC || op->mull.desthi_reg == PC));
+        case SWAP:
+            return op->swp.source_reg == PC || op->swp.mem_reg == PC;
+        case COUNT_LEADING_ZEROS:
+            return op->count_leading_zeros.source_reg == PC;
+        default:
+            return TRUE;
+    }
+}
+
+/* op in cp was just decoded, by the decode handlers below or the predecode thread */
+static void uop_decoded(struct uop_codepage *cp, struct uop *op)
+{
+    op->reads_pc = uop_reads_pc(op);
+    cp->decoded |= (dword)1 << (((op - cp->ops) << cp->pc_shift) >> CODEPAGE_LINE_SHIFT);
+#if DEAD_FLAGS_PASS
+    uop_dead_flags(cp, op);
+#endif
+#if FUSE_UOPS
+    uop_fuse(cp, op);
+#endif
+#if COND_RUNS
+    uop_cond_run(cp, op);
+#endif
+}
+
+static __UOP_HANDLER void uop_decode_me_arm(struct uop *op)
 {
     // call the arm decoder and set the pc back to retry this instruction
     ASSERT(cpu.cp_pc != NULL);
     UOP_TRACE(6, "decoding arm opcode 0x%08x at pc 0x%x\n", op->undecoded.raw_instruction, cpu.pc);
+    decode_r15 = cpu.r[PC];
     arm_decode_into_uop(op);
+    uop_decoded(cpu.curr_cp, op);
     cpu.pc -= 4; // back the instruction pointer up to retry this instruction
     cpu.cp_pc--;
     inc_perf_counter(INS_DECODE);
 }
 
-static inline __ALWAYS_INLINE void uop_decode_me_thumb(struct uop *op)
+static __UOP_HANDLER void uop_decode_me_thumb(struct uop *op)
 {
     // call the arm decoder and set the pc back to retry this instruction
     ASSERT(cpu.cp_pc != NULL);
     UOP_TRACE(6, "decoding thumb opcode 0x%04x at pc 0x%x\n", op->undecoded.raw_instruction, cpu.pc);
+    decode_r15 = cpu.r[PC];
     thumb_decode_into_uop(op);
+    uop_decoded(cpu.curr_cp, op);
     cpu.pc -= 2; // back the instruction pointer up to retry this instruction
     cpu.cp_pc--;
     inc_perf_counter(INS_DECODE);
 }
 
-static inline __ALWAYS_INLINE void uop_b_immediate(struct uop *op)
+#if WITH_PREDECODE
+/*
+ * A branch target the predecode thread found. Only if its translation is
+ * at hand and it's in a page that already has code in it is it loaded and
+ * predecoded as well. The branch may have been decoded out of data, and
+ * that's not worth a page walk or turning a page of data into code.
+ */
+static void predecode_target(armaddr_t target)
+{
+    armaddr_t cp_addr = target & ~(CODEPAGE_SIZE-1);
+    bool thumb = target & 1;
+    struct uop_codepage **slot;
+    armaddr_t paddr;
+    const void *host;
+
+    if (mmu_probe_instruction_page(cp_addr, &paddr, &host, arm_in_priviledged()) || host == NULL)
+        return;
+
+    paddr += cp_addr & (MMU_PAGESIZE-1);
+    if (!codepage_at_paddr(paddr))
+        return;
+
+    // anything loaded here before is left to lookup_codepage()
+    slot = codepage_slot(cp_addr, thumb);
+    if (*slot != NULL)
+        return;
+
+    UOP_TRACE(6, "predecode_target: loading 0x%x thumb %d\n", cp_addr, thumb);
+    queue_predecode(new_codepage(slot, cp_addr, thumb, paddr, (const byte *)host + (cp_addr & (MMU_PAGESIZE-1))), FALSE);
+}
+
+/*
+ * Take back what the predecode thread has decoded. An op only goes in if
+ * the codepage is still loaded from the same address, and the op there is
+ * still undecoded and hasn't been written over since it was queued, which
+ * makes it the same op the decode handlers would have made of it.
+ */
+static __NO_INLINE __COLD void uop_install_predecoded(void)
+{
+    struct uop_predecode *p;
+
+    while ((p = predecode_result()) != NULL) {
+        struct uop_codepage *cp = p->cp;
+        armaddr_t targets[PREDECODE_TARGETS];
+        int num_targets = p->follow ? p->num_targets : 0;
+        int installed = 0;
+        int i;
+
+        for (i = 0; cp->vaddr == p->address && i < (cp->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM); i++) {
+            struct uop *op = &cp->ops[i];
+
+            if ((op->opcode != DECODE_ME_ARM && op->opcode != DECODE_ME_THUMB) ||
+                    op->undecoded.raw_instruction != p->raw[i] ||
+                    p->ops[i].opcode == DECODE_ME_ARM || p->ops[i].opcode == DECODE_ME_THUMB)
+                continue;
+
+            *op = p->ops[i];
+            uop_decoded(cp, op);
+            installed++;
+        }
+
+        UOP_TRACE(6, "uop_install_predecoded: cp %p, address 0x%x, %d ops\n", cp, p->address, installed);
+        add_to_perf_counter(INS_PREDECODE, installed);
+#if WITH_JIT
+        if (installed > 0)
+            cp->jit_stale = TRUE;
+#endif
+
+        // the slot is needed back for the targets
+        memcpy(targets, p->targets, num_targets * sizeof(armaddr_t));
+        predecode_retire();
+        for (i = 0; i < num_targets; i++)
+            predecode_target(targets[i]);
+    }
+}
+#endif
+
+/* rare paths of the handlers, kept out of the dispatch loop */
+static __NO_INLINE __COLD void uop_switch_thumb(bool thumb)
+{
+    set_condition(PSR_THUMB, thumb);
+    // force a codepage reload
+    cpu.curr_cp = NULL;
+    UOP_TRACE(7, "setting thumb to %d (new mode)\n", thumb);
+}
+
+/* a new cpsr may unmask an interrupt that was raised while it was masked */
+static inline __ALWAYS_INLINE void uop_cpsr_written(void)
+{
+    if (cpu.pending_exceptions != 0)
+        cpu_request_exit();
+}
+
+/* copy spsr into cpsr, switching modes, on the way out of an exception */
+static __NO_INLINE __COLD void uop_restore_cpsr(bool check_thumb)
+{
+    reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
+
+    flush_lazy_flags(); // the flags are about to be replaced
+
+    // see if we're about to switch thumb state
+    if (check_thumb && (spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
+        cpu.curr_cp = NULL; // force a codepage reload
+
+    set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
+    cpu.cpsr = spsr;
+    uop_cpsr_written();
+}
+
+static __NO_INLINE __COLD void uop_load_multiple_abort(struct uop *op, armaddr_t base)
+{
+    // there was a data abort, and we may have trashed the base register. Restore it.
+    put_reg(op->load_store_multiple.base_reg, base);
+}
+
+static __UOP_HANDLER void uop_b_immediate(struct uop *op)
 {
     // branch to a fixed location outside of the current codepage.
     // Any offsets would have been resolved at decode time.
     if (op->flags & UOPBFLAGS_LINK) {
         int thumb = get_condition(PSR_THUMB) ? 1 : 0;
-        put_reg(LR, op->b_immediate.link_target | thumb);
-    }
-
-    if (op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
-        set_condition(PSR_THUMB, TRUE);
-        // force a codepage reload
-        cpu.curr_cp = NULL;
-    }
-    if (op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
-        set_condition(PSR_THUMB, FALSE);
-        // force a codepage reload
-        cpu.curr_cp = NULL;
+        put_reg(LR, op->b_immediate.link_target | thumb);
+        ras_push(op->b_immediate.link_target);
     }
 
+    if (op->flags & UOPBFLAGS_SETTHUMB_ALWAYS)
+        uop_switch_thumb(TRUE);
+    if (op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS)
+        uop_switch_thumb(FALSE);
+
     cpu.pc = op->b_immediate.target;
-    if (likely(op->b_immediate.target_cp != NULL)) {
-        // we have already cached a pointer to the target codepage, use it
+    if (likely(op->b_immediate.target_cp != NULL &&
+               op->b_immediate.target_cp->address == (cpu.pc & ~(CODEPAGE_SIZE-1)))) {
+        // we have already cached a pointer to the target codepage, and it wasn't evicted since
         cpu.curr_cp = op->b_immediate.target_cp;
+        cpu.curr_cp->referenced = TRUE;
         cpu.cp_pc = PC_TO_CPPC(cpu.pc);
     } else {
         // see if we can lookup the target codepage and try again
@@ -548,16 +1877,17 @@ static inline __ALWAYS_INLINE void uop_b_immediate(struct uop *op)
 #endif
 #if COUNT_CYCLES
     // all branch instructions take 3 cycles on all cores
-    add_to_perf_counter(CYCLE_COUNT, 2);
+    UOP_COUNT_CYCLES(2);
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_b_immediate_local(struct uop *op)
+static __UOP_HANDLER void uop_b_immediate_local(struct uop *op)
 {
     // branch to a fixed location within the current codepage.
     if (op->flags & UOPBFLAGS_LINK) {
         int thumb = get_condition(PSR_THUMB) ? 1 : 0;
         put_reg(LR, op->b_immediate.link_target | thumb);
+        ras_push(op->b_immediate.link_target);
     }
 
     cpu.pc = op->b_immediate.target;
@@ -568,11 +1898,11 @@ static inline __ALWAYS_INLINE void uop_b_immediate_local(struct uop *op)
 #endif
 #if COUNT_CYCLES
     // all branch instructions take 3 cycles on all cores
-    add_to_perf_counter(CYCLE_COUNT, 2);
+    UOP_COUNT_CYCLES(2);
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_b_reg(struct uop *op)
+static __UOP_HANDLER void uop_b_reg(struct uop *op)
 {
     armaddr_t temp_addr;
 
@@ -582,11 +1912,13 @@ static inline __ALWAYS_INLINE void uop_b_reg(struct uop *op)
     if (op->flags & UOPBFLAGS_LINK) {
         int thumb = get_condition(PSR_THUMB) ? 1 : 0;
         put_reg(LR, (get_reg(PC) + op->b_reg.link_offset) | thumb);
+        ras_push(get_reg(PC) + op->b_reg.link_offset);
     }
 
-    put_reg(PC, temp_addr & 0xfffffffe);
+    // the codepage and cp_pc are brought up to date here, so leave r15_dirty alone
+    cpu.r[PC] = temp_addr & 0xfffffffe;
 
-    if ((temp_addr >> MMU_PAGESIZE_SHIFT) == (cpu.pc >> MMU_PAGESIZE_SHIFT)) {
+    if ((temp_addr >> CODEPAGE_SHIFT) == (cpu.curr_cp->address >> CODEPAGE_SHIFT)) {
         // it's a local branch, just recalc the position in the current codepage
         cpu.pc = temp_addr & 0xfffffffe;
         cpu.cp_pc = PC_TO_CPPC(cpu.pc);
@@ -596,28 +1928,24 @@ static inline __ALWAYS_INLINE void uop_b_reg(struct uop *op)
         cpu.curr_cp = NULL;
     }
 
-    if (op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
-        set_condition(PSR_THUMB, TRUE);
-        // force a codepage reload
-        cpu.curr_cp = NULL;
-    }
-    if (op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
-        set_condition(PSR_THUMB, FALSE);
-        // force a codepage reload
-        cpu.curr_cp = NULL;
-    }
+    if (op->flags & UOPBFLAGS_SETTHUMB_ALWAYS)
+        uop_switch_thumb(TRUE);
+    if (op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS)
+        uop_switch_thumb(FALSE);
 
     // if the bottom bit of the target address is 1, switch to thumb, otherwise switch to arm
     if (op->flags & UOPBFLAGS_SETTHUMB_COND) {
         bool old_condition = get_condition(PSR_THUMB) ? TRUE : FALSE;
         bool new_condition = (temp_addr & 1) ? TRUE : FALSE;
 
-        if (old_condition != new_condition) {
-            set_condition(PSR_THUMB, new_condition);
-            // force a codepage reload
-            cpu.curr_cp = NULL;
-            UOP_TRACE(7, "B_REG: setting thumb to %d (new mode)\n", new_condition);
-        }
+        if (unlikely(old_condition != new_condition))
+            uop_switch_thumb(new_condition);
+    }
+
+    // a plain branch to a register is most likely a return, otherwise look for the target in the cache
+    if ((op->flags & UOPBFLAGS_LINK) || !ras_pop(cpu.pc)) {
+        if (cpu.curr_cp == NULL)
+            ibc_branch(op, &op->b_reg.target_cp, cpu.pc);
     }
 
 #if COUNT_ARM_OPS
@@ -625,11 +1953,11 @@ static inline __ALWAYS_INLINE void uop_b_reg(struct uop *op)
 #endif
 #if COUNT_CYCLES
     // all branch instructions take 3 cycles on all cores
-    add_to_perf_counter(CYCLE_COUNT, 2);
+    UOP_COUNT_CYCLES(2);
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_b_reg_offset(struct uop *op)
+static __UOP_HANDLER void uop_b_reg_offset(struct uop *op)
 {
     armaddr_t temp_addr;
 
@@ -640,11 +1968,13 @@ static inline __ALWAYS_INLINE void uop_b_reg_offset(struct uop *op)
     if (op->flags & UOPBFLAGS_LINK) {
         int thumb = get_condition(PSR_THUMB) ? 1 : 0;
         put_reg(LR, (get_reg(PC) + op->b_reg_offset.link_offset) | thumb);
+        ras_push(get_reg(PC) + op->b_reg_offset.link_offset);
     }
 
-    put_reg(PC, temp_addr & 0xfffffffe);
+    // the codepage and cp_pc are brought up to date here, so leave r15_dirty alone
+    cpu.r[PC] = temp_addr & 0xfffffffe;
 
-    if ((temp_addr >> MMU_PAGESIZE_SHIFT) == (cpu.pc >> MMU_PAGESIZE_SHIFT)) {
+    if ((temp_addr >> CODEPAGE_SHIFT) == (cpu.curr_cp->address >> CODEPAGE_SHIFT)) {
         // it's a local branch, just recalc the position in the current codepage
         cpu.pc = temp_addr & 0xfffffffe;
         cpu.cp_pc = PC_TO_CPPC(cpu.pc);
@@ -654,28 +1984,18 @@ static inline __ALWAYS_INLINE void uop_b_reg_offset(struct uop *op)
         cpu.curr_cp = NULL;
     }
 
-    if (op->flags & UOPBFLAGS_SETTHUMB_ALWAYS) {
-        set_condition(PSR_THUMB, TRUE);
-        // force a codepage reload
-        cpu.curr_cp = NULL;
-    }
-    if (op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS) {
-        set_condition(PSR_THUMB, FALSE);
-        // force a codepage reload
-        cpu.curr_cp = NULL;
-    }
+    if (op->flags & UOPBFLAGS_SETTHUMB_ALWAYS)
+        uop_switch_thumb(TRUE);
+    if (op->flags & UOPBFLAGS_UNSETTHUMB_ALWAYS)
+        uop_switch_thumb(FALSE);
 
     // if the bottom bit of the target address is 1, switch to thumb, otherwise switch to arm
     if (op->flags & UOPBFLAGS_SETTHUMB_COND) {
         bool old_condition = get_condition(PSR_THUMB) ? TRUE : FALSE;
         bool new_condition = (temp_addr & 1) ? TRUE : FALSE;
 
-        if (old_condition != new_condition) {
-            set_condition(PSR_THUMB, new_condition);
-            // force a codepage reload
-            cpu.curr_cp = NULL;
-            UOP_TRACE(7, "B_REG: setting thumb to %d (new mode)\n", new_condition);
-        }
+        if (unlikely(old_condition != new_condition))
+            uop_switch_thumb(new_condition);
     }
 
 #if COUNT_ARM_OPS
@@ -683,11 +2003,11 @@ static inline __ALWAYS_INLINE void uop_b_reg_offset(struct uop *op)
 #endif
 #if COUNT_CYCLES
     // all branch instructions take 3 cycles on all cores
-    add_to_perf_counter(CYCLE_COUNT, 2);
+    UOP_COUNT_CYCLES(2);
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_load_immediate_word(struct uop *op)
+static __UOP_HANDLER void uop_load_immediate_word(struct uop *op)
 {
     word temp_word;
 
@@ -704,13 +2024,13 @@ static inline __ALWAYS_INLINE void uop_load_immediate_word(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (op->load_immediate.target_reg == PC)
-        add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+        UOP_COUNT_CYCLES(4); // on all cores pc loads are 4 cycles
     else if (get_core() == ARM7)
-        add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+        UOP_COUNT_CYCLES(2); // on arm7 all other loads are 3
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_load_immediate_halfword(struct uop *op)
+static __UOP_HANDLER void uop_load_immediate_halfword(struct uop *op)
 {
     halfword temp_halfword;
     word temp_word;
@@ -731,15 +2051,15 @@ static inline __ALWAYS_INLINE void uop_load_immediate_halfword(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (op->load_immediate.target_reg == PC)
-        add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+        UOP_COUNT_CYCLES(4); // on all cores pc loads are 4 cycles
     else if (get_core() == ARM7)
-        add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+        UOP_COUNT_CYCLES(2); // on arm7 all other loads are 3
     else if (get_core() >= ARM9)
-        add_to_perf_counter(CYCLE_COUNT, 1); // byte and halfword loads are one cycle slower
+        UOP_COUNT_CYCLES(1); // byte and halfword loads are one cycle slower
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_load_immediate_byte(struct uop *op)
+static __UOP_HANDLER void uop_load_immediate_byte(struct uop *op)
 {
     byte temp_byte;
     word temp_word;
@@ -760,18 +2080,18 @@ static inline __ALWAYS_INLINE void uop_load_immediate_byte(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (op->load_immediate.target_reg == PC)
-        add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+        UOP_COUNT_CYCLES(4); // on all cores pc loads are 4 cycles
     else if (get_core() == ARM7)
-        add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+        UOP_COUNT_CYCLES(2); // on arm7 all other loads are 3
     else if (get_core() >= ARM9)
-        add_to_perf_counter(CYCLE_COUNT, 1); // byte and halfword loads are one cycle slower
+        UOP_COUNT_CYCLES(1); // byte and halfword loads are one cycle slower
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_load_immediate_offset(struct uop *op)
+static __UOP_HANDLER void uop_load_immediate_offset(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2, temp_addr3;
-    word temp_word;
+    word temp_word = 0; // the size switch covers every case, gcc just can't tell
 
     // slightly more complex, add an offset to a register
     temp_addr2 = get_reg(op->load_store_immediate_offset.source_reg);
@@ -842,18 +2162,18 @@ static inline __ALWAYS_INLINE void uop_load_immediate_offset(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (op->load_store_immediate_offset.target_reg == PC)
-        add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+        UOP_COUNT_CYCLES(4); // on all cores pc loads are 4 cycles
     else if (get_core() == ARM7)
-        add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+        UOP_COUNT_CYCLES(2); // on arm7 all other loads are 3
     else if (get_core() >= ARM9 && (op->flags & UOPLSFLAGS_SIZE_MASK) != UOPLSFLAGS_SIZE_WORD)
-        add_to_perf_counter(CYCLE_COUNT, 1); // byte, halfword, and dword loads are one cycle slower
+        UOP_COUNT_CYCLES(1); // byte, halfword, and dword loads are one cycle slower
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_load_scaled_reg_offset(struct uop *op)
+static __UOP_HANDLER void uop_load_scaled_reg_offset(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2, temp_addr3;
-    word temp_word;
+    word temp_word = 0; // the size switch covers every case, gcc just can't tell
 
     // pretty complex. take two registers, optionally perform a shift operation on the second one,
     // add them together and then load that address
@@ -881,7 +2201,7 @@ static inline __ALWAYS_INLINE void uop_load_scaled_reg_offset(struct uop *op)
             break;
         case 3: // ROR or RRX
             if (op->load_store_scaled_reg_offset.shift_immediate == 0) { // RRX
-                temp_addr3 = (cpu.cpsr ? 0x80000000 : 0) | LSR(temp_word, 1);
+                temp_addr3 = (get_condition(PSR_CC_CARRY) ? 0x80000000 : 0) | LSR(temp_addr3, 1);
             } else {
                 temp_addr3 = ROR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
             }
@@ -960,17 +2280,17 @@ static inline __ALWAYS_INLINE void uop_load_scaled_reg_offset(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (op->load_store_scaled_reg_offset.target_reg == PC)
-        add_to_perf_counter(CYCLE_COUNT, 4); // on all cores pc loads are 4 cycles
+        UOP_COUNT_CYCLES(4); // on all cores pc loads are 4 cycles
     else if (get_core() == ARM7)
-        add_to_perf_counter(CYCLE_COUNT, 2); // on arm7 all other loads are 3
+        UOP_COUNT_CYCLES(2); // on arm7 all other loads are 3
     else if (get_core() >= ARM9 && (op->flags & UOPLSFLAGS_SIZE_MASK) != UOPLSFLAGS_SIZE_WORD)
-        add_to_perf_counter(CYCLE_COUNT, 1); // byte, halfword, and dword loads are one cycle slower
+        UOP_COUNT_CYCLES(1); // byte, halfword, and dword loads are one cycle slower
     if (get_core() == ARM9e)
-        add_to_perf_counter(CYCLE_COUNT, 1); // scaled register loads are 1 cycle slower on this core
+        UOP_COUNT_CYCLES(1); // scaled register loads are 1 cycle slower on this core
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_store_immediate_offset(struct uop *op)
+static __UOP_HANDLER void uop_store_immediate_offset(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2, temp_addr3;
     word temp_word;
@@ -1026,17 +2346,17 @@ static inline __ALWAYS_INLINE void uop_store_immediate_offset(struct uop *op)
 #if COUNT_CYCLES
     // cycle count (arm9 is 1 cycle, arm7 is 2)
     if (get_core() == ARM7) {
-        add_to_perf_counter(CYCLE_COUNT, 1);
+        UOP_COUNT_CYCLES(1);
     }
     // strd is one cycle slower
     if ((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD) {
-        add_to_perf_counter(CYCLE_COUNT, 1);
+        UOP_COUNT_CYCLES(1);
     }
 #endif
 }
 
 
-static inline __ALWAYS_INLINE void uop_store_scaled_reg_offset(struct uop *op)
+static __UOP_HANDLER void uop_store_scaled_reg_offset(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2, temp_addr3;
     word temp_word;
@@ -1069,7 +2389,7 @@ static inline __ALWAYS_INLINE void uop_store_scaled_reg_offset(struct uop *op)
             break;
         case 3: // ROR or RRX
             if (op->load_store_scaled_reg_offset.shift_immediate == 0) { // RRX
-                temp_addr3 = (cpu.cpsr ? 0x80000000 : 0) | LSR(temp_addr3, 1);
+                temp_addr3 = (get_condition(PSR_CC_CARRY) ? 0x80000000 : 0) | LSR(temp_addr3, 1);
             } else {
                 temp_addr3 = ROR(temp_addr3, op->load_store_scaled_reg_offset.shift_immediate);
             }
@@ -1128,18 +2448,18 @@ static inline __ALWAYS_INLINE void uop_store_scaled_reg_offset(struct uop *op)
 #if COUNT_CYCLES
     // cycle count (arm9 is 1 cycle, arm7 is 2)
     if (get_core() == ARM7) {
-        add_to_perf_counter(CYCLE_COUNT, 1);
+        UOP_COUNT_CYCLES(1);
     } else if (get_core() == ARM9e) {
-        add_to_perf_counter(CYCLE_COUNT, 1); // XXX not precisely correct, since a zero scale is no extra work
+        UOP_COUNT_CYCLES(1); // XXX not precisely correct, since a zero scale is no extra work
     }
     // strd is one cycle slower
     if ((op->flags & UOPLSFLAGS_SIZE_MASK) == UOPLSFLAGS_SIZE_DWORD) {
-        add_to_perf_counter(CYCLE_COUNT, 1);
+        UOP_COUNT_CYCLES(1);
     }
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_load_multiple(struct uop *op)
+static __UOP_HANDLER void uop_load_multiple(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2;
     word temp_word;
@@ -1155,8 +2475,7 @@ static inline __ALWAYS_INLINE void uop_load_multiple(struct uop *op)
     for (i = 0; reg_list != 0; i++, reg_list >>= 1) {
         if (reg_list & 1) {
             if (mmu_read_mem_word(temp_addr2, &temp_word)) {
-                // there was a data abort, and we may have trashed the base register. Restore it.
-                put_reg(op->load_store_multiple.base_reg, temp_addr);
+                uop_load_multiple_abort(op, temp_addr);
                 return;
             }
 
@@ -1173,24 +2492,21 @@ static inline __ALWAYS_INLINE void uop_load_multiple(struct uop *op)
     }
 
     // see if we need to move spsr into cpsr
-    if (op->flags & UOPLSMFLAGS_LOAD_CPSR) {
-        reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-        set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-        cpu.cpsr = spsr;
-    }
+    if (op->flags & UOPLSMFLAGS_LOAD_CPSR)
+        uop_restore_cpsr(FALSE);
 
 #if COUNT_CYCLES
     // cycle count
     if (get_core() == ARM7) {
-        add_to_perf_counter(CYCLE_COUNT, op->load_store_multiple.reg_count + 1);
+        UOP_COUNT_CYCLES(op->load_store_multiple.reg_count + 1);
         if (op->load_store_multiple.reg_bitmap & 0x8000) // loaded into PC
-            add_to_perf_counter(CYCLE_COUNT, 2);
+            UOP_COUNT_CYCLES(2);
     } else { /* if(get_core() >= ARM9) */
-        add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+        UOP_COUNT_CYCLES((op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
         if (op->load_store_multiple.reg_bitmap & 0x8000) {
-            add_to_perf_counter(CYCLE_COUNT, 4);
+            UOP_COUNT_CYCLES(4);
             if (get_core() == ARM9e && op->load_store_multiple.reg_count == 0)
-                add_to_perf_counter(CYCLE_COUNT, -1); // ldm of just pc is one cycle faster on ARM9e
+                UOP_COUNT_CYCLES(-1); // ldm of just pc is one cycle faster on ARM9e
         }
     }
 #endif
@@ -1199,7 +2515,7 @@ static inline __ALWAYS_INLINE void uop_load_multiple(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_load_multiple_s(struct uop *op)
+static __UOP_COLD_HANDLER void uop_load_multiple_s(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2;
     word temp_word;
@@ -1237,15 +2553,15 @@ static inline __ALWAYS_INLINE void uop_load_multiple_s(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (get_core() == ARM7) {
-        add_to_perf_counter(CYCLE_COUNT, op->load_store_multiple.reg_count + 1);
+        UOP_COUNT_CYCLES(op->load_store_multiple.reg_count + 1);
         if (op->load_store_multiple.reg_bitmap & 0x8000) // loaded into PC
-            add_to_perf_counter(CYCLE_COUNT, 2);
+            UOP_COUNT_CYCLES(2);
     } else { /* if(get_core() >= ARM9) */
-        add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+        UOP_COUNT_CYCLES((op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
         if (op->load_store_multiple.reg_bitmap & 0x8000) {
-            add_to_perf_counter(CYCLE_COUNT, 4);
+            UOP_COUNT_CYCLES(4);
             if (get_core() == ARM9e && op->load_store_multiple.reg_count == 0)
-                add_to_perf_counter(CYCLE_COUNT, -1); // ldm of just pc is one cycle faster on ARM9e
+                UOP_COUNT_CYCLES(-1); // ldm of just pc is one cycle faster on ARM9e
         }
     }
 #endif
@@ -1254,7 +2570,7 @@ static inline __ALWAYS_INLINE void uop_load_multiple_s(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_store_multiple(struct uop *op)
+static __UOP_HANDLER void uop_store_multiple(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2;
     int i;
@@ -1283,9 +2599,9 @@ static inline __ALWAYS_INLINE void uop_store_multiple(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (get_core() == ARM7) {
-        add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count - 1) + 1);
+        UOP_COUNT_CYCLES((op->load_store_multiple.reg_count - 1) + 1);
     } else { /* if(get_core() >= ARM9) */
-        add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+        UOP_COUNT_CYCLES((op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
     }
 #endif
 #if COUNT_ARM_OPS
@@ -1293,7 +2609,7 @@ static inline __ALWAYS_INLINE void uop_store_multiple(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_store_multiple_s(struct uop *op)
+static __UOP_COLD_HANDLER void uop_store_multiple_s(struct uop *op)
 {
     armaddr_t temp_addr, temp_addr2;
     int i;
@@ -1323,9 +2639,9 @@ static inline __ALWAYS_INLINE void uop_store_multiple_s(struct uop *op)
 #if COUNT_CYCLES
     // cycle count
     if (get_core() == ARM7) {
-        add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count - 1) + 1);
+        UOP_COUNT_CYCLES((op->load_store_multiple.reg_count - 1) + 1);
     } else { /* if(get_core() >= ARM9) */
-        add_to_perf_counter(CYCLE_COUNT, (op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
+        UOP_COUNT_CYCLES((op->load_store_multiple.reg_count > 1) ? (op->load_store_multiple.reg_count - 1) : 1);
     }
 #endif
 #if COUNT_ARM_OPS
@@ -1334,7 +2650,7 @@ static inline __ALWAYS_INLINE void uop_store_multiple_s(struct uop *op)
 }
 
 // generic data process with immediate operand, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_imm(struct uop *op)
+static __UOP_HANDLER void uop_data_processing_imm(struct uop *op)
 {
     word immediate = op->data_processing_imm.immediate;
     word temp_word = get_reg(op->data_processing_imm.source_reg);
@@ -1362,7 +2678,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_imm(struct uop *op)
 }
 
 // generic data processing with register operand, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_reg(struct uop *op)
+static __UOP_HANDLER void uop_data_processing_reg(struct uop *op)
 {
     word temp_word = get_reg(op->data_processing_reg.source_reg);
     word operand2 = get_reg(op->data_processing_reg.source2_reg);
@@ -1391,7 +2707,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg(struct uop *op)
 }
 
 // generic data process with immediate operand, S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_imm_s(struct uop *op)
+static __UOP_HANDLER void uop_data_processing_imm_s(struct uop *op)
 {
     bool Rd_writeback;
     bool arith_op;
@@ -1417,25 +2733,17 @@ static inline __ALWAYS_INLINE void uop_data_processing_imm_s(struct uop *op)
         put_reg(op->data_processing_imm.dest_reg, temp_word);
 
     if (op->data_processing_imm.dest_reg != PC) {
-        set_NZ_condition(temp_word);
         if (arith_op) {
-            set_condition(PSR_CC_CARRY, carry);
-            set_condition(PSR_CC_OVL, ovl);
+            set_NZCV_condition(temp_word, carry, ovl);
         } else {
             // carry out from the shifter depending on how it was precalculated
             if (op->flags & UOPDPFLAGS_SET_CARRY_FROM_SHIFTER)
                 set_condition(PSR_CC_CARRY, op->flags & UOPDPFLAGS_CARRY_FROM_SHIFTER);
+            set_NZ_condition(temp_word);
         }
     } else {
         // destination was pc, and S bit was set, this means we swap spsr
-        reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-        // see if we're about to switch thumb state
-        if ((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-            cpu.curr_cp = NULL; // force a codepage reload
-
-        set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-        cpu.cpsr = spsr;
+        uop_restore_cpsr(TRUE);
     }
 
 #if COUNT_ARM_OPS
@@ -1447,7 +2755,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_imm_s(struct uop *op)
 }
 
 // generic data processing with register operand, S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_data_processing_reg_s(struct uop *op)
 {
     bool Rd_writeback;
     bool arith_op;
@@ -1474,21 +2782,13 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_s(struct uop *op)
         put_reg(op->data_processing_reg.dest_reg, temp_word);
 
     if (op->data_processing_reg.dest_reg != PC) {
-        set_NZ_condition(temp_word);
-        if (arith_op) {
-            set_condition(PSR_CC_CARRY, carry);
-            set_condition(PSR_CC_OVL, ovl);
-        }
+        if (arith_op)
+            set_NZCV_condition(temp_word, carry, ovl);
+        else
+            set_NZ_condition(temp_word);
     } else {
         // destination was pc, and S bit was set, this means we swap spsr
-        reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-        // see if we're about to switch thumb state
-        if ((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-            cpu.curr_cp = NULL; // force a codepage reload
-
-        set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-        cpu.cpsr = spsr;
+        uop_restore_cpsr(TRUE);
     }
 
 #if COUNT_ARM_OPS
@@ -1500,7 +2800,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_s(struct uop *op)
 }
 
 // generic data processing with immediate barrel shifter, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_imm_shift(struct uop *op)
+static inline __ALWAYS_INLINE void uop_data_processing_imm_shift(struct uop *op, int shift_opcode, bool s_bit)
 {
     bool Rd_writeback;
     bool arith_op;
@@ -1521,13 +2821,13 @@ static inline __ALWAYS_INLINE void uop_data_processing_imm_shift(struct uop *op)
     shift_imm = op->data_processing_imm_shift.shift_imm;
 
     // handle the immediate shift form of barrel shifter
-    switch (op->data_processing_imm_shift.shift_opcode) {
+    switch (shift_opcode) {
         default:
         case 0: // LSL
             if (shift_imm == 0) {
                 // shouldn't see this form, it would have been factored out into a simpler instruction
                 shifter_operand = temp_word2;
-                shifter_carry_out = get_condition(PSR_CC_CARRY);
+                shifter_carry_out = s_bit && get_condition(PSR_CC_CARRY); // only needed for the flags
             } else {
                 shifter_operand = LSL(temp_word2, shift_imm);
                 shifter_carry_out = BIT(temp_word2, 32 - shift_imm);
@@ -1581,26 +2881,18 @@ static inline __ALWAYS_INLINE void uop_data_processing_imm_shift(struct uop *op)
     if (Rd_writeback)
         put_reg(op->data_processing_imm_shift.dest_reg, temp_word);
 
-    if (op->flags & UOPDPFLAGS_S_BIT) {
+    if (s_bit) {
         if (op->data_processing_imm_shift.dest_reg != PC) {
-            set_NZ_condition(temp_word);
             if (arith_op) {
-                set_condition(PSR_CC_CARRY, carry);
-                set_condition(PSR_CC_OVL, ovl);
+                set_NZCV_condition(temp_word, carry, ovl);
             } else {
                 // carry out from the shifter
                 set_condition(PSR_CC_CARRY, shifter_carry_out);
+                set_NZ_condition(temp_word);
             }
         } else {
             // destination was pc, and S bit was set, this means we swap spsr
-            reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-            // see if we're about to switch thumb state
-            if ((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-                cpu.curr_cp = NULL; // force a codepage reload
-
-            set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-            cpu.cpsr = spsr;
+            uop_restore_cpsr(TRUE);
         }
     }
 
@@ -1613,7 +2905,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_imm_shift(struct uop *op)
 }
 
 // generic data processing with register based barrel shifter, no S bit, PC may be target
-static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
+static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op, int shift_opcode, bool s_bit)
 {
     bool Rd_writeback;
     bool arith_op;
@@ -1636,12 +2928,12 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
     temp_word3 = BITS(temp_word3, 7, 0);
 
     // handle the immediate shift form of barrel shifter
-    switch (op->data_processing_reg_shift.shift_opcode) {
+    switch (shift_opcode) {
         default:
         case 0: // LSL by reg (page A5-10)
             shifter_operand = LSL(temp_word2, temp_word3);
             if (temp_word3 == 0) {
-                shifter_carry_out = get_condition(PSR_CC_CARRY);
+                shifter_carry_out = s_bit && get_condition(PSR_CC_CARRY); // only needed for the flags
             } else if (temp_word3 < 32) {
                 shifter_carry_out = BIT(temp_word2, 32 - temp_word3);
             } else if (temp_word3 == 32) {
@@ -1653,7 +2945,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
         case 1: // LSR by reg (page A5-12)
             shifter_operand = LSR(temp_word2, temp_word3);
             if (temp_word3 == 0) {
-                shifter_carry_out = get_condition(PSR_CC_CARRY);
+                shifter_carry_out = s_bit && get_condition(PSR_CC_CARRY);
             } else if (temp_word3 < 32) {
                 shifter_carry_out = BIT(temp_word2, temp_word3 - 1);
             } else if (temp_word3 == 32) {
@@ -1665,7 +2957,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
         case 2: // ASR by reg (page A5-14)
             shifter_operand = ASR(temp_word2, temp_word3);
             if (temp_word3 == 0) {
-                shifter_carry_out = get_condition(PSR_CC_CARRY);
+                shifter_carry_out = s_bit && get_condition(PSR_CC_CARRY);
             } else if (temp_word3 < 32) {
                 shifter_carry_out = BIT(temp_word2, temp_word3 - 1);
             } else if (temp_word3 >= 32) {
@@ -1676,7 +2968,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
             word lower_4bits = BITS(temp_word3, 4, 0);
             shifter_operand = ROR(temp_word2, lower_4bits);
             if (temp_word3 == 0) {
-                shifter_carry_out = get_condition(PSR_CC_CARRY);
+                shifter_carry_out = s_bit && get_condition(PSR_CC_CARRY);
             } else if (lower_4bits == 0) {
                 shifter_carry_out = BIT(temp_word2, 31);
             } else { // temp_word3 & 0x1f > 0
@@ -1688,7 +2980,7 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
 
 #if COUNT_CYCLES
     /* shifting by a reg value costs an extra cycle */
-    add_to_perf_counter(CYCLE_COUNT, 1);
+    UOP_COUNT_CYCLES(1);
 #endif
     // do the op
     Rd_writeback = TRUE;
@@ -1703,26 +2995,18 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
     if (Rd_writeback)
         put_reg(op->data_processing_reg_shift.dest_reg, temp_word);
 
-    if (op->flags & UOPDPFLAGS_S_BIT) {
+    if (s_bit) {
         if (op->data_processing_reg_shift.dest_reg != PC) {
-            set_NZ_condition(temp_word);
             if (arith_op) {
-                set_condition(PSR_CC_CARRY, carry);
-                set_condition(PSR_CC_OVL, ovl);
+                set_NZCV_condition(temp_word, carry, ovl);
             } else {
                 // carry out from the shifter
                 set_condition(PSR_CC_CARRY, shifter_carry_out);
+                set_NZ_condition(temp_word);
             }
         } else {
             // destination was pc, and S bit was set, this means we swap spsr
-            reg_t spsr = cpu.spsr; // save it here because cpu.spsr might change in set_cpu_mode()
-
-            // see if we're about to switch thumb state
-            if ((spsr & PSR_THUMB) != (cpu.cpsr & PSR_THUMB))
-                cpu.curr_cp = NULL; // force a codepage reload
-
-            set_cpu_mode(cpu.spsr & PSR_MODE_MASK);
-            cpu.cpsr = spsr;
+            uop_restore_cpsr(TRUE);
         }
     }
 
@@ -1734,8 +3018,23 @@ static inline __ALWAYS_INLINE void uop_data_processing_reg_shift(struct uop *op)
 #endif
 }
 
+/*
+ * The decoder only hands out the specialized forms of the above, see
+ * DP_SHIFT_UOP_LIST. They are called out of line: inlined, the switch on
+ * the dp opcode gets a copy of the threaded fetch per case, per form, and
+ * the loop no longer fits in the icache.
+ */
+#define DP_SHIFT_UOP_HANDLER(opcode, handler, form, shift, s) \
+static __NO_INLINE void uop_##handler(struct uop *op) \
+{ \
+    uop_data_processing_##form##_shift(op, shift, s); \
+}
+
+DP_SHIFT_UOP_LIST(DP_SHIFT_UOP_HANDLER)
+#undef DP_SHIFT_UOP_HANDLER
+
 // simple load of immediate into register, PC may not be target
-static inline __ALWAYS_INLINE void uop_mov_imm(struct uop *op)
+static __UOP_HANDLER void uop_mov_imm(struct uop *op)
 {
     put_reg_nopc(op->simple_dp_imm.dest_reg, op->simple_dp_imm.immediate);
 
@@ -1745,7 +3044,7 @@ static inline __ALWAYS_INLINE void uop_mov_imm(struct uop *op)
 }
 
 // simple load of immediate into register, set N and Z flags, PC may not be target
-static inline __ALWAYS_INLINE void uop_mov_imm_nz(struct uop *op)
+static __UOP_HANDLER void uop_mov_imm_nz(struct uop *op)
 {
     put_reg_nopc(op->simple_dp_imm.dest_reg, op->simple_dp_imm.immediate);
     set_NZ_condition(op->simple_dp_imm.immediate);
@@ -1756,7 +3055,7 @@ static inline __ALWAYS_INLINE void uop_mov_imm_nz(struct uop *op)
 }
 
 // simple mov from register to register, PC may not be target
-static inline __ALWAYS_INLINE void uop_mov_reg(struct uop *op)
+static __UOP_HANDLER void uop_mov_reg(struct uop *op)
 {
     put_reg_nopc(op->simple_dp_reg.dest_reg, get_reg(op->simple_dp_reg.source2_reg));
 
@@ -1766,18 +3065,17 @@ static inline __ALWAYS_INLINE void uop_mov_reg(struct uop *op)
 }
 
 // simple compare of register to immediate value
-static inline __ALWAYS_INLINE void uop_cmp_imm_s(struct uop *op)
+static __UOP_HANDLER void uop_cmp_imm_s(struct uop *op)
 {
-    int carry, ovl;
+    word a = get_reg(op->simple_dp_imm.source_reg);
+    word b = ~(op->simple_dp_imm.immediate);
     word result;
 
     // subtract the immediate from the source register
-    result = do_add(get_reg(op->simple_dp_imm.source_reg), ~(op->simple_dp_imm.immediate), 1, &carry, &ovl);
+    result = a + b + 1;
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, b);
 
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
@@ -1785,18 +3083,17 @@ static inline __ALWAYS_INLINE void uop_cmp_imm_s(struct uop *op)
 }
 
 // simple compare of two registers
-static inline __ALWAYS_INLINE void uop_cmp_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_cmp_reg_s(struct uop *op)
 {
-    int carry, ovl;
+    word a = get_reg(op->simple_dp_reg.source_reg);
+    word b = ~(get_reg(op->simple_dp_reg.source2_reg));
     word result;
 
     // subtract the source2 reg from the source register
-    result = do_add(get_reg(op->simple_dp_reg.source_reg), ~(get_reg(op->simple_dp_reg.source2_reg)), 1, &carry, &ovl);
+    result = a + b + 1;
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, b);
 
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
@@ -1804,18 +3101,17 @@ static inline __ALWAYS_INLINE void uop_cmp_reg_s(struct uop *op)
 }
 
 // simple negative compare of two registers
-static inline __ALWAYS_INLINE void uop_cmn_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_cmn_reg_s(struct uop *op)
 {
-    int carry, ovl;
+    word a = get_reg(op->simple_dp_reg.source_reg);
+    word b = get_reg(op->simple_dp_reg.source2_reg);
     word result;
 
     // subtract the source2 reg from the source register
-    result = do_add(get_reg(op->simple_dp_reg.source_reg), get_reg(op->simple_dp_reg.source2_reg), 0, &carry, &ovl);
+    result = a + b;
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, b);
 
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
@@ -1823,7 +3119,7 @@ static inline __ALWAYS_INLINE void uop_cmn_reg_s(struct uop *op)
 }
 
 // bit test of two registers
-static inline __ALWAYS_INLINE void uop_tst_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_tst_reg_s(struct uop *op)
 {
     word result;
     word a;
@@ -1843,7 +3139,7 @@ static inline __ALWAYS_INLINE void uop_tst_reg_s(struct uop *op)
 }
 
 // simple add of immediate to register, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_imm(struct uop *op)
+static __UOP_HANDLER void uop_add_imm(struct uop *op)
 {
     word a;
     word result;
@@ -1858,20 +3154,17 @@ static inline __ALWAYS_INLINE void uop_add_imm(struct uop *op)
 }
 
 // simple add of immediate to register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_imm_s(struct uop *op)
+static __UOP_HANDLER void uop_add_imm_s(struct uop *op)
 {
-    int carry, ovl;
     word a;
     word result;
 
     a = get_reg(op->simple_dp_imm.source_reg);
-    result = do_add(a, op->simple_dp_imm.immediate, 0, &carry, &ovl);
+    result = a + op->simple_dp_imm.immediate;
     put_reg_nopc(op->simple_dp_imm.dest_reg, result);
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, op->simple_dp_imm.immediate);
 
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
@@ -1879,7 +3172,7 @@ static inline __ALWAYS_INLINE void uop_add_imm_s(struct uop *op)
 }
 
 // simple add of two registers, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_reg(struct uop *op)
+static __UOP_HANDLER void uop_add_reg(struct uop *op)
 {
     word a;
     word b;
@@ -1896,22 +3189,19 @@ static inline __ALWAYS_INLINE void uop_add_reg(struct uop *op)
 }
 
 // simple add of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_add_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_add_reg_s(struct uop *op)
 {
-    int carry, ovl;
     word a;
     word b;
     word result;
 
     a = get_reg(op->simple_dp_reg.source_reg);
     b = get_reg(op->simple_dp_reg.source2_reg);
-    result = do_add(a, b, 0, &carry, &ovl);
+    result = a + b;
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, b);
 
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
@@ -1919,22 +3209,19 @@ static inline __ALWAYS_INLINE void uop_add_reg_s(struct uop *op)
 }
 
 // simple add with carry of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_adc_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_adc_reg_s(struct uop *op)
 {
-    int carry, ovl;
     word a;
     word b;
     word result;
 
     a = get_reg(op->simple_dp_reg.source_reg);
     b = get_reg(op->simple_dp_reg.source2_reg);
-    result = do_add(a, b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl);
+    result = a + b + (get_condition(PSR_CC_CARRY) ? 1 : 0);
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, b);
 
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
@@ -1942,51 +3229,45 @@ static inline __ALWAYS_INLINE void uop_adc_reg_s(struct uop *op)
 }
 
 // simple subtract of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_sub_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_sub_reg_s(struct uop *op)
 {
-    int carry, ovl;
     word a;
     word b;
     word result;
 
     a = get_reg(op->simple_dp_reg.source_reg);
     b = get_reg(op->simple_dp_reg.source2_reg);
-    result = do_add(a, ~b, 1, &carry, &ovl);
+    result = a + ~b + 1;
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, ~b);
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
 #endif
 }
 
 // simple subtract with carry of two registers, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_sbc_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_sbc_reg_s(struct uop *op)
 {
-    int carry, ovl;
     word a;
     word b;
     word result;
 
     a = get_reg(op->simple_dp_reg.source_reg);
     b = get_reg(op->simple_dp_reg.source2_reg);
-    result = do_add(a, ~b, get_condition(PSR_CC_CARRY) ? 1 : 0, &carry, &ovl);
+    result = a + ~b + (get_condition(PSR_CC_CARRY) ? 1 : 0);
     put_reg(op->simple_dp_reg.dest_reg, result);
 
     // set flags on the result
-    set_NZ_condition(result);
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
+    set_add_condition(result, a, ~b);
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_DATA_PROC);
 #endif
 }
 
 // and with immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_and_imm(struct uop *op)
+static __UOP_HANDLER void uop_and_imm(struct uop *op)
 {
     word a;
     word result;
@@ -2002,7 +3283,7 @@ static inline __ALWAYS_INLINE void uop_and_imm(struct uop *op)
 }
 
 // or with immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_orr_imm(struct uop *op)
+static __UOP_HANDLER void uop_orr_imm(struct uop *op)
 {
     word a;
     word result;
@@ -2018,7 +3299,7 @@ static inline __ALWAYS_INLINE void uop_orr_imm(struct uop *op)
 }
 
 // or by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_orr_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_orr_reg_s(struct uop *op)
 {
     word a;
     word b;
@@ -2037,7 +3318,7 @@ static inline __ALWAYS_INLINE void uop_orr_reg_s(struct uop *op)
 }
 
 // shift left of register by immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_imm(struct uop *op)
+static __UOP_HANDLER void uop_lsl_imm(struct uop *op)
 {
     word a;
     word shift;
@@ -2056,7 +3337,7 @@ static inline __ALWAYS_INLINE void uop_lsl_imm(struct uop *op)
 }
 
 // shift left of register by immediate, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_imm_s(struct uop *op)
+static __UOP_HANDLER void uop_lsl_imm_s(struct uop *op)
 {
     int carry;
     word a;
@@ -2074,8 +3355,8 @@ static inline __ALWAYS_INLINE void uop_lsl_imm_s(struct uop *op)
         result = a;
     }
 
-    set_NZ_condition(result);
     set_condition(PSR_CC_CARRY, carry);
+    set_NZ_condition(result);
     put_reg_nopc(op->simple_dp_imm.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2084,7 +3365,7 @@ static inline __ALWAYS_INLINE void uop_lsl_imm_s(struct uop *op)
 }
 
 // shift left of register by register, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_reg(struct uop *op)
+static __UOP_HANDLER void uop_lsl_reg(struct uop *op)
 {
     word a;
     word shift;
@@ -2104,7 +3385,7 @@ static inline __ALWAYS_INLINE void uop_lsl_reg(struct uop *op)
 }
 
 // shift left of register by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsl_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_lsl_reg_s(struct uop *op)
 {
     int carry;
     word a;
@@ -2126,8 +3407,8 @@ static inline __ALWAYS_INLINE void uop_lsl_reg_s(struct uop *op)
         carry = 0;
     }
 
-    set_NZ_condition(result);
     set_condition(PSR_CC_CARRY, carry);
+    set_NZ_condition(result);
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2136,7 +3417,7 @@ static inline __ALWAYS_INLINE void uop_lsl_reg_s(struct uop *op)
 }
 
 // logical shift right by immediate, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_imm(struct uop *op)
+static __UOP_HANDLER void uop_lsr_imm(struct uop *op)
 {
     word a;
     word immed;
@@ -2155,7 +3436,7 @@ static inline __ALWAYS_INLINE void uop_lsr_imm(struct uop *op)
 }
 
 // logical shift right by immediate, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_imm_s(struct uop *op)
+static __UOP_HANDLER void uop_lsr_imm_s(struct uop *op)
 {
     int carry;
     word a;
@@ -2173,8 +3454,8 @@ static inline __ALWAYS_INLINE void uop_lsr_imm_s(struct uop *op)
         result = 0;
     }
 
-    set_NZ_condition(result);
     set_condition(PSR_CC_CARRY, carry);
+    set_NZ_condition(result);
     put_reg_nopc(op->simple_dp_imm.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2183,7 +3464,7 @@ static inline __ALWAYS_INLINE void uop_lsr_imm_s(struct uop *op)
 }
 
 // logical shift right by register, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_reg(struct uop *op)
+static __UOP_HANDLER void uop_lsr_reg(struct uop *op)
 {
     word a;
     word shift;
@@ -2203,7 +3484,7 @@ static inline __ALWAYS_INLINE void uop_lsr_reg(struct uop *op)
 }
 
 // logical shift right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_lsr_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_lsr_reg_s(struct uop *op)
 {
     int carry;
     word a;
@@ -2225,8 +3506,8 @@ static inline __ALWAYS_INLINE void uop_lsr_reg_s(struct uop *op)
         carry = 0;
     }
 
-    set_NZ_condition(result);
     set_condition(PSR_CC_CARRY, carry);
+    set_NZ_condition(result);
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2235,7 +3516,7 @@ static inline __ALWAYS_INLINE void uop_lsr_reg_s(struct uop *op)
 }
 
 // arithmetic shift right by immediate,  PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_imm(struct uop *op)
+static __UOP_HANDLER void uop_asr_imm(struct uop *op)
 {
     word a;
     word immed;
@@ -2254,7 +3535,7 @@ static inline __ALWAYS_INLINE void uop_asr_imm(struct uop *op)
 }
 
 // arithmetic shift right by immediate, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_imm_s(struct uop *op)
+static __UOP_HANDLER void uop_asr_imm_s(struct uop *op)
 {
     int carry;
     word a;
@@ -2275,8 +3556,8 @@ static inline __ALWAYS_INLINE void uop_asr_imm_s(struct uop *op)
         result = ASR(a, immed);
     }
 
-    set_NZ_condition(result);
     set_condition(PSR_CC_CARRY, carry);
+    set_NZ_condition(result);
     put_reg_nopc(op->simple_dp_imm.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2285,7 +3566,7 @@ static inline __ALWAYS_INLINE void uop_asr_imm_s(struct uop *op)
 }
 
 // arithmetic shift right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_reg(struct uop *op)
+static __UOP_HANDLER void uop_asr_reg(struct uop *op)
 {
     word a;
     word shift;
@@ -2305,7 +3586,7 @@ static inline __ALWAYS_INLINE void uop_asr_reg(struct uop *op)
 }
 
 // arithmetic shift right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_asr_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_asr_reg_s(struct uop *op)
 {
     int carry;
     word a;
@@ -2325,8 +3606,8 @@ static inline __ALWAYS_INLINE void uop_asr_reg_s(struct uop *op)
         carry = BIT(a, 31);
     }
 
-    set_NZ_condition(result);
     set_condition(PSR_CC_CARRY, carry);
+    set_NZ_condition(result);
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2335,7 +3616,7 @@ static inline __ALWAYS_INLINE void uop_asr_reg_s(struct uop *op)
 }
 
 // rotate right by register, PC may not be target
-static inline __ALWAYS_INLINE void uop_ror_reg(struct uop *op)
+static __UOP_HANDLER void uop_ror_reg(struct uop *op)
 {
     word a;
     word rotate;
@@ -2355,7 +3636,7 @@ static inline __ALWAYS_INLINE void uop_ror_reg(struct uop *op)
 }
 
 // rotate right by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_ror_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_ror_reg_s(struct uop *op)
 {
     int carry;
     word a;
@@ -2376,8 +3657,8 @@ static inline __ALWAYS_INLINE void uop_ror_reg_s(struct uop *op)
         carry = BIT(a, rotate_lower_4_bits - 1);
     }
 
-    set_NZ_condition(result);
     set_condition(PSR_CC_CARRY, carry);
+    set_NZ_condition(result);
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2386,7 +3667,7 @@ static inline __ALWAYS_INLINE void uop_ror_reg_s(struct uop *op)
 }
 
 // and by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_and_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_and_reg_s(struct uop *op)
 {
     word a;
     word b;
@@ -2405,7 +3686,7 @@ static inline __ALWAYS_INLINE void uop_and_reg_s(struct uop *op)
 }
 
 // xor by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_eor_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_eor_reg_s(struct uop *op)
 {
     word a;
     word b;
@@ -2424,7 +3705,7 @@ static inline __ALWAYS_INLINE void uop_eor_reg_s(struct uop *op)
 }
 
 // bit clear by register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_bic_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_bic_reg_s(struct uop *op)
 {
     word a;
     word b;
@@ -2443,18 +3724,15 @@ static inline __ALWAYS_INLINE void uop_bic_reg_s(struct uop *op)
 }
 
 // negate register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_neg_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_neg_reg_s(struct uop *op)
 {
-    int carry, ovl;
     word b;
     word result;
 
-    b = get_reg(op->simple_dp_reg.source2_reg);
-    result = do_add(0, ~b, 1, &carry, &ovl);
+    b = ~get_reg(op->simple_dp_reg.source2_reg);
+    result = b + 1;
 
-    set_condition(PSR_CC_CARRY, carry);
-    set_condition(PSR_CC_OVL, ovl);
-    set_NZ_condition(result);
+    set_add_condition(result, 0, b);
     put_reg_nopc(op->simple_dp_reg.dest_reg, result);
 
 #if COUNT_ARM_OPS
@@ -2463,7 +3741,7 @@ static inline __ALWAYS_INLINE void uop_neg_reg_s(struct uop *op)
 }
 
 // bitwise negation register, S bit, PC may not be target
-static inline __ALWAYS_INLINE void uop_mvn_reg_s(struct uop *op)
+static __UOP_HANDLER void uop_mvn_reg_s(struct uop *op)
 {
     word b;
     word result;
@@ -2479,7 +3757,7 @@ static inline __ALWAYS_INLINE void uop_mvn_reg_s(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_multiply(struct uop *op)
+static __UOP_HANDLER void uop_multiply(struct uop *op)
 {
     // multiply the first two operands
     word temp_word = get_reg(op->mul.source_reg);
@@ -2502,14 +3780,14 @@ static inline __ALWAYS_INLINE void uop_multiply(struct uop *op)
         int signed_word = temp_word;
 
         if ((signed_word >> 8) == 0 || (signed_word >> 8) == -1)
-            add_to_perf_counter(CYCLE_COUNT, 1);
+            UOP_COUNT_CYCLES(1);
         else if ((signed_word >> 16) == 0 || (signed_word >> 16) == -1)
-            add_to_perf_counter(CYCLE_COUNT, 2);
+            UOP_COUNT_CYCLES(2);
         else if ((signed_word >> 24) == 0 || (signed_word >> 24) == -1)
-            add_to_perf_counter(CYCLE_COUNT, 3);
+            UOP_COUNT_CYCLES(3);
     } else { /* if(get_core() == ARM9e) */
         /* ARM9e core can do the multiply in 2 cycles, with an interlock */
-        add_to_perf_counter(CYCLE_COUNT, 1);
+        UOP_COUNT_CYCLES(1);
         // XXX schedule interlock here
     }
 #endif
@@ -2518,7 +3796,7 @@ static inline __ALWAYS_INLINE void uop_multiply(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_multiply_long(struct uop *op)
+static __UOP_HANDLER void uop_multiply_long(struct uop *op)
 {
     word reslo, reshi;
     uint64_t result;
@@ -2558,14 +3836,14 @@ static inline __ALWAYS_INLINE void uop_multiply_long(struct uop *op)
     // cycle count
     if (get_core() <= ARM9) {
         if ((temp_word >> 8) == 0)
-            add_to_perf_counter(CYCLE_COUNT, 2);
+            UOP_COUNT_CYCLES(2);
         else if ((temp_word >> 16) == 0)
-            add_to_perf_counter(CYCLE_COUNT, 3);
+            UOP_COUNT_CYCLES(3);
         else if ((temp_word >> 24) == 0)
-            add_to_perf_counter(CYCLE_COUNT, 4);
+            UOP_COUNT_CYCLES(4);
     } else { /* if(get_core() == ARM9e) */
         /* ARM9e core can do the multiply in 3 cycles, with an interlock */
-        add_to_perf_counter(CYCLE_COUNT, 2);
+        UOP_COUNT_CYCLES(2);
         // XXX schedule interlock here
     }
 #endif
@@ -2574,7 +3852,7 @@ static inline __ALWAYS_INLINE void uop_multiply_long(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_swap(struct uop *op)
+static __UOP_COLD_HANDLER void uop_swap(struct uop *op)
 {
     word mem_reg_val, source_reg_val;
     armaddr_t addr;
@@ -2624,7 +3902,7 @@ static inline __ALWAYS_INLINE void uop_swap(struct uop *op)
     }
 }
 
-static inline __ALWAYS_INLINE void uop_count_leading_zeros(struct uop *op)
+static __UOP_HANDLER void uop_count_leading_zeros(struct uop *op)
 {
     word val;
     int count;
@@ -2647,7 +3925,7 @@ static inline __ALWAYS_INLINE void uop_count_leading_zeros(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_move_to_sr_imm(struct uop *op)
+static __UOP_COLD_HANDLER void uop_move_to_sr_imm(struct uop *op)
 {
     reg_t old_psr, new_psr;
 
@@ -2656,6 +3934,7 @@ static inline __ALWAYS_INLINE void uop_move_to_sr_imm(struct uop *op)
         old_psr = cpu.spsr;
     } else {
         // cpsr
+        flush_lazy_flags();
         old_psr = cpu.cpsr;
     }
 
@@ -2677,11 +3956,12 @@ static inline __ALWAYS_INLINE void uop_move_to_sr_imm(struct uop *op)
         // cpsr
         set_cpu_mode(new_psr & PSR_MODE_MASK);
         cpu.cpsr = new_psr;
+        uop_cpsr_written();
 
 #if COUNT_CYCLES
         // cycle count
         if (field_mask & 0x00ffffff)
-            add_to_perf_counter(CYCLE_COUNT, 2); // we updated something other than the status flags
+            UOP_COUNT_CYCLES(2); // we updated something other than the status flags
 #endif
     }
 
@@ -2690,7 +3970,7 @@ static inline __ALWAYS_INLINE void uop_move_to_sr_imm(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_move_to_sr_reg(struct uop *op)
+static __UOP_COLD_HANDLER void uop_move_to_sr_reg(struct uop *op)
 {
     reg_t old_psr, new_psr;
 
@@ -2699,6 +3979,7 @@ static inline __ALWAYS_INLINE void uop_move_to_sr_reg(struct uop *op)
         old_psr = cpu.spsr;
     } else {
         // cpsr
+        flush_lazy_flags();
         old_psr = cpu.cpsr;
     }
 
@@ -2721,11 +4002,12 @@ static inline __ALWAYS_INLINE void uop_move_to_sr_reg(struct uop *op)
         // cpsr
         set_cpu_mode(new_psr & PSR_MODE_MASK);
         cpu.cpsr = new_psr;
+        uop_cpsr_written();
 
 #if COUNT_CYCLES
         // cycle count
         if (field_mask & 0x00ffffff)
-            add_to_perf_counter(CYCLE_COUNT, 2); // we updated something other than the status flags
+            UOP_COUNT_CYCLES(2); // we updated something other than the status flags
 #endif
     }
 
@@ -2734,12 +4016,13 @@ static inline __ALWAYS_INLINE void uop_move_to_sr_reg(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_move_from_sr(struct uop *op)
+static __UOP_COLD_HANDLER void uop_move_from_sr(struct uop *op)
 {
     if (op->flags & UOPMSR_R_BIT) {
         // NOTE: UNPREDICTABLE if the cpu is in user or system mode
         put_reg(op->move_from_sr.reg, cpu.spsr);
     } else {
+        flush_lazy_flags();
         put_reg(op->move_from_sr.reg, cpu.cpsr);
     }
 
@@ -2749,55 +4032,58 @@ static inline __ALWAYS_INLINE void uop_move_from_sr(struct uop *op)
 #if COUNT_CYCLES
     // 2 cycles on arm9+
     if (get_core() >= ARM9)
-        add_to_perf_counter(CYCLE_COUNT, 1);
+        UOP_COUNT_CYCLES(1);
 #endif
 }
 
 
-static inline __ALWAYS_INLINE void uop_undefined(struct uop *op)
+static __UOP_COLD_HANDLER void uop_undefined(struct uop *op)
 {
     atomic_or(&cpu.pending_exceptions, EX_UNDEFINED);
+    cpu_request_exit();
 
 //  UOP_TRACE(0, "undefined instruction at 0x%x\n", get_reg(PC));
 
 #if COUNT_CYCLES
     if (get_core() == ARM7)
-        add_to_perf_counter(CYCLE_COUNT, 3);
+        UOP_COUNT_CYCLES(3);
     else /* if(get_core() >= ARM9) */
-        add_to_perf_counter(CYCLE_COUNT, 2);
+        UOP_COUNT_CYCLES(2);
 #endif
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_MISC);
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_swi(struct uop *op)
+static __UOP_COLD_HANDLER void uop_swi(struct uop *op)
 {
     atomic_or(&cpu.pending_exceptions, EX_SWI);
+    cpu_request_exit();
 
     // always takes 3 cycles
 #if COUNT_CYCLES
-    add_to_perf_counter(CYCLE_COUNT, 2);
+    UOP_COUNT_CYCLES(2);
 #endif
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_MISC);
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_bkpt(struct uop *op)
+static __UOP_COLD_HANDLER void uop_bkpt(struct uop *op)
 {
     atomic_or(&cpu.pending_exceptions, EX_PREFETCH);
+    cpu_request_exit();
 
     // always takes 3 cycles
 #if COUNT_CYCLES
-    add_to_perf_counter(CYCLE_COUNT, 2);
+    UOP_COUNT_CYCLES(2);
 #endif
 #if COUNT_ARM_OPS
     inc_perf_counter(OP_MISC);
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_coproc_reg_transfer(struct uop *op)
+static __UOP_COLD_HANDLER void uop_coproc_reg_transfer(struct uop *op)
 {
     struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
 
@@ -2813,7 +4099,7 @@ static inline __ALWAYS_INLINE void uop_coproc_reg_transfer(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_coproc_double_reg_transfer(struct uop *op)
+static __UOP_COLD_HANDLER void uop_coproc_double_reg_transfer(struct uop *op)
 {
     struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
 
@@ -2829,7 +4115,7 @@ static inline __ALWAYS_INLINE void uop_coproc_double_reg_transfer(struct uop *op
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_coproc_data_processing(struct uop *op)
+static __UOP_COLD_HANDLER void uop_coproc_data_processing(struct uop *op)
 {
     struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
 
@@ -2845,7 +4131,7 @@ static inline __ALWAYS_INLINE void uop_coproc_data_processing(struct uop *op)
 #endif
 }
 
-static inline __ALWAYS_INLINE void uop_coproc_load_store(struct uop *op)
+static __UOP_COLD_HANDLER void uop_coproc_load_store(struct uop *op)
 {
     struct arm_coprocessor *cp = &cpu.coproc[op->coproc.cp_num];
 
@@ -2861,315 +4147,382 @@ static inline __ALWAYS_INLINE void uop_coproc_load_store(struct uop *op)
 #endif
 }
 
-int uop_dispatch_loop(void)
+static __UOP_HANDLER void uop_nop(struct uop *op)
 {
-    process_pending_exceptions();
+#if COUNT_ARM_OPS
+    inc_perf_counter(OP_NOP);
+#endif
+}
 
-    /* main dispatch loop */
-    for (;;) {
-        struct uop *op;
+/*
+ * Fused pairs, see uop_fuse(). The second half gets counted here when the
+ * fused op ends the block, otherwise the block count covers it already.
+ */
+static inline __ALWAYS_INLINE void uop_fused_next(struct uop *op, bool count)
+{
+    int pc_inc = cpu.curr_cp->pc_inc;
 
-        UOP_TRACE(10, "\nUOP: start of new cycle\n");
+    cpu.pc += pc_inc;
+    if (op[1].reads_pc)
+        cpu.r[PC] = cpu.pc + pc_inc;
+    cpu.cp_pc++;
 
-        // in the last instruction we wrote something else into r[PC], so sync it with
-        // the real program counter cpu.pc
-        if (unlikely(cpu.r15_dirty)) {
-            UOP_TRACE(9, "UOP: r15 dirty\n");
-            cpu.r15_dirty = FALSE;
+    if (count) {
+        inc_perf_counter(INS_COUNT);
+#if COUNT_CYCLES
+        UOP_COUNT_CYCLES(1);
+#endif
+    }
+#if COUNT_FUSED_UOPS
+    inc_perf_counter(FUSED_UOP_BASE + op->opcode - FUSED_UOP_FIRST);
+#endif
+}
 
-            if (cpu.curr_cp) {
-                if ((cpu.pc >> MMU_PAGESIZE_SHIFT) == (cpu.r[PC] >> MMU_PAGESIZE_SHIFT)) {
-                    cpu.cp_pc = PC_TO_CPPC(cpu.r[PC]);
-                } else {
-                    cpu.curr_cp = NULL; // will load a new codepage in a few lines
-                }
-            }
-            cpu.pc = cpu.r[PC];
-        }
+static inline __ALWAYS_INLINE void uop_fused_branch_local(struct uop *op)
+{
+    struct uop *b = op + 1;
 
-        // check for exceptions
-        if (unlikely(cpu.pending_exceptions != 0)) {
-            // something may be pending
-            if (cpu.pending_exceptions & ~(cpu.cpsr & (PSR_IRQ_MASK|PSR_FIQ_MASK))) {
-                if (process_pending_exceptions())
-                    continue;
-            }
-        }
+    uop_fused_next(op, TRUE);
+    if (check_condition(b->cond))
+        uop_b_immediate_local(b);
+#if COUNT_ARM_OPS
+    else
+        inc_perf_counter(OP_SKIPPED_CONDITION);
+#endif
+}
 
-        /* see if we are off the end of a codepage, or the codepage was removed out from underneath us */
-        if (unlikely(cpu.curr_cp == NULL)) {
-            UOP_TRACE(7, "UOP: curr_cp == NULL, setting new codepage\n");
-            if (set_codepage(cpu.pc))
-                continue; // MMU translation error reading it
-        }
+static __UOP_HANDLER void uop_cmp_imm_branch_local(struct uop *op)
+{
+    uop_cmp_imm_s(op);
+    uop_fused_branch_local(op);
+}
 
-        ASSERT(cpu.curr_cp != NULL);
-        ASSERT(cpu.cp_pc != NULL);
+static __UOP_HANDLER void uop_cmp_reg_branch_local(struct uop *op)
+{
+    uop_cmp_reg_s(op);
+    uop_fused_branch_local(op);
+}
 
-        // instruction count
-        inc_perf_counter(INS_COUNT);
-#if COUNT_CYCLES
-        inc_perf_counter(CYCLE_COUNT);
-#endif
+static __UOP_HANDLER void uop_add_imm_s_branch_local(struct uop *op)
+{
+    uop_add_imm_s(op);
+    uop_fused_branch_local(op);
+}
 
-        /* get the next op and dispatch it */
-        op = cpu.cp_pc;
-        UOP_TRACE(8, "UOP: opcode %3d %32s, pc 0x%x, cp_pc %p, curr_cp %p\n", op->opcode, uop_opcode_to_str(op->opcode), cpu.pc, cpu.cp_pc, cpu.curr_cp);
-#if COUNT_UOPS
-        inc_perf_counter(UOP_BASE + op->opcode);
-#endif
+static __UOP_HANDLER void uop_load_add_imm(struct uop *op)
+{
+    uop_load_immediate_offset(op);
 
-        /* increment the program counter */
-        int pc_inc = cpu.curr_cp->pc_inc;
-        cpu.pc += pc_inc; // next pc
-        cpu.r[PC] = cpu.pc + pc_inc; // during the course of the instruction, r15 looks like it's +8 or +4 (arm vs thumb)
-        cpu.cp_pc++;
+    // if the load faulted, leave the add to run on its own later
+    if (unlikely(cpu.exit_request != 0))
+        return;
 
-        if (TRACE_CPU_LEVEL >= 10
-                && op->opcode != DECODE_ME_ARM
-                && op->opcode != DECODE_ME_THUMB)
-            dump_cpu();
+    uop_fused_next(op, TRUE);
+    uop_add_imm(op + 1);
+}
 
-        /* check to see if we should execute it */
-        if (unlikely(!check_condition(op->cond))) {
-            UOP_TRACE(8, "UOP: opcode not executed due to condition 0x%x\n", op->cond);
-#if COUNT_ARM_OPS
-            inc_perf_counter(OP_SKIPPED_CONDITION);
-#endif
-            continue; // not executed
-        }
+static inline __ALWAYS_INLINE void uop_fused_mov(struct uop *op)
+{
+    struct uop *b = op + 1;
 
-        /* dispatch */
-        switch (op->opcode) {
-            case NOP:
+    uop_fused_next(op, FALSE);
+    if (b->opcode == MOV_IMM)
+        uop_mov_imm(b);
+    else
+        uop_mov_reg(b);
+}
+
+static __UOP_HANDLER void uop_mov_imm_mov(struct uop *op)
+{
+    uop_mov_imm(op);
+    uop_fused_mov(op);
+}
+
+static __UOP_HANDLER void uop_mov_reg_mov(struct uop *op)
+{
+    uop_mov_reg(op);
+    uop_fused_mov(op);
+}
+
+#define UOP_DP_SHIFT_HANDLER(opcode, handler, form, shift, s) UOP_HANDLER(opcode, uop_##handler, WRITES_PC)
+
+/* opcode -> handler map and block tag (see below), expanded into either the switch or the threaded jump table */
+#define UOP_HANDLER_LIST \
+    UOP_HANDLER(NOP, uop_nop, STRAIGHT) \
+    UOP_HANDLER(DECODE_ME_ARM, uop_decode_me_arm, ENDS_BLOCK) \
+    UOP_HANDLER(DECODE_ME_THUMB, uop_decode_me_thumb, ENDS_BLOCK) \
+    UOP_HANDLER(B_IMMEDIATE, uop_b_immediate, ENDS_BLOCK) \
+    UOP_HANDLER(B_IMMEDIATE_LOCAL, uop_b_immediate_local, ENDS_BLOCK) \
+    UOP_HANDLER(B_REG, uop_b_reg, ENDS_BLOCK) \
+    UOP_HANDLER(B_REG_OFFSET, uop_b_reg_offset, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_IMMEDIATE_WORD, uop_load_immediate_word, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_IMMEDIATE_HALFWORD, uop_load_immediate_halfword, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_IMMEDIATE_BYTE, uop_load_immediate_byte, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_IMMEDIATE_OFFSET, uop_load_immediate_offset, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_SCALED_REG_OFFSET, uop_load_scaled_reg_offset, ENDS_BLOCK) \
+    UOP_HANDLER(STORE_IMMEDIATE_OFFSET, uop_store_immediate_offset, ENDS_BLOCK) \
+    UOP_HANDLER(STORE_SCALED_REG_OFFSET, uop_store_scaled_reg_offset, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_MULTIPLE, uop_load_multiple, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_MULTIPLE_S, uop_load_multiple_s, ENDS_BLOCK) \
+    UOP_HANDLER(STORE_MULTIPLE, uop_store_multiple, ENDS_BLOCK) \
+    UOP_HANDLER(STORE_MULTIPLE_S, uop_store_multiple_s, ENDS_BLOCK) \
+    UOP_HANDLER(DATA_PROCESSING_IMM, uop_data_processing_imm, WRITES_PC) \
+    UOP_HANDLER(DATA_PROCESSING_REG, uop_data_processing_reg, WRITES_PC) \
+    UOP_HANDLER(DATA_PROCESSING_IMM_S, uop_data_processing_imm_s, WRITES_PC) \
+    UOP_HANDLER(DATA_PROCESSING_REG_S, uop_data_processing_reg_s, WRITES_PC) \
+    DP_SHIFT_UOP_LIST(UOP_DP_SHIFT_HANDLER) \
+    UOP_HANDLER(MOV_IMM, uop_mov_imm, STRAIGHT) \
+    UOP_HANDLER(MOV_IMM_NZ, uop_mov_imm_nz, STRAIGHT) \
+    UOP_HANDLER(MOV_REG, uop_mov_reg, STRAIGHT) \
+    UOP_HANDLER(CMP_IMM_S, uop_cmp_imm_s, STRAIGHT) \
+    UOP_HANDLER(CMP_REG_S, uop_cmp_reg_s, STRAIGHT) \
+    UOP_HANDLER(CMN_REG_S, uop_cmn_reg_s, STRAIGHT) \
+    UOP_HANDLER(TST_REG_S, uop_tst_reg_s, STRAIGHT) \
+    UOP_HANDLER(ADD_IMM, uop_add_imm, STRAIGHT) \
+    UOP_HANDLER(ADD_IMM_S, uop_add_imm_s, STRAIGHT) \
+    UOP_HANDLER(ADD_REG, uop_add_reg, STRAIGHT) \
+    UOP_HANDLER(ADD_REG_S, uop_add_reg_s, STRAIGHT) \
+    UOP_HANDLER(ADC_REG_S, uop_adc_reg_s, STRAIGHT) \
+    UOP_HANDLER(SUB_REG_S, uop_sub_reg_s, STRAIGHT) \
+    UOP_HANDLER(SBC_REG_S, uop_sbc_reg_s, WRITES_PC) \
+    UOP_HANDLER(AND_IMM, uop_and_imm, STRAIGHT) \
+    UOP_HANDLER(ORR_IMM, uop_orr_imm, STRAIGHT) \
+    UOP_HANDLER(ORR_REG_S, uop_orr_reg_s, STRAIGHT) \
+    UOP_HANDLER(LSL_IMM, uop_lsl_imm, STRAIGHT) \
+    UOP_HANDLER(LSL_IMM_S, uop_lsl_imm_s, STRAIGHT) \
+    UOP_HANDLER(LSL_REG, uop_lsl_reg, STRAIGHT) \
+    UOP_HANDLER(LSL_REG_S, uop_lsl_reg_s, STRAIGHT) \
+    UOP_HANDLER(LSR_IMM, uop_lsr_imm, STRAIGHT) \
+    UOP_HANDLER(LSR_IMM_S, uop_lsr_imm_s, STRAIGHT) \
+    UOP_HANDLER(LSR_REG, uop_lsr_reg, STRAIGHT) \
+    UOP_HANDLER(LSR_REG_S, uop_lsr_reg_s, STRAIGHT) \
+    UOP_HANDLER(ASR_IMM, uop_asr_imm, STRAIGHT) \
+    UOP_HANDLER(ASR_IMM_S, uop_asr_imm_s, STRAIGHT) \
+    UOP_HANDLER(ASR_REG, uop_asr_reg, STRAIGHT) \
+    UOP_HANDLER(ASR_REG_S, uop_asr_reg_s, STRAIGHT) \
+    UOP_HANDLER(ROR_REG, uop_ror_reg, STRAIGHT) \
+    UOP_HANDLER(ROR_REG_S, uop_ror_reg_s, STRAIGHT) \
+    UOP_HANDLER(AND_REG_S, uop_and_reg_s, STRAIGHT) \
+    UOP_HANDLER(EOR_REG_S, uop_eor_reg_s, STRAIGHT) \
+    UOP_HANDLER(BIC_REG_S, uop_bic_reg_s, STRAIGHT) \
+    UOP_HANDLER(NEG_REG_S, uop_neg_reg_s, STRAIGHT) \
+    UOP_HANDLER(MVN_REG_S, uop_mvn_reg_s, STRAIGHT) \
+    UOP_HANDLER(MULTIPLY, uop_multiply, WRITES_PC) \
+    UOP_HANDLER(MULTIPLY_LONG, uop_multiply_long, WRITES_PC) \
+    UOP_HANDLER(SWAP, uop_swap, ENDS_BLOCK) \
+    UOP_HANDLER(COUNT_LEADING_ZEROS, uop_count_leading_zeros, WRITES_PC) \
+    UOP_HANDLER(MOVE_TO_SR_IMM, uop_move_to_sr_imm, ENDS_BLOCK) \
+    UOP_HANDLER(MOVE_TO_SR_REG, uop_move_to_sr_reg, ENDS_BLOCK) \
+    UOP_HANDLER(MOVE_FROM_SR, uop_move_from_sr, WRITES_PC) \
+    UOP_HANDLER(UNDEFINED, uop_undefined, ENDS_BLOCK) \
+    UOP_HANDLER(SWI, uop_swi, ENDS_BLOCK) \
+    UOP_HANDLER(BKPT, uop_bkpt, ENDS_BLOCK) \
+    UOP_HANDLER(COPROC_REG_TRANSFER, uop_coproc_reg_transfer, ENDS_BLOCK) \
+    UOP_HANDLER(COPROC_DOUBLE_REG_TRANSFER, uop_coproc_double_reg_transfer, ENDS_BLOCK) \
+    UOP_HANDLER(COPROC_DATA_PROCESSING, uop_coproc_data_processing, ENDS_BLOCK) \
+    UOP_HANDLER(COPROC_LOAD_STORE, uop_coproc_load_store, ENDS_BLOCK) \
+    UOP_HANDLER(CMP_IMM_BRANCH_LOCAL, uop_cmp_imm_branch_local, ENDS_BLOCK) \
+    UOP_HANDLER(CMP_REG_BRANCH_LOCAL, uop_cmp_reg_branch_local, ENDS_BLOCK) \
+    UOP_HANDLER(ADD_IMM_S_BRANCH_LOCAL, uop_add_imm_s_branch_local, ENDS_BLOCK) \
+    UOP_HANDLER(LOAD_ADD_IMM, uop_load_add_imm, ENDS_BLOCK) \
+    UOP_HANDLER(MOV_IMM_MOV, uop_mov_imm_mov, STRAIGHT) \
+    UOP_HANDLER(MOV_REG_MOV, uop_mov_reg_mov, STRAIGHT)
+
+#if COUNT_UOPS
+#define UOP_COUNT_UOP(op) inc_perf_counter(UOP_BASE + (op)->opcode)
+#else
+#define UOP_COUNT_UOP(op) do { } while (0)
+#endif
 #if COUNT_ARM_OPS
-                inc_perf_counter(OP_NOP);
+#define UOP_COUNT_SKIPPED() inc_perf_counter(OP_SKIPPED_CONDITION)
+#else
+#define UOP_COUNT_SKIPPED() do { } while (0)
 #endif
-                break;
-            case DECODE_ME_ARM:
-                uop_decode_me_arm(op);
-                break;
-            case DECODE_ME_THUMB:
-                uop_decode_me_thumb(op);
-                break;
-            case B_IMMEDIATE:
-                uop_b_immediate(op);
-                break;
-            case B_IMMEDIATE_LOCAL:
-                uop_b_immediate_local(op);
-                break;
-            case B_REG:
-                uop_b_reg(op);
-                break;
-            case B_REG_OFFSET:
-                uop_b_reg_offset(op);
-                break;
-            case LOAD_IMMEDIATE_WORD:
-                uop_load_immediate_word(op);
-                break;
-            case LOAD_IMMEDIATE_HALFWORD:
-                uop_load_immediate_halfword(op);
-                break;
-            case LOAD_IMMEDIATE_BYTE:
-                uop_load_immediate_byte(op);
-                break;
-            case LOAD_IMMEDIATE_OFFSET:
-                uop_load_immediate_offset(op);
-                break;
-            case LOAD_SCALED_REG_OFFSET:
-                uop_load_scaled_reg_offset(op);
-                break;
-            case STORE_IMMEDIATE_OFFSET:
-                uop_store_immediate_offset(op);
-                break;
-            case STORE_SCALED_REG_OFFSET:
-                uop_store_scaled_reg_offset(op);
-                break;
-            case LOAD_MULTIPLE:         // simple multiple load, no S bit
-                uop_load_multiple(op);
-                break;
-            case LOAD_MULTIPLE_S:               // multiple load, with S bit
-                uop_load_multiple_s(op);
-                break;
-            case STORE_MULTIPLE:            // simple multiple store, no S bit
-                uop_store_multiple(op);
-                break;
-            case STORE_MULTIPLE_S:      // multiple store with S bit
-                uop_store_multiple_s(op);
-                break;
-            case DATA_PROCESSING_IMM:       // plain instruction, no barrel shifter, no condition flag update, immediate operand
-                uop_data_processing_imm(op);
-                break;
-            case DATA_PROCESSING_REG:       // plain instruction, no barrel shifter, no condition flag update, no writeback, register operand
-                uop_data_processing_reg(op);
-                break;
-            case DATA_PROCESSING_IMM_S: // same as above but S bit set, update condition flags, writeback conditional on op
-                uop_data_processing_imm_s(op);
-                break;
-            case DATA_PROCESSING_REG_S: // same as above but S bit set, update condition flags, writeback conditional on op
-                uop_data_processing_reg_s(op);
-                break;
-            case DATA_PROCESSING_IMM_SHIFT: // barrel shifter involved, immediate operands to shifter, S bit may apply
-                uop_data_processing_imm_shift(op);
-                break;
-            case DATA_PROCESSING_REG_SHIFT: // barrel shifter involved, register operands to shifter, S bit may apply
-                uop_data_processing_reg_shift(op);
-                break;
-            case MOV_IMM: // move immediate value into register
-                uop_mov_imm(op);
-                break;
-            case MOV_IMM_NZ: // move immediate value into register, set NZ condition
-                uop_mov_imm_nz(op);
-                break;
-            case MOV_REG: // move one register to another
-                uop_mov_reg(op);
-                break;
-            case CMP_IMM_S: // compare with immediate, set full conditions
-                uop_cmp_imm_s(op);
-                break;
-            case CMP_REG_S: // compare with another register, set full conditions
-                uop_cmp_reg_s(op);
-                break;
-            case CMN_REG_S:
-                uop_cmn_reg_s(op);
-                break;
-            case TST_REG_S:
-                uop_tst_reg_s(op);
-                break;
-            case ADD_IMM: // add a value to a register and store it into another register
-                uop_add_imm(op);
-                break;
-            case ADD_IMM_S: // add a value to a register and store it into another register, set condition flags
-                uop_add_imm_s(op);
-                break;
-            case ADD_REG: // add two registers and store in a third
-                uop_add_reg(op);
-                break;
-            case ADD_REG_S: // add two registers and store in a third, set condition flags
-                uop_add_reg_s(op);
-                break;
-            case ADC_REG_S:
-                uop_adc_reg_s(op);
-                break;
-            case SUB_REG_S: // add two registers and store in a third, set condition flags
-                uop_sub_reg_s(op);
-                break;
-            case SBC_REG_S:
-                uop_sbc_reg_s(op);
-                break;
-            case AND_IMM:
-                uop_and_imm(op);
-                break;
-            case ORR_IMM:
-                uop_orr_imm(op);
-                break;
-            case ORR_REG_S:
-                uop_orr_reg_s(op);
-                break;
-            case LSL_IMM:   // logical left shift by immediate
-                uop_lsl_imm(op);
-                break;
-            case LSL_IMM_S: // logical left shift by immediate, sets full conditions
-                uop_lsl_imm_s(op);
-                break;
-            case LSL_REG:   // logical left shift by register
-                uop_lsl_reg(op);
-                break;
-            case LSL_REG_S: // logical left shift by register, sets full conditions
-                uop_lsl_reg_s(op);
-                break;
-            case LSR_IMM:   // logical right shift by immediate
-                uop_lsr_imm(op);
-                break;
-            case LSR_IMM_S: // logical right shift by immediate, sets full conditions
-                uop_lsr_imm_s(op);
-                break;
-            case LSR_REG:   // logical right shift by register
-                uop_lsr_reg(op);
-                break;
-            case LSR_REG_S: // logical right shift by register, sets full conditions
-                uop_lsr_reg_s(op);
-                break;
-            case ASR_IMM:   // arithmetic right shift by immediate
-                uop_asr_imm(op);
-                break;
-            case ASR_IMM_S: // arithmetic right shift by immediate, sets full conditions
-                uop_asr_imm_s(op);
-                break;
-            case ASR_REG:   // arithmetic right shift by register
-                uop_asr_reg(op);
-                break;
-            case ASR_REG_S: // arithmetic right shift by register, sets full conditions
-                uop_asr_reg_s(op);
-                break;
-            case ROR_REG:   // rotate right by register
-                uop_ror_reg(op);
-                break;
-            case ROR_REG_S: // rotate right by register, sets full conditions
-                uop_ror_reg_s(op);
-                break;
-            case AND_REG_S:
-                uop_and_reg_s(op);
-                break;
-            case EOR_REG_S:
-                uop_eor_reg_s(op);
-                break;
-            case BIC_REG_S:
-                uop_bic_reg_s(op);
-                break;
-            case NEG_REG_S:
-                uop_neg_reg_s(op);
-                break;
-            case MVN_REG_S:
-                uop_mvn_reg_s(op);
-                break;
-            case MULTIPLY:
-                uop_multiply(op);
-                break;
-            case MULTIPLY_LONG:
-                uop_multiply_long(op);
-                break;
-            case SWAP:
-                uop_swap(op);
-                break;
-            case COUNT_LEADING_ZEROS:
-                uop_count_leading_zeros(op);
-                break;
-            case MOVE_TO_SR_IMM:
-                uop_move_to_sr_imm(op);
-                break;
-            case MOVE_TO_SR_REG:
-                uop_move_to_sr_reg(op);
-                break;
-            case MOVE_FROM_SR:
-                uop_move_from_sr(op);
-                break;
-            case UNDEFINED:
-                uop_undefined(op);
-                break;
-            case SWI:
-                uop_swi(op);
-                break;
-            case BKPT:
-                uop_bkpt(op);
-                break;
-            case COPROC_REG_TRANSFER:
-                uop_coproc_reg_transfer(op);
-                break;
-            case COPROC_DOUBLE_REG_TRANSFER:
-                uop_coproc_double_reg_transfer(op);
-                break;
-            case COPROC_DATA_PROCESSING:
-                uop_coproc_data_processing(op);
-                break;
-            case COPROC_LOAD_STORE:
-                uop_coproc_load_store(op);
-                break;
-            default:
-                panic_cpu("bad uop decode, bailing...\n");
+
+/*
+ * Fetch the op at cp_pc and move the program counter past it. If its
+ * condition fails, jump to the label 'skip', which carries on with the
+ * next op in the block.
+ */
+#define UOP_FETCH(skip) \
+    do { \
+        /* get the next op */ \
+        op = cpu.cp_pc; \
+        if (UOP_LOOP_TRACING) \
+            UOP_TRACE(8, "UOP: opcode %3d %32s, pc 0x%x, cp_pc %p, curr_cp %p\n", op->opcode, uop_opcode_to_str(op->opcode), cpu.pc, cpu.cp_pc, cpu.curr_cp); \
+        if (UOP_LOOP_COUNTING) \
+            UOP_COUNT_UOP(op); \
+\
+        /* increment the program counter */ \
+        int pc_inc = cpu.curr_cp->pc_inc; \
+        cpu.pc += pc_inc; /* next pc */ \
+        if (UOP_LOOP_TRACING || unlikely(op->reads_pc)) /* keep it up to date for dump_cpu() when tracing */ \
+            cpu.r[PC] = cpu.pc + pc_inc; /* during the course of the instruction, r15 looks like it's +8 or +4 (arm vs thumb) */ \
+        cpu.cp_pc++; \
+\
+        if (UOP_LOOP_TRACING && TRACE_CPU_LEVEL >= 10 \
+                && op->opcode != DECODE_ME_ARM \
+                && op->opcode != DECODE_ME_THUMB) \
+            dump_cpu(); \
+\
+        /* check to see if we should execute it */ \
+        UOP_CHECK_CONDITION(skip); \
+    } while (0)
+
+#if COND_RUNS
+/*
+ * cond_run is the number of ops left in a predicated run whose condition
+ * already passed (see uop_cond_run()). If the condition fails the rest of
+ * the run is skipped along with the op.
+ */
+#define UOP_CHECK_CONDITION(skip) \
+        if (cond_run > 0) { \
+            cond_run--; \
+        } else if (likely(check_condition(op->cond))) { \
+            cond_run = op->cond_run; \
+        } else { \
+            if (UOP_LOOP_TRACING) \
+                UOP_TRACE(8, "UOP: opcode not executed due to condition 0x%x, skipping %d more\n", op->cond, op->cond_run); \
+            if (UOP_LOOP_COUNTING) \
+                UOP_COUNT_SKIPPED(); \
+            cpu.pc += op->cond_run * pc_inc; \
+            cpu.cp_pc += op->cond_run; \
+            goto skip; /* not executed */ \
         }
+#define UOP_COND_RUN_RESET() cond_run = 0
+#else
+#define UOP_CHECK_CONDITION(skip) \
+        if (unlikely(!check_condition(op->cond))) { \
+            if (UOP_LOOP_TRACING) \
+                UOP_TRACE(8, "UOP: opcode not executed due to condition 0x%x\n", op->cond); \
+            if (UOP_LOOP_COUNTING) \
+                UOP_COUNT_SKIPPED(); \
+            goto skip; /* not executed */ \
+        }
+#define UOP_COND_RUN_RESET() do { } while (0)
+#endif
+
+#if WITH_JIT
+/*
+ * Run the op at index in codepage cp on behalf of translated code.
+ * Returns the index of the next op to run in the same codepage, or -1
+ * if something happened that the dispatch loop has to deal with.
+ */
+int uop_execute_one(struct uop_codepage *cp, int index)
+{
+    struct uop *op = &cp->ops[index];
+    int opcode = uop_unfused_opcode(op->opcode); // translated code runs pairs one op at a time
+
+    inc_perf_counter(INS_COUNT);
+    UOP_COUNT_CYCLES(1);
+    UOP_COUNT_UOP(op);
+
+    cpu.pc = cp->address + (index << cp->pc_shift) + cp->pc_inc;
+    cpu.r[PC] = cpu.pc + cp->pc_inc;
+    cpu.cp_pc = op + 1;
+
+    if (unlikely(!check_condition(op->cond))) {
+        UOP_COUNT_SKIPPED();
+        return index + 1;
+    }
+
+    switch (opcode) {
+#define UOP_HANDLER(opcode, handler, block) \
+        case opcode: \
+            handler(op); \
+            break;
+
+        UOP_HANDLER_LIST
+#undef UOP_HANDLER
+        default:
+            panic_cpu("bad uop decode, bailing...\n");
     }
 
-    return 0;
+    // the translation of this page has a stub where a real op could be now
+    if (opcode == DECODE_ME_ARM || opcode == DECODE_ME_THUMB)
+        cp->jit_stale = TRUE;
+    else if (cp->jit_stale && cpu.cp_pc != op + 1)
+        return -1; // branched, a good time to retranslate the page
+
+    // translated code works on the flags in cpsr directly
+    flush_lazy_flags();
+
+    if (unlikely(cpu.r15_dirty || cpu.exit_request != 0 || cpu.curr_cp != cp))
+        return -1;
+
+    return cpu.cp_pc - cp->ops;
 }
+#endif
+
+/*
+ * Ops are run in blocks: straight runs of ops starting wherever the top of
+ * the dispatch loop left off and ending at the first op that can branch,
+ * fault or otherwise need the checks at the top of the loop. Those checks,
+ * and the instruction and cycle counters, are done once per block. Every op
+ * in the handler list is tagged with what it can do to a block:
+ *
+ * STRAIGHT   - plain alu op, the block carries on.
+ * WRITES_PC  - may write r15 through put_reg(), which ends the block.
+ * ENDS_BLOCK - always ends the block. The counters are brought up to date
+ *              before it runs so that anything it reads out of them, or any
+ *              exception it raises, sees the same counts as before.
+ *
+ * Ops that fail their condition stay in the block whatever their tag is.
+ *
+ * Exceptions are only looked for at the top of the loop, which the end of a
+ * block only goes back to if cpu.exit_request is up (see cpu_request_exit()).
+ * Device threads raise it along with irq and fiq, and ops that fault or trap
+ * raise it themselves, so no op tests pending_exceptions on its own. The
+ * latency this gives an unmasked irq, in guest instructions:
+ *
+ * - interpreter: the rest of the current block. Every branch, load, store and
+ *   the end of the codepage end a block, so that is at most one codepage of
+ *   straight line alu ops, NUM_CODEPAGE_INS_ARM or NUM_CODEPAGE_INS_THUMB
+ *   instructions.
+ * - translated code: the next backwards or far branch, or the exit at the end
+ *   of the codepage, which bounds it the same way.
+ *
+ * An irq that arrives while masked leaves exit_request clear once the loop has
+ * seen it, so blocks are not cut short while the guest runs with it masked. An
+ * msr or exception return that unmasks it raises exit_request again and it is
+ * taken at the end of that block.
+ */
+#define UOP_BLOCK_COUNT(last) \
+    do { \
+        int ins = (last) + 1 - block_start; \
+        add_to_perf_counter(INS_COUNT, ins); \
+        if (UOP_LOOP_COUNTING) \
+            UOP_COUNT_CYCLES(ins); \
+    } while (0)
+
+#define UOP_BLOCK_BEFORE_STRAIGHT()
+#define UOP_BLOCK_BEFORE_WRITES_PC()
+#define UOP_BLOCK_BEFORE_ENDS_BLOCK() UOP_BLOCK_COUNT(op)
+
+/*
+ * The dispatch loop is instantiated once per variant out of
+ * uop_dispatch_loop.h, with the counting and tracing in the fetch and
+ * block paths compiled in or out. See uop_set_dispatch().
+ */
+#define UOP_LOOP_NAME uop_dispatch_loop_fast
+#define UOP_LOOP_COUNTING 0
+#define UOP_LOOP_TRACING 0
+#include "uop_dispatch_loop.h"
+
+#define UOP_LOOP_NAME uop_dispatch_loop_count
+#define UOP_LOOP_COUNTING 1
+#define UOP_LOOP_TRACING 0
+#include "uop_dispatch_loop.h"
+
+#define UOP_LOOP_NAME uop_dispatch_loop_trace
+#define UOP_LOOP_COUNTING 1
+#define UOP_LOOP_TRACING 1
+#include "uop_dispatch_loop.h"
 
+int uop_dispatch_loop(void)
+{
+#if WITH_DECODE_CACHE
+    on_cpu_thread = TRUE;
+#endif
+    return uop_dispatch_variant();
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Body of the dispatch loop, included by uop_dispatch.c once per variant.
+ * The includer defines:
+ *
+ * UOP_LOOP_NAME     - name of the function to generate
+ * UOP_LOOP_COUNTING - count cycles and the per op stats in the fetch and block paths
+ * UOP_LOOP_TRACING  - per op tracing in the fetch path
+ */
+
+static int UOP_LOOP_NAME(void)
+{
+    struct uop *block_start;
+#if COND_RUNS
+    int cond_run;
+#endif
+#if THREADED_DISPATCH
+    static const void * const dispatch_table[MAX_UOP_OPCODE] = {
+#define UOP_HANDLER(opcode, handler, block) [opcode] = &&L_##opcode,
+        UOP_HANDLER_LIST
+#undef UOP_HANDLER
+    };
+#endif
+
+    process_pending_exceptions();
+
+    /* main dispatch loop */
+    for (;;) {
+        struct uop *op;
+
+        if (UOP_LOOP_TRACING)
+            UOP_TRACE(10, "\nUOP: start of new cycle\n");
+
+        // in the last instruction we wrote something else into r[PC], so sync it with
+        // the real program counter cpu.pc
+        if (unlikely(cpu.r15_dirty)) {
+            if (UOP_LOOP_TRACING)
+                UOP_TRACE(9, "UOP: r15 dirty\n");
+            cpu.r15_dirty = FALSE;
+
+            if (ras_pop(cpu.r[PC])) {
+                // returned to where the last call said it would
+            } else if (cpu.curr_cp) {
+                if ((cpu.curr_cp->address >> CODEPAGE_SHIFT) == (cpu.r[PC] >> CODEPAGE_SHIFT)) {
+                    cpu.cp_pc = PC_TO_CPPC(cpu.r[PC]);
+                } else {
+                    // the op that wrote r15 is the one before cp_pc
+                    struct uop *site = cpu.cp_pc - 1;
+
+                    cpu.curr_cp = NULL;
+                    ibc_branch(site, NULL, cpu.r[PC]); // otherwise will load a new codepage in a few lines
+                }
+            }
+            cpu.pc = cpu.r[PC];
+        }
+
+        // check for exceptions
+        if (unlikely(cpu.exit_request != 0)) {
+            // clear it before looking, anything raised from here on raises it again
+            atomic_set(&cpu.exit_request, 0);
+
+            // the block may have written over its own codepage
+            if (unlikely(written_cp != NULL))
+                uop_remove_written();
+
+#if WITH_PREDECODE
+            // the predecode thread may have ops for us
+            if (uop_predecode)
+                uop_install_predecoded();
+#endif
+
+            // something may be pending
+            if (cpu.pending_exceptions & ~(cpu.cpsr & (PSR_IRQ_MASK|PSR_FIQ_MASK))) {
+                if (process_pending_exceptions()) {
+                    cpu_request_exit(); // come back for anything else that is pending
+                    continue;
+                }
+            }
+        }
+
+        /* see if we are off the end of a codepage, or the codepage was removed out from underneath us */
+        if (unlikely(cpu.curr_cp == NULL)) {
+            UOP_TRACE(7, "UOP: curr_cp == NULL, setting new codepage\n");
+            if (set_codepage(cpu.pc))
+                continue; // MMU translation error reading it
+        }
+
+        ASSERT(cpu.curr_cp != NULL);
+        ASSERT(cpu.cp_pc != NULL);
+
+#if WITH_JIT
+        // run translated code until it needs the checks above again
+        if (uop_use_jit && jit_run())
+            continue;
+#endif
+
+        /* start a new block */
+        block_start = cpu.cp_pc;
+        UOP_COND_RUN_RESET();
+
+        /* dispatch */
+#if THREADED_DISPATCH
+        /*
+         * Each handler ends with its own copy of the fetch and an indirect jump
+         * straight to the next handler, so the host branch predictor gets one jump
+         * site per opcode instead of a single shared one. An op that ends the block
+         * only falls back to the top of the loop if something is out of the
+         * ordinary (dirty r15, pending exceptions, codepage change), otherwise
+         * it starts the next block itself.
+         */
+#define UOP_DISPATCH_NEXT() \
+        do { \
+            UOP_FETCH(skip); \
+            goto *dispatch_table[op->opcode]; \
+        } while (0)
+
+#define UOP_BLOCK_AFTER_STRAIGHT() \
+        UOP_DISPATCH_NEXT()
+#define UOP_BLOCK_AFTER_WRITES_PC() \
+        do { \
+            if (unlikely(cpu.r15_dirty)) { \
+                UOP_BLOCK_COUNT(op); \
+                goto next; \
+            } \
+            UOP_DISPATCH_NEXT(); \
+        } while (0)
+#define UOP_BLOCK_AFTER_ENDS_BLOCK() \
+        do { \
+            if (unlikely(cpu.r15_dirty || cpu.exit_request != 0 || cpu.curr_cp == NULL)) \
+                goto next; \
+            if (UOP_LOOP_TRACING) \
+                UOP_TRACE(10, "\nUOP: start of new cycle\n"); \
+            block_start = cpu.cp_pc; \
+            UOP_COND_RUN_RESET(); \
+            UOP_DISPATCH_NEXT(); \
+        } while (0)
+
+skip:
+        UOP_DISPATCH_NEXT();
+
+#define UOP_HANDLER(opcode, handler, block) \
+L_##opcode: \
+        UOP_BLOCK_BEFORE_##block(); \
+        handler(op); \
+        UOP_BLOCK_AFTER_##block();
+
+        UOP_HANDLER_LIST
+#undef UOP_HANDLER
+#undef UOP_BLOCK_AFTER_STRAIGHT
+#undef UOP_BLOCK_AFTER_WRITES_PC
+#undef UOP_BLOCK_AFTER_ENDS_BLOCK
+#undef UOP_DISPATCH_NEXT
+#else
+#define UOP_BLOCK_AFTER_STRAIGHT() \
+        goto skip
+#define UOP_BLOCK_AFTER_WRITES_PC() \
+        do { \
+            if (unlikely(cpu.r15_dirty)) { \
+                UOP_BLOCK_COUNT(op); \
+                goto next; \
+            } \
+            goto skip; \
+        } while (0)
+#define UOP_BLOCK_AFTER_ENDS_BLOCK() \
+        goto next
+
+        for (;;) {
+            UOP_FETCH(skip);
+
+            switch (op->opcode) {
+#define UOP_HANDLER(opcode, handler, block) \
+                case opcode: \
+                    UOP_BLOCK_BEFORE_##block(); \
+                    handler(op); \
+                    UOP_BLOCK_AFTER_##block();
+
+                UOP_HANDLER_LIST
+#undef UOP_HANDLER
+                default:
+                    panic_cpu("bad uop decode, bailing...\n");
+            }
+skip:
+            ;
+        }
+#undef UOP_BLOCK_AFTER_STRAIGHT
+#undef UOP_BLOCK_AFTER_WRITES_PC
+#undef UOP_BLOCK_AFTER_ENDS_BLOCK
+#endif
+next:
+        ;
+    }
+
+    return 0;
+}
+
+#undef UOP_LOOP_NAME
+#undef UOP_LOOP_COUNTING
+#undef UOP_LOOP_TRACING
@@ -0,0 +1,1380 @@
+/*
+ * Copyright (c) 2010 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <debug.h>
+#include <options.h>
+#include <arm/arm.h>
+
+/*
+ * x86-64 translator for uop codepages.
+ *
+ * A codepage is translated as a whole the first time the dispatch loop
+ * enters it. Guest state stays in the cpu structure, so translated code and
+ * the interpreter can hand off to each other at any uop boundary. The common
+ * uops (simple data processing, shifts, local branches, immediate offset
+ * loads and stores) are emitted inline. Everything else, including ops that
+ * haven't been decoded yet, turns into a short stub that runs the op through
+ * uop_execute_one() and then jumps to whatever op comes next in the page.
+ */
+
+#if WITH_JIT && defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE (32*1024*1024)
+#define JIT_MAX_OP_SIZE 320 // upper bound of the code emitted for a single uop
+
+// translate ops inline only if nothing needs the per op statistics the handlers keep
+#define JIT_NATIVE_OPS (!COUNT_ARM_OPS && !COUNT_UOPS && !COUNT_ARITH_UOPS)
+
+/* host registers */
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* x86 condition codes */
+enum {
+    CC_O = 0x0, CC_NO = 0x1, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5,
+    CC_S = 0x8, CC_NS = 0x9,
+};
+
+/* x86 alu ops, as the opcode of the 'op r/m32, r32' form */
+enum {
+    X86_ADD = 0x01, X86_OR = 0x09, X86_ADC = 0x11, X86_SBB = 0x19,
+    X86_AND = 0x21, X86_SUB = 0x29, X86_XOR = 0x31, X86_CMP = 0x39,
+};
+
+/* the /digit of the group 1 immediate forms, same order as above */
+#define X86_GRP1(op) ((op) >> 3)
+
+/* which flags an emitted op updates */
+enum {
+    FLAGS_NONE,
+    FLAGS_NZ,
+    FLAGS_NZC,
+    FLAGS_NZCV,
+};
+
+/*
+ * register usage inside translated code:
+ * rbx   - &cpu
+ * r12   - codepage being run
+ * r13   - &codepage->ops[0]
+ * r14d  - instructions retired since the last counter flush
+ * r15d  - extra cycles since the last counter flush
+ * rbp   - load/store base register, preserved across the mmu call
+ * [rsp] - scratch space for mmu reads
+ */
+typedef void (*jit_enter_func)(struct cpu_struct *c, struct uop_codepage *cp, void *entry);
+
+/*
+ * A branch to another codepage. Lives in the translation buffer next to the
+ * code for the branch. Starts out unlinked, exiting to the dispatch loop,
+ * and is linked straight to the translated target the next time jit_run()
+ * enters it from there. Every codepage keeps a list of the sites linked to
+ * it, so they can be unlinked when it is retranslated.
+ */
+struct jit_chain {
+    armaddr_t target;           // guest address the branch goes to
+    byte *jmp;                  // rel32 of the jump that picks the linked or unlinked path
+    byte *linked;               // switches to the target codepage and jumps into it
+    byte *unlinked;             // exits to the dispatch loop
+    byte *cp_imm;               // imm64 of the target codepage in the linked path
+    byte *entry_rel;            // rel32 of the jump to the target op in the linked path
+    struct jit_chain *next;     // next site linked to the same codepage
+};
+
+static struct jit {
+    byte *buf;
+    byte *start;    // first byte after the entry and exit stubs
+    byte *ptr;      // next free byte
+    byte *end;
+    int gen;        // bumped every time the buffer is recycled
+
+    jit_enter_func enter;
+    byte *exit;     // common exit path back to jit_run()
+
+    struct jit_chain *chain_exit; // unlinked branch site translated code last left through
+} jit;
+
+/* state for the page currently being translated */
+struct jit_fixup {
+    byte *patch;
+    int target;
+};
+
+static struct jit_fixup fixups[(NUM_CODEPAGE_INS_THUMB + 1) * 2];
+static int fixup_count;
+static void **entries;
+static byte *common_stub;
+static armaddr_t jit_r15; // value r15 reads as for the op being translated
+
+#define OFF_PC      offsetof(struct cpu_struct, pc)
+#define OFF_CP_PC   offsetof(struct cpu_struct, cp_pc)
+#define OFF_CURR_CP offsetof(struct cpu_struct, curr_cp)
+#define OFF_CPSR    offsetof(struct cpu_struct, cpsr)
+#define OFF_REG(reg) (offsetof(struct cpu_struct, r) + (reg) * sizeof(reg_t))
+#define OFF_EXIT_REQUEST offsetof(struct cpu_struct, exit_request)
+#define OFF_COUNTER(c) (offsetof(struct cpu_struct, perf_counters) + (c) * sizeof(int))
+
+static inline void emit8(byte b)
+{
+    *jit.ptr++ = b;
+}
+
+static inline void emit32(word w)
+{
+    memcpy(jit.ptr, &w, 4);
+    jit.ptr += 4;
+}
+
+static inline void emit64(uint64_t q)
+{
+    memcpy(jit.ptr, &q, 8);
+    jit.ptr += 8;
+}
+
+static void emit_rex(int w, int reg, int base)
+{
+    byte rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+
+    if (rex != 0x40)
+        emit8(rex);
+}
+
+static void emit_opcode(int opcode)
+{
+    if (opcode > 0xff)
+        emit8(opcode >> 8);
+    emit8(opcode);
+}
+
+/* op reg, r/m with a register operand */
+static void emit_op_rr(int w, int opcode, int reg, int rm)
+{
+    emit_rex(w, reg, rm);
+    emit_opcode(opcode);
+    emit8(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op reg, [base + disp] */
+static void emit_op_mem(int w, int opcode, int reg, int base, int32_t disp)
+{
+    int mod;
+
+    if (disp == 0 && (base & 7) != RBP)
+        mod = 0;
+    else if (disp >= -128 && disp <= 127)
+        mod = 1;
+    else
+        mod = 2;
+
+    emit_rex(w, reg, base);
+    emit_opcode(opcode);
+    emit8((mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit8(0x24); // sib, no index
+    if (mod == 1)
+        emit8(disp);
+    else if (mod == 2)
+        emit32(disp);
+}
+
+static void emit_mov_imm(int reg, word imm)
+{
+    emit_rex(0, 0, reg);
+    emit8(0xb8 + (reg & 7));
+    emit32(imm);
+}
+
+static void emit_mov_imm64(int reg, uint64_t imm)
+{
+    emit_rex(1, 0, reg);
+    emit8(0xb8 + (reg & 7));
+    emit64(imm);
+}
+
+static void emit_alu_imm(int op, int reg, word imm)
+{
+    emit_op_rr(0, 0x81, X86_GRP1(op), reg);
+    emit32(imm);
+}
+
+static void emit_alu_mem_imm(int op, int base, int32_t disp, word imm)
+{
+    emit_op_mem(0, 0x81, X86_GRP1(op), base, disp);
+    emit32(imm);
+}
+
+static void emit_shift_imm(int ext, int reg, int amount)
+{
+    emit_op_rr(0, 0xc1, ext, reg);
+    emit8(amount);
+}
+#define SHIFT_ROR 1
+#define SHIFT_RCR 3
+#define SHIFT_SHL 4
+#define SHIFT_SHR 5
+#define SHIFT_SAR 7
+
+static void emit_setcc(int cc, int reg8)
+{
+    emit_op_rr(0, 0x0f90 + cc, 0, reg8);
+}
+
+static void emit_call(void *func)
+{
+    emit_mov_imm64(RAX, (uint64_t)(uintptr_t)func);
+    emit_op_rr(0, 0xff, 2, RAX);
+}
+
+static void emit_jcc_abs(int cc, byte *target)
+{
+    emit_opcode(0x0f80 + cc);
+    emit32(target - (jit.ptr + 4));
+}
+
+static void emit_jmp_abs(byte *target)
+{
+    emit8(0xe9);
+    emit32(target - (jit.ptr + 4));
+}
+
+static void add_fixup(int target)
+{
+    fixups[fixup_count].patch = jit.ptr;
+    fixups[fixup_count].target = target;
+    fixup_count++;
+    emit32(0);
+}
+
+static void emit_jmp_op(int target)
+{
+    emit8(0xe9);
+    add_fixup(target);
+}
+
+static void emit_jcc_op(int cc, int target)
+{
+    emit_opcode(0x0f80 + cc);
+    add_fixup(target);
+}
+
+/* fold r14/r15 into the real perf counters */
+static void emit_flush_counters(void)
+{
+    emit_op_mem(0, X86_ADD, R14, RBX, OFF_COUNTER(INS_COUNT));
+#if COUNT_CYCLES
+    if (uop_count_cycles) {
+        emit_op_mem(0, X86_ADD, R14, RBX, OFF_COUNTER(CYCLE_COUNT));
+        emit_op_mem(0, X86_ADD, R15, RBX, OFF_COUNTER(CYCLE_COUNT));
+        emit_op_rr(0, X86_XOR, R15, R15);
+    }
+#endif
+    emit_op_rr(0, X86_XOR, R14, R14);
+}
+
+static void emit_add_cycles(int cycles)
+{
+#if COUNT_CYCLES
+    if (cycles > 0 && uop_count_cycles) {
+        emit_op_rr(0, 0x83, 0, R15);
+        emit8(cycles);
+    }
+#endif
+}
+
+static inline armaddr_t op_address(struct uop_codepage *cp, int index)
+{
+    return cp->address + (index << cp->pc_shift);
+}
+
+/* put pc, r15 and cp_pc where the dispatch loop would have them while running op index */
+static void emit_sync(struct uop_codepage *cp, int index)
+{
+    armaddr_t pc = op_address(cp, index) + cp->pc_inc;
+
+    emit_op_mem(0, 0xc7, 0, RBX, OFF_PC);
+    emit32(pc);
+    emit_op_mem(0, 0xc7, 0, RBX, OFF_REG(PC));
+    emit32(pc + cp->pc_inc);
+    emit_op_mem(1, 0x8d, RAX, R13, (index + 1) * sizeof(struct uop));
+    emit_op_mem(1, 0x89, RAX, RBX, OFF_CP_PC);
+    emit_flush_counters();
+}
+
+static void patch_rel32(byte *patch, byte *target)
+{
+    word rel = target - (patch + 4);
+
+    memcpy(patch, &rel, 4);
+}
+
+/* leave translated code about to run op index */
+static void emit_exit_to(struct uop_codepage *cp, int index)
+{
+    emit_op_mem(0, 0xc7, 0, RBX, OFF_PC);
+    emit32(op_address(cp, index));
+    emit_op_mem(1, 0x8d, RAX, R13, index * sizeof(struct uop));
+    emit_op_mem(1, 0x89, RAX, RBX, OFF_CP_PC);
+    emit_flush_counters();
+    emit_jmp_abs(jit.exit);
+}
+
+static void emit_load_reg(int hreg, int reg)
+{
+    if (reg == PC)
+        emit_mov_imm(hreg, jit_r15);
+    else
+        emit_op_mem(0, 0x8b, hreg, RBX, OFF_REG(reg));
+}
+
+static void emit_store_reg(int reg, int hreg)
+{
+    ASSERT(reg != PC);
+    emit_op_mem(0, 0x89, hreg, RBX, OFF_REG(reg));
+}
+
+/* skip to the next op if the condition fails */
+static void emit_condition(struct uop *op, int index)
+{
+    unsigned int mask = 0;
+    int i;
+
+    if (op->cond == COND_AL)
+        return;
+
+    // precompute which of the 16 NZCV combinations pass
+    for (i = 0; i < 16; i++) {
+        if (cpu.condition_table[i] & (1 << op->cond))
+            mask |= (1 << i);
+    }
+
+    if (mask == 0xffff)
+        return;
+
+    emit_op_mem(0, 0x8b, RAX, RBX, OFF_CPSR);
+    emit_shift_imm(SHIFT_SHR, RAX, COND_SHIFT);
+    emit_mov_imm(RCX, mask);
+    emit_op_rr(0, 0x0fa3, RAX, RCX); // bt ecx, eax
+    emit_jcc_op(CC_AE, index + 1);
+}
+
+/* fold the x86 flags of the last op into the cpsr */
+static void emit_set_flags(int which, bool invert_carry)
+{
+    word keep;
+
+    emit_setcc(CC_S, RCX);
+    emit_setcc(CC_E, RDX);
+    if (which >= FLAGS_NZC)
+        emit_setcc(invert_carry ? CC_AE : CC_B, RAX);
+    if (which >= FLAGS_NZCV)
+        emit_setcc(CC_O, RSP); // ah
+
+    emit_op_rr(0, 0x0fb6, RCX, RCX);
+    emit_shift_imm(SHIFT_SHL, RCX, 31);
+    emit_op_rr(0, 0x0fb6, RDX, RDX);
+    emit_shift_imm(SHIFT_SHL, RDX, 30);
+    emit_op_rr(0, X86_OR, RDX, RCX);
+    keep = ~(PSR_CC_NEG | PSR_CC_ZERO);
+    if (which >= FLAGS_NZC) {
+        emit_op_rr(0, 0x0fb6, RDX, RAX);
+        emit_shift_imm(SHIFT_SHL, RDX, 29);
+        emit_op_rr(0, X86_OR, RDX, RCX);
+        keep &= ~PSR_CC_CARRY;
+    }
+    if (which >= FLAGS_NZCV) {
+        emit_op_rr(0, 0x0fb6, RDX, RSP); // movzx edx, ah
+        emit_shift_imm(SHIFT_SHL, RDX, 28);
+        emit_op_rr(0, X86_OR, RDX, RCX);
+        keep &= ~PSR_CC_OVL;
+    }
+
+    emit_op_mem(0, 0x8b, RDX, RBX, OFF_CPSR);
+    emit_alu_imm(X86_AND, RDX, keep);
+    emit_op_rr(0, X86_OR, RCX, RDX);
+    emit_op_mem(0, 0x89, RDX, RBX, OFF_CPSR);
+}
+
+static void emit_carry_in(bool invert)
+{
+    // bt dword [cpsr], 29
+    emit_op_mem(0, 0x0fba, 4, RBX, OFF_CPSR);
+    emit8(29);
+    if (invert)
+        emit8(0xf5); // cmc
+}
+
+/* operand b of a data processing op, in ecx when it's a register */
+static void emit_alu_b(int op, int reg, bool b_imm, word b)
+{
+    if (b_imm)
+        emit_alu_imm(op, reg, b);
+    else
+        emit_op_rr(0, op, RCX, reg);
+}
+
+#define OPERAND_ECX         0xff // register operand b has already been computed into ecx
+#define SHIFTER_CARRY_NONE  -1
+#define SHIFTER_CARRY_R8    2    // shifter carry out was left in r8b
+
+/*
+ * Emit one of the 16 arm data processing ops on a (register) and b (immediate
+ * or register). Mirrors DATA_PROCESSING_OP_TABLE. Returns FALSE if the form
+ * isn't handled here.
+ */
+static bool emit_data_processing(int aop, int dest, int a, bool b_imm, word b, bool s, int shifter_carry)
+{
+    bool writeback = TRUE;
+    int flags = FLAGS_NZ;
+    bool invert_carry = FALSE;
+
+    // writes to the pc, and S ops with Rd = pc (which restore the spsr), go through the interpreter
+    if (dest == PC)
+        return FALSE;
+
+    if (!b_imm && b != OPERAND_ECX)
+        emit_load_reg(RCX, b);
+    if (aop != AOP_MOV && aop != AOP_MVN)
+        emit_load_reg(RAX, a);
+
+    switch (aop) {
+        case AOP_TST:
+            writeback = !s;
+            // fallthrough
+        case AOP_AND:
+            emit_alu_b(X86_AND, RAX, b_imm, b);
+            break;
+        case AOP_TEQ:
+            writeback = !s;
+            // fallthrough
+        case AOP_EOR:
+            emit_alu_b(X86_XOR, RAX, b_imm, b);
+            break;
+        case AOP_ORR:
+            emit_alu_b(X86_OR, RAX, b_imm, b);
+            break;
+        case AOP_BIC:
+            if (b_imm) {
+                emit_alu_imm(X86_AND, RAX, ~b);
+            } else {
+                emit_op_rr(0, 0xf7, 2, RCX); // not ecx
+                emit_op_rr(0, X86_AND, RCX, RAX);
+            }
+            break;
+        case AOP_MOV:
+        case AOP_MVN:
+            if (b_imm)
+                emit_mov_imm(RAX, b);
+            else
+                emit_op_rr(0, 0x89, RCX, RAX);
+            if (aop == AOP_MVN)
+                emit_op_rr(0, 0xf7, 2, RAX); // not eax
+            break;
+        case AOP_CMN:
+            writeback = !s;
+            // fallthrough
+        case AOP_ADD:
+            emit_alu_b(X86_ADD, RAX, b_imm, b);
+            flags = FLAGS_NZCV;
+            break;
+        case AOP_CMP:
+            writeback = !s;
+            // fallthrough
+        case AOP_SUB:
+            emit_alu_b(X86_SUB, RAX, b_imm, b);
+            flags = FLAGS_NZCV;
+            invert_carry = TRUE;
+            break;
+        case AOP_ADC:
+            emit_carry_in(FALSE);
+            emit_alu_b(X86_ADC, RAX, b_imm, b);
+            flags = FLAGS_NZCV;
+            break;
+        case AOP_SBC:
+            emit_carry_in(TRUE);
+            emit_alu_b(X86_SBB, RAX, b_imm, b);
+            flags = FLAGS_NZCV;
+            invert_carry = TRUE;
+            break;
+        case AOP_RSB:
+        case AOP_RSC:
+            if (b_imm)
+                emit_mov_imm(RDX, b);
+            else
+                emit_op_rr(0, 0x89, RCX, RDX);
+            if (aop == AOP_RSC) {
+                emit_carry_in(TRUE);
+                emit_op_rr(0, X86_SBB, RAX, RDX);
+            } else {
+                emit_op_rr(0, X86_SUB, RAX, RDX);
+            }
+            emit_op_rr(0, 0x89, RDX, RAX);
+            flags = FLAGS_NZCV;
+            invert_carry = TRUE;
+            break;
+        default:
+            return FALSE;
+    }
+
+    // mov doesn't touch the flags, so the store can go before reading them back
+    if (writeback)
+        emit_store_reg(dest, RAX);
+
+    if (s) {
+        if (flags == FLAGS_NZ) {
+            emit_op_rr(0, 0x85, RAX, RAX); // test eax, eax
+            emit_set_flags(FLAGS_NZ, FALSE);
+            if (shifter_carry == SHIFTER_CARRY_R8) {
+                emit_op_rr(0, 0x0fb6, R8, R8); // movzx r8d, r8b
+                emit_shift_imm(SHIFT_SHL, R8, 29);
+                emit_alu_mem_imm(X86_AND, RBX, OFF_CPSR, ~PSR_CC_CARRY);
+                emit_op_mem(0, X86_OR, R8, RBX, OFF_CPSR);
+            } else if (shifter_carry >= 0) {
+                if (shifter_carry)
+                    emit_alu_mem_imm(X86_OR, RBX, OFF_CPSR, PSR_CC_CARRY);
+                else
+                    emit_alu_mem_imm(X86_AND, RBX, OFF_CPSR, ~PSR_CC_CARRY);
+            }
+        } else {
+            emit_set_flags(flags, invert_carry);
+        }
+    }
+
+    return TRUE;
+}
+
+static bool emit_shift(int ext, struct uop *op, bool s)
+{
+    int dest = op->simple_dp_imm.dest_reg;
+    word amount = op->simple_dp_imm.immediate;
+
+    if (dest == PC)
+        return FALSE;
+
+    emit_load_reg(RAX, op->simple_dp_imm.source_reg);
+    if (!s) {
+        if (amount >= 32) {
+            if (ext == SHIFT_SAR)
+                emit_shift_imm(SHIFT_SAR, RAX, 31);
+            else
+                emit_op_rr(0, X86_XOR, RAX, RAX);
+        } else if (amount > 0) {
+            emit_shift_imm(ext, RAX, amount);
+        }
+        emit_store_reg(dest, RAX);
+        return TRUE;
+    }
+
+    if (amount == 0 && ext == SHIFT_SHL) {
+        // lsl #0, carry is untouched
+        emit_store_reg(dest, RAX);
+        emit_op_rr(0, 0x85, RAX, RAX);
+        emit_set_flags(FLAGS_NZ, FALSE);
+        return TRUE;
+    }
+    if (amount == 0 || amount >= 32)
+        return FALSE;
+
+    // shl/shr leave the last bit shifted out in CF, and set SF and ZF on the result
+    emit_shift_imm(ext, RAX, amount);
+    emit_store_reg(dest, RAX);
+    emit_set_flags(FLAGS_NZC, FALSE);
+    return TRUE;
+}
+
+static void *mmu_read_func(int size)
+{
+    switch (size) {
+        case UOPLSFLAGS_SIZE_HALFWORD:
+            return &mmu_read_mem_halfword;
+        case UOPLSFLAGS_SIZE_BYTE:
+            return &mmu_read_mem_byte;
+        default:
+            return &mmu_read_mem_word;
+    }
+}
+
+static void *mmu_write_func(int size)
+{
+    switch (size) {
+        case UOPLSFLAGS_SIZE_HALFWORD:
+            return &mmu_write_mem_halfword;
+        case UOPLSFLAGS_SIZE_BYTE:
+            return &mmu_write_mem_byte;
+        default:
+            return &mmu_write_mem_word;
+    }
+}
+
+/* extra cycles a load takes, same as the interpreter's accounting */
+static int load_cycles(int size)
+{
+    if (get_core() == ARM7)
+        return 2;
+    if (size != UOPLSFLAGS_SIZE_WORD)
+        return 1;
+    return 0;
+}
+
+/* pull the result of an mmu read out of the scratch slot into eax */
+static void emit_load_result(int size, bool sign_extend)
+{
+    switch (size) {
+        case UOPLSFLAGS_SIZE_HALFWORD:
+            emit_op_mem(0, sign_extend ? 0x0fbf : 0x0fb7, RAX, RSP, 0);
+            break;
+        case UOPLSFLAGS_SIZE_BYTE:
+            emit_op_mem(0, sign_extend ? 0x0fbe : 0x0fb6, RAX, RSP, 0);
+            break;
+        default:
+            emit_op_mem(0, 0x8b, RAX, RSP, 0);
+            break;
+    }
+}
+
+static bool emit_load_store(struct uop_codepage *cp, int index, struct uop *op, bool load)
+{
+    int size = op->flags & UOPLSFLAGS_SIZE_MASK;
+    int target = op->load_store_immediate_offset.target_reg;
+    int base = op->load_store_immediate_offset.source_reg;
+    word offset = op->load_store_immediate_offset.offset;
+    bool writeback = (op->flags & UOPLSFLAGS_WRITEBACK) ? TRUE : FALSE;
+
+    if (size == UOPLSFLAGS_SIZE_DWORD)
+        return FALSE;
+    if (load && target == PC)
+        return FALSE;
+    if (writeback && base == PC)
+        return FALSE;
+
+    // an abort needs the pc to be precise
+    emit_sync(cp, index);
+
+    emit_load_reg(RAX, base);
+    if (writeback)
+        emit_op_rr(0, 0x89, RAX, RBP);
+    if (op->flags & UOPLSFLAGS_POSTINDEX)
+        emit_op_rr(0, 0x89, RAX, RDI);
+    else
+        emit_op_mem(0, 0x8d, RDI, RAX, offset);
+
+    if (load) {
+        emit_op_mem(1, 0x8d, RSI, RSP, 0);
+        emit_call(mmu_read_func(size));
+    } else {
+        emit_load_reg(RSI, target);
+        emit_call(mmu_write_func(size));
+    }
+    emit_op_rr(0, 0x84, RAX, RAX); // test al, al
+    emit_jcc_abs(CC_NE, jit.exit);
+
+    if (load) {
+        emit_load_result(size, (op->flags & UOPLSFLAGS_SIGN_EXTEND) ? TRUE : FALSE);
+        emit_store_reg(target, RAX);
+    }
+    if (writeback) {
+        emit_op_mem(0, 0x8d, RAX, RBP, offset);
+        emit_store_reg(base, RAX);
+    }
+
+    if (load)
+        emit_add_cycles(load_cycles(size));
+    else if (get_core() == ARM7)
+        emit_add_cycles(1);
+
+    // a store over decoded ops of this page ends the block, the same as in the interpreter
+    if (!load) {
+        byte *skip;
+
+        emit_op_mem(0, 0x83, X86_GRP1(X86_CMP), RBX, OFF_EXIT_REQUEST);
+        emit8(0);
+        emit_jcc_abs(CC_E, jit.ptr);
+        skip = jit.ptr - 4;
+        emit_exit_to(cp, index + 1);
+        patch_rel32(skip, jit.ptr);
+    }
+
+    return TRUE;
+}
+
+static bool emit_load_immediate(struct uop_codepage *cp, int index, struct uop *op, int size)
+{
+    int target = op->load_immediate.target_reg;
+
+    if (target == PC)
+        return FALSE;
+
+    emit_sync(cp, index);
+
+    emit_mov_imm(RDI, op->load_immediate.address);
+    emit_op_mem(1, 0x8d, RSI, RSP, 0);
+    emit_call(mmu_read_func(size));
+    emit_op_rr(0, 0x84, RAX, RAX);
+    emit_jcc_abs(CC_NE, jit.exit);
+
+    emit_load_result(size, (op->flags & UOPLSFLAGS_SIGN_EXTEND) ? TRUE : FALSE);
+    emit_store_reg(target, RAX);
+
+    emit_add_cycles(load_cycles(size));
+
+    return TRUE;
+}
+
+static bool emit_branch_local(struct uop_codepage *cp, int index, struct uop *op)
+{
+    int target = (op->b_immediate.target % CODEPAGE_SIZE) >> cp->pc_shift;
+
+    if (op->flags & UOPBFLAGS_LINK) {
+        emit_op_mem(0, 0xc7, 0, RBX, OFF_REG(LR));
+        emit32(op->b_immediate.link_target | (cp->thumb ? 1 : 0));
+        emit_mov_imm(RDI, op->b_immediate.link_target);
+        emit_call(&uop_push_return);
+    }
+
+    // all branch instructions take 3 cycles on all cores
+    emit_add_cycles(2);
+
+    if (target <= index) {
+        // backwards, give pending exceptions and retranslation a chance to happen
+        byte *patch;
+        word rel;
+
+        emit_op_mem(0, 0x83, X86_GRP1(X86_CMP), RBX, OFF_EXIT_REQUEST);
+        emit8(0);
+        emit_jcc_abs(CC_NE, jit.ptr);
+        patch = jit.ptr - 4;
+        emit_op_mem(0, 0x83, X86_GRP1(X86_CMP), R12, offsetof(struct uop_codepage, jit_stale));
+        emit8(0);
+        emit_jcc_op(CC_E, target);
+
+        // taken, but something has to happen outside of translated code first
+        rel = jit.ptr - (patch + 4);
+        memcpy(patch, &rel, 4);
+        emit_exit_to(cp, target);
+    } else {
+        emit_jmp_op(target);
+    }
+
+    return TRUE;
+}
+
+/* barrel shifter with an immediate shift, result in ecx and the carry out in r8b */
+static bool emit_imm_shift(struct uop *op)
+{
+    int shift_imm = op->data_processing_imm_shift.shift_imm;
+
+    emit_load_reg(RCX, op->data_processing_imm_shift.source2_reg);
+    switch (op->data_processing_imm_shift.shift_opcode) {
+        case 0: // LSL
+            if (shift_imm == 0)
+                return FALSE;
+            emit_shift_imm(SHIFT_SHL, RCX, shift_imm);
+            break;
+        case 1: // LSR
+            if (shift_imm == 0) {
+                // lsr #32
+                emit_op_rr(0, 0x0fba, 4, RCX); // bt ecx, 31
+                emit8(31);
+                emit_mov_imm(RCX, 0);
+            } else {
+                emit_shift_imm(SHIFT_SHR, RCX, shift_imm);
+            }
+            break;
+        case 2: // ASR
+            if (shift_imm == 0) {
+                // asr #32
+                emit_shift_imm(SHIFT_SAR, RCX, 31);
+                emit_op_rr(0, 0x0fba, 4, RCX); // bt ecx, 0
+                emit8(0);
+            } else {
+                emit_shift_imm(SHIFT_SAR, RCX, shift_imm);
+            }
+            break;
+        case 3: // ROR
+            if (shift_imm == 0) {
+                // rrx
+                emit_carry_in(FALSE);
+                emit_op_rr(0, 0xd1, SHIFT_RCR, RCX);
+            } else {
+                emit_shift_imm(SHIFT_ROR, RCX, shift_imm);
+            }
+            break;
+        default:
+            return FALSE;
+    }
+    emit_setcc(CC_B, R8);
+
+    return TRUE;
+}
+
+static bool emit_multiply(struct uop *op)
+{
+    int dest = op->mul.dest_reg;
+
+    if (dest == PC || op->mul.source_reg == PC || op->mul.source2_reg == PC)
+        return FALSE;
+    // only the ARM9e timing is constant
+    if (COUNT_CYCLES && uop_count_cycles && get_core() <= ARM9)
+        return FALSE;
+
+    emit_load_reg(RAX, op->mul.source_reg);
+    emit_load_reg(RCX, op->mul.source2_reg);
+    emit_op_rr(0, 0x0faf, RAX, RCX); // imul eax, ecx
+    if (op->flags & UOPMULFLAGS_ACCUMULATE) {
+        emit_load_reg(RDX, op->mul.accum_reg);
+        emit_op_rr(0, X86_ADD, RDX, RAX);
+    }
+    emit_store_reg(dest, RAX);
+    if (op->flags & UOPMULFLAGS_S_BIT) {
+        emit_op_rr(0, 0x85, RAX, RAX);
+        emit_set_flags(FLAGS_NZ, FALSE);
+    }
+    emit_add_cycles(1);
+
+    return TRUE;
+}
+
+static bool emit_multiply_long(struct uop *op)
+{
+    int lo = op->mull.destlo_reg;
+    int hi = op->mull.desthi_reg;
+
+    if (lo == PC || hi == PC || op->mull.source_reg == PC || op->mull.source2_reg == PC)
+        return FALSE;
+    if (COUNT_CYCLES && uop_count_cycles && get_core() <= ARM9)
+        return FALSE;
+
+    if (op->flags & UOPMULFLAGS_SIGNED) {
+        emit_op_mem(1, 0x63, RAX, RBX, OFF_REG(op->mull.source_reg)); // movsxd
+        emit_op_mem(1, 0x63, RCX, RBX, OFF_REG(op->mull.source2_reg));
+    } else {
+        emit_load_reg(RAX, op->mull.source_reg);
+        emit_load_reg(RCX, op->mull.source2_reg);
+    }
+    emit_op_rr(1, 0x0faf, RAX, RCX); // imul rax, rcx
+    if (op->flags & UOPMULFLAGS_ACCUMULATE) {
+        emit_load_reg(RDX, hi);
+        emit_op_rr(1, 0xc1, SHIFT_SHL, RDX);
+        emit8(32);
+        emit_load_reg(RCX, lo);
+        emit_op_rr(1, X86_OR, RCX, RDX);
+        emit_op_rr(1, X86_ADD, RDX, RAX);
+    }
+    emit_store_reg(lo, RAX);
+    emit_op_rr(1, 0x89, RAX, RDX);
+    emit_op_rr(1, 0xc1, SHIFT_SHR, RDX);
+    emit8(32);
+    emit_store_reg(hi, RDX);
+    if (op->flags & UOPMULFLAGS_S_BIT) {
+        emit_op_rr(1, 0x85, RAX, RAX); // test rax, rax
+        emit_set_flags(FLAGS_NZ, FALSE);
+    }
+    emit_add_cycles(2);
+
+    return TRUE;
+}
+
+static bool emit_branch_far(struct uop_codepage *cp, int index, struct uop *op)
+{
+    struct jit_chain *chain;
+    byte *chain_imm;
+    byte *pending_rel;
+    byte *jmp;
+    byte *linked, *unlinked;
+    byte *cp_imm, *entry_rel;
+
+    // thumb switches need a different kind of codepage
+    if (op->flags & (UOPBFLAGS_SETTHUMB_ALWAYS | UOPBFLAGS_UNSETTHUMB_ALWAYS))
+        return FALSE;
+
+    if (op->flags & UOPBFLAGS_LINK) {
+        emit_op_mem(0, 0xc7, 0, RBX, OFF_REG(LR));
+        emit32(op->b_immediate.link_target | (cp->thumb ? 1 : 0));
+        emit_mov_imm(RDI, op->b_immediate.link_target);
+        emit_call(&uop_push_return);
+    }
+    emit_add_cycles(2);
+
+    emit_op_mem(0, 0x83, X86_GRP1(X86_CMP), RBX, OFF_EXIT_REQUEST);
+    emit8(0);
+    emit_jcc_abs(CC_NE, jit.ptr);
+    pending_rel = jit.ptr - 4;
+
+    emit_jmp_abs(jit.ptr);
+    jmp = jit.ptr - 4;
+
+    // linked: switch to the target codepage, the same way jit.enter does
+    linked = jit.ptr;
+    emit_mov_imm64(R12, 0);
+    cp_imm = jit.ptr - 8;
+    emit_op_mem(1, 0x8d, R13, R12, offsetof(struct uop_codepage, ops));
+    emit_op_mem(1, 0x89, R12, RBX, OFF_CURR_CP);
+    emit_op_mem(0, 0xc7, 0, R12, offsetof(struct uop_codepage, referenced)); // keep it off the eviction clock
+    emit32(TRUE);
+    emit_jmp_abs(jit.ptr);
+    entry_rel = jit.ptr - 4;
+
+    // unlinked: leave a note for jit_run() to link us up
+    unlinked = jit.ptr;
+    emit_mov_imm64(RAX, 0);
+    chain_imm = jit.ptr - 8;
+    emit_mov_imm64(RCX, (uint64_t)(uintptr_t)&jit.chain_exit);
+    emit_op_mem(1, 0x89, RAX, RCX, 0);
+
+    // let the dispatch loop find the target codepage
+    patch_rel32(pending_rel, jit.ptr);
+    emit_op_mem(0, 0xc7, 0, RBX, OFF_PC);
+    emit32(op->b_immediate.target);
+    emit_op_mem(1, 0xc7, 0, RBX, OFF_CURR_CP);
+    emit32(0);
+    emit_flush_counters();
+    emit_jmp_abs(jit.exit);
+
+    patch_rel32(jmp, unlinked);
+
+    jit.ptr = (byte *)(((uintptr_t)jit.ptr + 7) & ~(uintptr_t)7);
+    chain = (struct jit_chain *)jit.ptr;
+    jit.ptr += sizeof(struct jit_chain);
+
+    chain->target = op->b_immediate.target;
+    chain->jmp = jmp;
+    chain->linked = linked;
+    chain->unlinked = unlinked;
+    chain->cp_imm = cp_imm;
+    chain->entry_rel = entry_rel;
+    chain->next = NULL;
+    memcpy(chain_imm, &chain, 8);
+
+    return TRUE;
+}
+
+static void jit_link(struct jit_chain *chain, struct uop_codepage *cp, byte *entry)
+{
+    UOP_TRACE(6, "jit: linking branch to 0x%08x into codepage 0x%08x\n", chain->target, cp->address);
+
+    memcpy(chain->cp_imm, &cp, 8);
+    patch_rel32(chain->entry_rel, entry);
+    patch_rel32(chain->jmp, chain->linked);
+
+    chain->next = cp->jit_chain_in;
+    cp->jit_chain_in = chain;
+}
+
+/* point every branch linked into cp back at the dispatch loop */
+static void jit_unlink(struct uop_codepage *cp)
+{
+    struct jit_chain *chain;
+
+    for (chain = cp->jit_chain_in; chain; chain = chain->next)
+        patch_rel32(chain->jmp, chain->unlinked);
+    cp->jit_chain_in = NULL;
+}
+
+/* try to emit op inline, returns FALSE if it needs to go through the interpreter */
+static bool emit_native_op(struct uop_codepage *cp, int index, struct uop *op)
+{
+    switch (op->opcode) {
+        case NOP:
+            return TRUE;
+        case B_IMMEDIATE_LOCAL:
+            return emit_branch_local(cp, index, op);
+        case B_IMMEDIATE:
+            return emit_branch_far(cp, index, op);
+
+        case MOV_IMM:
+            if (op->simple_dp_imm.dest_reg == PC)
+                return FALSE;
+            emit_op_mem(0, 0xc7, 0, RBX, OFF_REG(op->simple_dp_imm.dest_reg));
+            emit32(op->simple_dp_imm.immediate);
+            return TRUE;
+        case MOV_IMM_NZ: {
+            word imm = op->simple_dp_imm.immediate;
+            word nz = (imm & 0x80000000) ? PSR_CC_NEG : 0;
+
+            if (op->simple_dp_imm.dest_reg == PC)
+                return FALSE;
+            if (imm == 0)
+                nz |= PSR_CC_ZERO;
+            emit_op_mem(0, 0xc7, 0, RBX, OFF_REG(op->simple_dp_imm.dest_reg));
+            emit32(imm);
+            emit_alu_mem_imm(X86_AND, RBX, OFF_CPSR, ~(PSR_CC_NEG | PSR_CC_ZERO));
+            if (nz)
+                emit_alu_mem_imm(X86_OR, RBX, OFF_CPSR, nz);
+            return TRUE;
+        }
+        case MOV_REG:
+            return emit_data_processing(AOP_MOV, op->simple_dp_reg.dest_reg, 0, FALSE, op->simple_dp_reg.source2_reg, FALSE, SHIFTER_CARRY_NONE);
+        case CMP_IMM_S:
+            return emit_data_processing(AOP_CMP, 0, op->simple_dp_imm.source_reg, TRUE, op->simple_dp_imm.immediate, TRUE, SHIFTER_CARRY_NONE);
+        case CMP_REG_S:
+            return emit_data_processing(AOP_CMP, 0, op->simple_dp_reg.source_reg, FALSE, op->simple_dp_reg.source2_reg, TRUE, SHIFTER_CARRY_NONE);
+        case CMN_REG_S:
+            return emit_data_processing(AOP_CMN, 0, op->simple_dp_reg.source_reg, FALSE, op->simple_dp_reg.source2_reg, TRUE, SHIFTER_CARRY_NONE);
+        case TST_REG_S:
+            return emit_data_processing(AOP_TST, 0, op->simple_dp_reg.source_reg, FALSE, op->simple_dp_reg.source2_reg, TRUE, SHIFTER_CARRY_NONE);
+        case ADD_IMM:
+        case ADD_IMM_S:
+            return emit_data_processing(AOP_ADD, op->simple_dp_imm.dest_reg, op->simple_dp_imm.source_reg, TRUE, op->simple_dp_imm.immediate, op->opcode == ADD_IMM_S, SHIFTER_CARRY_NONE);
+        case AND_IMM:
+            return emit_data_processing(AOP_AND, op->simple_dp_imm.dest_reg, op->simple_dp_imm.source_reg, TRUE, op->simple_dp_imm.immediate, FALSE, SHIFTER_CARRY_NONE);
+        case ORR_IMM:
+            return emit_data_processing(AOP_ORR, op->simple_dp_imm.dest_reg, op->simple_dp_imm.source_reg, TRUE, op->simple_dp_imm.immediate, FALSE, SHIFTER_CARRY_NONE);
+
+        case ADD_REG:
+        case ADD_REG_S:
+        case ADC_REG_S:
+        case SUB_REG_S:
+        case SBC_REG_S:
+        case ORR_REG_S:
+        case AND_REG_S:
+        case EOR_REG_S:
+        case BIC_REG_S: {
+            static const byte aops[] = {
+                [ADD_REG] = AOP_ADD, [ADD_REG_S] = AOP_ADD, [ADC_REG_S] = AOP_ADC,
+                [SUB_REG_S] = AOP_SUB, [SBC_REG_S] = AOP_SBC, [ORR_REG_S] = AOP_ORR,
+                [AND_REG_S] = AOP_AND, [EOR_REG_S] = AOP_EOR, [BIC_REG_S] = AOP_BIC,
+            };
+
+            return emit_data_processing(aops[op->opcode], op->simple_dp_reg.dest_reg, op->simple_dp_reg.source_reg,
+                                        FALSE, op->simple_dp_reg.source2_reg, op->opcode != ADD_REG, SHIFTER_CARRY_NONE);
+        }
+        case MVN_REG_S:
+            return emit_data_processing(AOP_MVN, op->simple_dp_reg.dest_reg, 0, FALSE, op->simple_dp_reg.source2_reg, TRUE, SHIFTER_CARRY_NONE);
+        case NEG_REG_S:
+            // rsb from zero
+            if (op->simple_dp_reg.dest_reg == PC)
+                return FALSE;
+            emit_load_reg(RCX, op->simple_dp_reg.source2_reg);
+            emit_op_rr(0, X86_XOR, RAX, RAX);
+            emit_op_rr(0, X86_SUB, RCX, RAX);
+            emit_store_reg(op->simple_dp_reg.dest_reg, RAX);
+            emit_set_flags(FLAGS_NZCV, TRUE);
+            return TRUE;
+
+        case LSL_IMM:
+            return emit_shift(SHIFT_SHL, op, FALSE);
+        case LSR_IMM:
+            return emit_shift(SHIFT_SHR, op, FALSE);
+        case ASR_IMM:
+            return emit_shift(SHIFT_SAR, op, FALSE);
+        case LSL_IMM_S:
+            return emit_shift(SHIFT_SHL, op, TRUE);
+        case LSR_IMM_S:
+            return emit_shift(SHIFT_SHR, op, TRUE);
+        case ASR_IMM_S:
+            return emit_shift(SHIFT_SAR, op, TRUE);
+
+        case DATA_PROCESSING_IMM:
+        case DATA_PROCESSING_IMM_S: {
+            int shifter_carry = SHIFTER_CARRY_NONE;
+
+            if (op->flags & UOPDPFLAGS_SET_CARRY_FROM_SHIFTER)
+                shifter_carry = (op->flags & UOPDPFLAGS_CARRY_FROM_SHIFTER) ? 1 : 0;
+            return emit_data_processing(op->data_processing_imm.dp_opcode, op->data_processing_imm.dest_reg,
+                                        op->data_processing_imm.source_reg, TRUE, op->data_processing_imm.immediate,
+                                        op->opcode == DATA_PROCESSING_IMM_S, shifter_carry);
+        }
+        case DATA_PROCESSING_REG:
+        case DATA_PROCESSING_REG_S:
+            return emit_data_processing(op->data_processing_reg.dp_opcode, op->data_processing_reg.dest_reg,
+                                        op->data_processing_reg.source_reg, FALSE, op->data_processing_reg.source2_reg,
+                                        op->opcode == DATA_PROCESSING_REG_S, SHIFTER_CARRY_NONE);
+
+        case DATA_PROCESSING_IMM_SHIFT: {
+            int aop = op->data_processing_imm_shift.dp_opcode;
+            bool s = (op->flags & UOPDPFLAGS_S_BIT) ? TRUE : FALSE;
+
+            // the test ops never write back
+            if (!s && (aop == AOP_TST || aop == AOP_TEQ || aop == AOP_CMP || aop == AOP_CMN))
+                return FALSE;
+            if (op->data_processing_imm_shift.dest_reg == PC)
+                return FALSE;
+            if (!emit_imm_shift(op))
+                return FALSE;
+            return emit_data_processing(aop, op->data_processing_imm_shift.dest_reg, op->data_processing_imm_shift.source_reg,
+                                        FALSE, OPERAND_ECX, s, SHIFTER_CARRY_R8);
+        }
+
+        case MULTIPLY:
+            return emit_multiply(op);
+        case MULTIPLY_LONG:
+            return emit_multiply_long(op);
+
+        case LOAD_IMMEDIATE_OFFSET:
+            return emit_load_store(cp, index, op, TRUE);
+        case STORE_IMMEDIATE_OFFSET:
+            return emit_load_store(cp, index, op, FALSE);
+        case LOAD_IMMEDIATE_WORD:
+            return emit_load_immediate(cp, index, op, UOPLSFLAGS_SIZE_WORD);
+        case LOAD_IMMEDIATE_HALFWORD:
+            return emit_load_immediate(cp, index, op, UOPLSFLAGS_SIZE_HALFWORD);
+        case LOAD_IMMEDIATE_BYTE:
+            return emit_load_immediate(cp, index, op, UOPLSFLAGS_SIZE_BYTE);
+    }
+
+    return FALSE;
+}
+
+static void emit_op(struct uop_codepage *cp, int index)
+{
+    struct uop *op = &cp->ops[index];
+    struct uop unfused;
+    byte *start = jit.ptr;
+    int fixup_start = fixup_count;
+
+    // translate fused pairs one op at a time, and specialized ops as the generic one
+    if (op->opcode >= FUSED_UOP_FIRST) {
+        unfused = *op;
+        unfused.opcode = uop_unfused_opcode(op->opcode);
+        op = &unfused;
+    } else if (uop_is_dp_shift(op->opcode)) {
+        unfused = *op;
+        unfused.opcode = uop_dp_shift_generic(op->opcode);
+        op = &unfused;
+    }
+
+    jit_r15 = op_address(cp, index) + cp->pc_inc * 2;
+
+#if JIT_NATIVE_OPS
+    // instruction count, the dispatch loop also counts ops that fail their condition
+    emit_op_rr(0, 0xff, 0, R14); // inc r14d
+    emit_condition(op, index);
+
+    if (emit_native_op(cp, index, op))
+        return;
+
+    // back out and let the interpreter have it
+    jit.ptr = start;
+    fixup_count = fixup_start;
+#endif
+
+    emit_mov_imm(RSI, index);
+    emit_jmp_abs(common_stub);
+}
+
+/*
+ * Shared by every untranslated op in the page: run op esi through the
+ * interpreter and continue with whatever op it leaves us at.
+ */
+static void emit_common_stub(struct uop_codepage *cp)
+{
+    common_stub = jit.ptr;
+
+    emit_flush_counters();
+    emit_op_rr(1, 0x89, R12, RDI);
+    emit_call(&uop_execute_one);
+    emit_op_rr(0, 0x85, RAX, RAX);
+    emit_jcc_abs(CC_S, jit.exit);
+    emit_op_rr(0, 0x89, RAX, RAX); // mov eax, eax, the top half of rax is junk after an int return
+    emit_mov_imm64(RCX, (uint64_t)(uintptr_t)entries);
+    emit8(0xff); // jmp [rcx + rax*8]
+    emit8(0x24);
+    emit8(0xc1);
+}
+
+static void jit_recycle(void)
+{
+    UOP_TRACE(3, "jit: recycling translation buffer\n");
+
+    jit.ptr = jit.start;
+    jit.gen++;
+    jit.chain_exit = NULL;
+}
+
+static bool jit_translate(struct uop_codepage *cp)
+{
+    int count = (cp->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM) + 1;
+    size_t worst_case = count * (JIT_MAX_OP_SIZE + sizeof(void *)) + JIT_MAX_OP_SIZE;
+    int i;
+
+    UOP_TRACE(5, "jit: translating codepage 0x%08x thumb %d\n", cp->address, cp->thumb);
+
+    // branches into the old translation have to go back through the dispatch loop
+    if (cp->jit_entry != NULL && cp->jit_gen == jit.gen)
+        jit_unlink(cp);
+    cp->jit_chain_in = NULL;
+
+    if ((size_t)(jit.end - jit.ptr) < worst_case)
+        jit_recycle();
+
+    // per op entry points go first so the common stub can find them
+    jit.ptr = (byte *)(((uintptr_t)jit.ptr + 7) & ~(uintptr_t)7);
+    entries = (void **)jit.ptr;
+    jit.ptr += count * sizeof(void *);
+
+    emit_common_stub(cp);
+
+    fixup_count = 0;
+    for (i = 0; i < count; i++) {
+        entries[i] = jit.ptr;
+        emit_op(cp, i);
+        ASSERT(jit.ptr - (byte *)entries[i] <= JIT_MAX_OP_SIZE);
+    }
+
+    for (i = 0; i < fixup_count; i++) {
+        byte *target = entries[fixups[i].target];
+        word rel = target - (fixups[i].patch + 4);
+
+        memcpy(fixups[i].patch, &rel, 4);
+    }
+
+    cp->jit_entry = entries;
+    cp->jit_gen = jit.gen;
+    cp->jit_stale = FALSE;
+
+    return TRUE;
+}
+
+/* run the current codepage from cpu.cp_pc until something needs the dispatch loop */
+bool jit_run(void)
+{
+    struct uop_codepage *cp = cpu.curr_cp;
+    void *entry;
+
+    // leave the per instruction tracing to the interpreter
+    if (TRACE_CPU_LEVEL >= 10 || TRACE_UOP_LEVEL >= 8)
+        return FALSE;
+
+    if (cp->jit_entry == NULL || cp->jit_gen != jit.gen || cp->jit_stale) {
+        if (!jit_translate(cp))
+            return FALSE;
+    }
+
+    entry = cp->jit_entry[cpu.cp_pc - cp->ops];
+
+    // translated code works on the flags in cpsr directly
+    flush_lazy_flags();
+
+    // if we got here through an unlinked branch, link it to where it went
+    if (jit.chain_exit) {
+        if (jit.chain_exit->target == cpu.pc)
+            jit_link(jit.chain_exit, cp, entry);
+        jit.chain_exit = NULL;
+    }
+
+    jit.enter(&cpu, cp, entry);
+
+    return TRUE;
+}
+
+/* all codepages are going away */
+void jit_flush(void)
+{
+    if (jit.buf)
+        jit_recycle();
+}
+
+/* cp may not be mapped where it was, branches into it have to check with the dispatch loop */
+void jit_unmap(struct uop_codepage *cp)
+{
+    if (cp->jit_entry != NULL && cp->jit_gen == jit.gen)
+        jit_unlink(cp);
+    cp->jit_chain_in = NULL;
+}
+
+/* cp is being evicted from the codepage cache, nothing may branch into its translation */
+void jit_evict(struct uop_codepage *cp)
+{
+    jit_unmap(cp);
+    cp->jit_entry = NULL;
+}
+
+int jit_init(void)
+{
+    if (jit.buf)
+        return 0;
+
+    jit.buf = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (jit.buf == MAP_FAILED) {
+        jit.buf = NULL;
+        return -1;
+    }
+    jit.ptr = jit.buf;
+    jit.end = jit.buf + JIT_BUFFER_SIZE;
+
+    /* entry: save callee saved registers and jump to the op */
+    jit.enter = (jit_enter_func)jit.ptr;
+    emit8(0x53);                            // push rbx
+    emit8(0x55);                            // push rbp
+    emit8(0x41); emit8(0x54);               // push r12
+    emit8(0x41); emit8(0x55);               // push r13
+    emit8(0x41); emit8(0x56);               // push r14
+    emit8(0x41); emit8(0x57);               // push r15
+    emit_op_rr(1, 0x83, 5, RSP);            // sub rsp, 8 (scratch, realigns the stack)
+    emit8(8);
+    emit_op_rr(1, 0x89, RDI, RBX);          // mov rbx, rdi
+    emit_op_rr(1, 0x89, RSI, R12);          // mov r12, rsi
+    emit_op_mem(1, 0x8d, R13, RSI, offsetof(struct uop_codepage, ops));
+    emit_op_rr(0, X86_XOR, R14, R14);
+    emit_op_rr(0, X86_XOR, R15, R15);
+    emit_op_rr(0, 0xff, 4, RDX);            // jmp rdx
+
+    /* exit: counters and cpu state have already been synced */
+    jit.exit = jit.ptr;
+    emit_op_rr(1, 0x83, 0, RSP);            // add rsp, 8
+    emit8(8);
+    emit8(0x41); emit8(0x5f);               // pop r15
+    emit8(0x41); emit8(0x5e);               // pop r14
+    emit8(0x41); emit8(0x5d);               // pop r13
+    emit8(0x41); emit8(0x5c);               // pop r12
+    emit8(0x5d);                            // pop rbp
+    emit8(0x5b);                            // pop rbx
+    emit8(0xc3);                            // ret
+
+    jit.start = jit.ptr;
+    jit.gen = 1;
+
+    return 0;
+}
+
+#else
+
+int jit_init(void)
+{
+    return -1;
+}
+
+bool jit_run(void)
+{
+    return FALSE;
+}
+
+void jit_flush(void)
+{
+}
+
+void jit_unmap(struct uop_codepage *cp)
+{
+}
+
+void jit_evict(struct uop_codepage *cp)
+{
+}
+
+#endif
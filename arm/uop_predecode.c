@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2005 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <options.h>
+#include <arm/arm.h>
+
+/*
+ * Predecode thread.
+ *
+ * When a codepage is loaded the cpu thread queues a copy of its undecoded
+ * ops here. The thread decodes every op of it it can, on the guess that
+ * most of the words are going to run, and picks out the far branch targets
+ * on the way. The result goes back through the same queue, and the cpu
+ * thread puts the ops into the codepage the next time it is at the top of
+ * the dispatch loop (see uop_install_predecoded()), but only the ones that
+ * are still undecoded there and still have the same instruction. The thread
+ * never touches the codepage or anything else of the cpu's. Ops that go in
+ * count as decoded like any other, so a store into a line of them later
+ * throws the codepage away (see codepage_written()), which makes it a poor
+ * fit for code that keeps writing data next to itself.
+ *
+ * The queue is a ring with one producer and one consumer at each step:
+ *
+ * [queue_tail, queue_done) decoded, waiting for the cpu thread to take back
+ * [queue_done, queue_head) queued, waiting for the predecode thread
+ * [queue_head, queue_tail) free
+ *
+ * queue_head only moves on the cpu thread and queue_done only on the
+ * predecode thread, each with a release store after the slots it hands over
+ * are filled in. queue_tail is private to the cpu thread. One slot is always
+ * kept free to tell a full queue from an empty one.
+ */
+
+bool uop_predecode; // set with 'predecode = yes' in [cpu]
+
+#if WITH_PREDECODE
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include <arm/decoder.h>
+#include <util/atomic.h>
+
+#define PREDECODE_QUEUE_SIZE 16
+
+static struct uop_predecode queue[PREDECODE_QUEUE_SIZE];
+static volatile int queue_head;
+static volatile int queue_done;
+static int queue_tail;
+
+static SDL_sem *queue_sem; // posted once per queued codepage
+
+/* the next free slot for the cpu thread to fill in, NULL if the queue is full */
+struct uop_predecode *predecode_slot(void)
+{
+    if ((queue_head + 1) % PREDECODE_QUEUE_SIZE == queue_tail)
+        return NULL;
+
+    return &queue[queue_head];
+}
+
+/* hand the slot from predecode_slot() to the predecode thread */
+void predecode_queue(void)
+{
+    atomic_put(&queue_head, (queue_head + 1) % PREDECODE_QUEUE_SIZE);
+    SDL_SemPost(queue_sem);
+}
+
+/* the oldest decoded codepage, NULL if there's none */
+struct uop_predecode *predecode_result(void)
+{
+    if (queue_tail == atomic_get(&queue_done))
+        return NULL;
+
+    return &queue[queue_tail];
+}
+
+/* done with the slot from predecode_result() */
+void predecode_retire(void)
+{
+    queue_tail = (queue_tail + 1) % PREDECODE_QUEUE_SIZE;
+}
+
+static void predecode_ops(struct uop_predecode *p)
+{
+    int count = p->thumb ? NUM_CODEPAGE_INS_THUMB : NUM_CODEPAGE_INS_ARM;
+    int pc_inc = p->thumb ? 2 : 4;
+    int i, j;
+
+    p->num_targets = 0;
+    for (i = 0; i < count; i++) {
+        struct uop *op = &p->ops[i];
+        struct uop undecoded = *op;
+
+        // ops taken from the decode cache are already done, only their branches are of interest
+        if (op->opcode == DECODE_ME_ARM || op->opcode == DECODE_ME_THUMB) {
+            p->raw[i] = op->undecoded.raw_instruction;
+
+            // r15 as it would be when the op runs, two instructions ahead
+            decode_r15 = p->address + (i + 2) * pc_inc;
+            decode_failed = FALSE;
+            if (p->thumb)
+                thumb_decode_into_uop(op);
+            else
+                arm_decode_into_uop(op);
+            if (decode_failed) {
+                *op = undecoded; // the cpu thread decodes it if it ever runs, and panics then
+                continue;
+            }
+        }
+
+        if (op->opcode == B_IMMEDIATE && p->num_targets < PREDECODE_TARGETS) {
+            // codepage of the target, with the low bit set if it is thumb
+            armaddr_t target = (op->b_immediate.target & ~(CODEPAGE_SIZE-1)) |
+                               ((p->thumb || (op->flags & UOPBFLAGS_SETTHUMB_ALWAYS)) ? 1 : 0);
+
+            for (j = 0; j < p->num_targets && p->targets[j] != target; j++)
+                ;
+            if (j == p->num_targets)
+                p->targets[p->num_targets++] = target;
+        }
+    }
+}
+
+static int predecode_thread_entry(void *args)
+{
+    decode_speculative = TRUE;
+
+    for (;;) {
+        int done = queue_done;
+        bool any = FALSE;
+
+        SDL_SemWait(queue_sem);
+
+        // everything queued so far, the posts for the rest of them find nothing left
+        while (done != atomic_get(&queue_head)) {
+            predecode_ops(&queue[done]);
+            done = (done + 1) % PREDECODE_QUEUE_SIZE;
+            atomic_put(&queue_done, done);
+            any = TRUE;
+        }
+
+        // and have the cpu thread pick them up
+        if (any)
+            cpu_request_exit();
+    }
+
+    return 0;
+}
+
+void uop_set_predecode(bool enable)
+{
+    if (!enable || uop_predecode)
+        return;
+
+    queue_sem = SDL_CreateSemaphore(0);
+    if (queue_sem == NULL || SDL_CreateThread(&predecode_thread_entry, NULL) == NULL) {
+        printf("could not start the predecode thread, decoding as the code runs\n");
+        return;
+    }
+
+    uop_predecode = TRUE;
+}
+
+#else
+
+void uop_set_predecode(bool enable)
+{
+    if (enable)
+        printf("predecode thread not built in, decoding as the code runs\n");
+}
+
+#endif
@@ -57,6 +57,13 @@ enum perf_counter_type {
     EXCEPTIONS,
 
     INS_DECODE,
+    INS_PREDECODE,
+
+    CODEPAGE_HIT,
+    CODEPAGE_MISS,
+    CODEPAGE_EVICT,
+    CODEPAGE_WRITTEN,
+    CODEPAGE_CACHED,
 
 #if COUNT_MMU_OPS
     MMU_READ,
@@ -94,6 +101,11 @@ enum perf_counter_type {
     UOP_ARITH_OPCODE_TOP = UOP_ARITH_OPCODE + 16,
 #endif
 
+#if COUNT_FUSED_UOPS
+    FUSED_UOP_BASE,
+    FUSED_UOP_TOP = FUSED_UOP_BASE + NUM_FUSED_UOPS,
+#endif
+
     // setting this lower will tend to make the compiler optimize away calls to add_to_perf_count
     MAX_PERF_COUNTER,
 };
@@ -122,14 +134,22 @@ struct cpu_struct {
     reg_t spsr;
     bool r15_dirty;     // if we wrote into r[15] in the last instruction
 
+    // condition flags that have not been folded into cpsr yet, see flush_lazy_flags()
+    int lazy_flags;     // one of the LAZY_* values, LAZY_NONE if the NZCV bits of cpsr are up to date
+    word lazy_a;
+    word lazy_b;
+    word lazy_result;
+
     // pending interrupts and mode changes
     volatile int pending_exceptions;
+    volatile int exit_request; // raised along with any pending exception, see cpu_request_exit()
     reg_t old_cpsr; // in case of a mode switch, we store the old mode
     armaddr_t exception_base; // 0 or 0xffff0000 on cpus that support it
 
     // cache of uop codepages
     struct uop_codepage *curr_cp;
-    struct uop_codepage *codepage_hash[CODEPAGE_HASHSIZE];
+    struct uop_codepage **codepage_dir[2][CODEPAGE_DIR_SIZE]; // [thumb][address >> CODEPAGE_DIR_SHIFT]
+    struct uop_codepage **codepage_pdir[CODEPAGE_DIR_SIZE]; // both kinds, by physical address
 
     // free list of codepage structures
     struct uop_codepage *free_cp_arm;
@@ -184,6 +204,7 @@ extern struct cpu_struct cpu;
 #define PSR_CC_CARRY  0x20000000
 #define PSR_CC_OVL    0x10000000
 #define PSR_CC_Q      0x08000000
+#define PSR_CC_NZCV   (PSR_CC_NEG|PSR_CC_ZERO|PSR_CC_CARRY|PSR_CC_OVL)
 
 // conditions
 #define COND_MASK     0xf
@@ -298,8 +319,58 @@ static inline word do_add(word a, word b, int carry_in, int *carry, int *ovl)
     return val;
 }
 
+/*
+ * Lazy condition flags. With LAZY_FLAGS on, ops that set NZCV only record
+ * what they computed, and the flags are worked out the first time
+ * something reads them: a conditional op, get_condition(), MRS, exception
+ * entry or a write of the whole cpsr. Most flag results are overwritten by
+ * the next flag setting op before anything looks at them.
+ */
+enum {
+    LAZY_NONE = 0,
+    LAZY_ADD,   // lazy_result = lazy_a + lazy_b (+ carry in), subtracts pass ~b
+    LAZY_NZCV,  // N and Z from lazy_result, C and V precomputed in lazy_b
+    LAZY_NZ,    // N and Z from lazy_result, C and V in cpsr
+};
+
+static inline void flush_lazy_flags(void)
+{
+#if LAZY_FLAGS
+    reg_t nzcv;
+    word a, b, result;
+
+    if (likely(cpu.lazy_flags == LAZY_NONE))
+        return;
+
+    a = cpu.lazy_a;
+    b = cpu.lazy_b;
+    result = cpu.lazy_result;
+
+    nzcv = (result & PSR_CC_NEG) | ((result == 0) ? PSR_CC_ZERO : 0);
+    switch (cpu.lazy_flags) {
+        case LAZY_ADD:
+            // carry out of and overflow into bit 31, whatever the carry in was
+            nzcv |= (((a & b) | ((a | b) & ~result)) >> 2) & PSR_CC_CARRY;
+            nzcv |= (((a ^ result) & (b ^ result)) >> 3) & PSR_CC_OVL;
+            break;
+        case LAZY_NZCV:
+            nzcv |= b;
+            break;
+        case LAZY_NZ:
+            nzcv |= cpu.cpsr & (PSR_CC_CARRY|PSR_CC_OVL);
+            break;
+    }
+
+    cpu.cpsr = (cpu.cpsr & ~PSR_CC_NZCV) | nzcv;
+    cpu.lazy_flags = LAZY_NONE;
+#endif
+}
+
 static inline void set_condition(unsigned int condition, bool set)
 {
+    if (condition & PSR_CC_NZCV)
+        flush_lazy_flags();
+
     if (condition == PSR_THUMB) {
         CPU_TRACE(7, "setting THUMB bit to %d\n", set);
     }
@@ -312,12 +383,52 @@ static inline void set_condition(unsigned int condition, bool set)
 
 static inline void set_NZ_condition(reg_t val)
 {
+#if LAZY_FLAGS
+    // C and V of anything still pending have to be kept
+    if (unlikely(cpu.lazy_flags != LAZY_NONE && cpu.lazy_flags != LAZY_NZ))
+        flush_lazy_flags();
+    cpu.lazy_flags = LAZY_NZ;
+    cpu.lazy_result = val;
+#else
     set_condition(PSR_CC_NEG, BIT(val, 31));
     set_condition(PSR_CC_ZERO, val == 0);
+#endif
+}
+
+/* all four flags from an op that already worked out carry and overflow */
+static inline void set_NZCV_condition(reg_t val, int carry, int ovl)
+{
+#if LAZY_FLAGS
+    cpu.lazy_flags = LAZY_NZCV;
+    cpu.lazy_b = (carry ? PSR_CC_CARRY : 0) | (ovl ? PSR_CC_OVL : 0);
+    cpu.lazy_result = val;
+#else
+    set_NZ_condition(val);
+    set_condition(PSR_CC_CARRY, carry);
+    set_condition(PSR_CC_OVL, ovl);
+#endif
+}
+
+/* all four flags from val = a + b (+ carry in), pass ~b for subtracts */
+static inline void set_add_condition(reg_t val, word a, word b)
+{
+#if LAZY_FLAGS
+    cpu.lazy_flags = LAZY_ADD;
+    cpu.lazy_a = a;
+    cpu.lazy_b = b;
+    cpu.lazy_result = val;
+#else
+    set_NZ_condition(val);
+    set_condition(PSR_CC_CARRY, ISNEG((a & b) | ((a | b) & ~val)));
+    set_condition(PSR_CC_OVL, ISNEG((a ^ val) & (b ^ val)));
+#endif
 }
 
 static inline unsigned int get_condition(unsigned int condition)
 {
+    if (condition & PSR_CC_NZCV)
+        flush_lazy_flags();
+
     return (cpu.cpsr & condition);
 }
 
@@ -348,6 +459,16 @@ static inline bool check_condition(byte condition)
     // this happens far more often than not
     if (likely(condition == COND_AL))
         return TRUE;
+#if LAZY_FLAGS
+    // Z is always straight off the result, no need to fold anything into cpsr for it
+    if (cpu.lazy_flags != LAZY_NONE) {
+        if (condition == COND_EQ)
+            return cpu.lazy_result == 0;
+        if (condition == COND_NE)
+            return cpu.lazy_result != 0;
+    }
+#endif
+    flush_lazy_flags();
     // check the instructions condition mask against precomputed values of cpsr
     return cpu.condition_table[cpu.cpsr >> COND_SHIFT] & (1 << (condition));
 }
@@ -404,6 +525,7 @@ void set_exception_base(armaddr_t base);
 void install_cp15(void);
 
 /* exceptions */
+void cpu_request_exit(void);
 void raise_irq(void);
 void lower_irq(void);
 void raise_fiq(void);
@@ -414,5 +536,10 @@ int process_pending_exceptions(void);
 
 /* codepage maintenance */
 void flush_all_codepages(void); /* throw away all cached instructions */
+void invalidate_all_codepages(void); /* check them against memory before they're used again */
+void flush_codepage_range(armaddr_t address, armaddr_t len); /* just the ones covering this range */
+void unmap_all_codepages(void); /* the virtual to physical mapping may have changed */
+bool codepage_at_paddr(armaddr_t paddr); /* is there code cached from this physical page */
+bool codepage_written(armaddr_t paddr, armaddr_t len); /* a store went to it, returns FALSE if there isn't */
 
 #endif
@@ -28,5 +28,25 @@
 void arm_decode_into_uop(struct uop *op);
 void thumb_decode_into_uop(struct uop *op);
 
+/*
+ * The decoders take r15 for the instruction being decoded from decode_r15
+ * rather than from the cpu, so they can also run on the predecode thread.
+ * A decode there is speculative, the words may well be data, so instead of
+ * panicking on a form it can't handle a decoder sets decode_failed and
+ * gives up on the op.
+ */
+extern __THREAD_LOCAL armaddr_t decode_r15;
+extern __THREAD_LOCAL bool decode_speculative;
+extern __THREAD_LOCAL bool decode_failed;
+
+#define DECODE_PANIC(x...) \
+    do { \
+        if (decode_speculative) { \
+            decode_failed = TRUE; \
+            return; \
+        } \
+        panic_cpu(x); \
+    } while (0)
+
 #endif
 
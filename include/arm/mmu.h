@@ -38,6 +38,19 @@ bool mmu_write_mem_word(armaddr_t address, word data);
 bool mmu_write_mem_halfword(armaddr_t address, halfword data);
 bool mmu_write_mem_byte(armaddr_t address, byte data);
 
+/*
+ * translate the whole page of instructions at address at once, faults like a fetch from it would.
+ * host is the page in host memory, or NULL if it has to be read with sys_read_mem_*()
+ */
+bool mmu_get_instruction_page(armaddr_t address, armaddr_t *paddr, const void **host, bool priviledged);
+/* physical address an instruction fetch from address goes to, only out of the translation cache, returns TRUE if it isn't there */
+bool mmu_probe_instruction(armaddr_t address, armaddr_t *paddr, bool priviledged);
+/* mmu_get_instruction_page() out of the translation cache, never faults and returns TRUE if it isn't there */
+bool mmu_probe_instruction_page(armaddr_t address, armaddr_t *paddr, const void **host, bool priviledged);
+
+/* stores to this physical page have to be passed on to codepage_written() */
+void mmu_track_code_page(armaddr_t paddr);
+
 /* initialization */
 void mmu_init(int with_mmu);
 
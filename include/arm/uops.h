@@ -24,6 +24,33 @@
 #define __ARM_UOPS_H
 
 /* opcodes supported by the uop interpreter */
+/*
+ * DATA_PROCESSING_IMM_SHIFT and DATA_PROCESSING_REG_SHIFT specialized on the
+ * shift type and the S bit, so the handlers don't have to look at either.
+ * X(opcode, handler, form, shift type, S bit), in the order that
+ * uop_dp_shift_opcode() counts on.
+ */
+#define DP_SHIFT_UOP_LIST(X) \
+    X(DP_IMM_SHIFT_LSL,     dp_imm_shift_lsl,       imm, 0, FALSE) \
+    X(DP_IMM_SHIFT_LSR,     dp_imm_shift_lsr,       imm, 1, FALSE) \
+    X(DP_IMM_SHIFT_ASR,     dp_imm_shift_asr,       imm, 2, FALSE) \
+    X(DP_IMM_SHIFT_ROR,     dp_imm_shift_ror,       imm, 3, FALSE) \
+    X(DP_IMM_SHIFT_LSL_S,   dp_imm_shift_lsl_s,     imm, 0, TRUE) \
+    X(DP_IMM_SHIFT_LSR_S,   dp_imm_shift_lsr_s,     imm, 1, TRUE) \
+    X(DP_IMM_SHIFT_ASR_S,   dp_imm_shift_asr_s,     imm, 2, TRUE) \
+    X(DP_IMM_SHIFT_ROR_S,   dp_imm_shift_ror_s,     imm, 3, TRUE) \
+    X(DP_REG_SHIFT_LSL,     dp_reg_shift_lsl,       reg, 0, FALSE) \
+    X(DP_REG_SHIFT_LSR,     dp_reg_shift_lsr,       reg, 1, FALSE) \
+    X(DP_REG_SHIFT_ASR,     dp_reg_shift_asr,       reg, 2, FALSE) \
+    X(DP_REG_SHIFT_ROR,     dp_reg_shift_ror,       reg, 3, FALSE) \
+    X(DP_REG_SHIFT_LSL_S,   dp_reg_shift_lsl_s,     reg, 0, TRUE) \
+    X(DP_REG_SHIFT_LSR_S,   dp_reg_shift_lsr_s,     reg, 1, TRUE) \
+    X(DP_REG_SHIFT_ASR_S,   dp_reg_shift_asr_s,     reg, 2, TRUE) \
+    X(DP_REG_SHIFT_ROR_S,   dp_reg_shift_ror_s,     reg, 3, TRUE)
+
+/* expands to a case label for each of the above */
+#define DP_SHIFT_UOP_CASE(opcode, handler, form, shift, s) case opcode:
+
 enum uop_opcode {
     DECODE_ME_ARM = 0,
     DECODE_ME_THUMB,
@@ -52,6 +79,10 @@ enum uop_opcode {
     DATA_PROCESSING_REG_S,      // S bit set, update condition flags
     DATA_PROCESSING_IMM_SHIFT,  // barrel shifter involved, immediate operands to shifter, S bit may be involved
     DATA_PROCESSING_REG_SHIFT,  // barrel shifter involved, register operands to shifter, S bit may be involved
+                                // (only the translator sees these two, ops are decoded into the specialized forms below)
+#define DP_SHIFT_UOP_ENUM(opcode, handler, form, shift, s) opcode,
+    DP_SHIFT_UOP_LIST(DP_SHIFT_UOP_ENUM)
+#undef DP_SHIFT_UOP_ENUM
 
     // special versions of some of the above instructions
     MOV_IMM,                    // mov and mvn
@@ -119,14 +150,61 @@ enum uop_opcode {
     COPROC_DATA_PROCESSING,
     COPROC_LOAD_STORE,
 
+    // fused pairs, the first op of a pair runs both of them (see uop_fuse())
+    CMP_IMM_BRANCH_LOCAL,       // CMP_IMM_S followed by B_IMMEDIATE_LOCAL
+    CMP_REG_BRANCH_LOCAL,       // CMP_REG_S followed by B_IMMEDIATE_LOCAL
+    ADD_IMM_S_BRANCH_LOCAL,     // ADD_IMM_S followed by B_IMMEDIATE_LOCAL
+    LOAD_ADD_IMM,               // LOAD_IMMEDIATE_OFFSET followed by ADD_IMM to the base register
+    MOV_IMM_MOV,                // MOV_IMM followed by MOV_IMM or MOV_REG
+    MOV_REG_MOV,                // MOV_REG followed by MOV_IMM or MOV_REG
+
     MAX_UOP_OPCODE,
 };
 
-/* description for the internal opcode format and decoder routines */
+#define FUSED_UOP_FIRST CMP_IMM_BRANCH_LOCAL
+#define NUM_FUSED_UOPS (MAX_UOP_OPCODE - FUSED_UOP_FIRST)
+
+/* the specialized barrel shifter op for a shift type and S bit, UOPDPFLAGS_S_BIT is still set to match */
+static inline int uop_dp_shift_opcode(bool reg_shift, int shift_opcode, bool s_bit)
+{
+    return DP_IMM_SHIFT_LSL + (reg_shift ? 8 : 0) + (s_bit ? 4 : 0) + shift_opcode;
+}
+
+static inline bool uop_is_dp_shift(int opcode)
+{
+    return opcode >= DP_IMM_SHIFT_LSL && opcode <= DP_REG_SHIFT_ROR_S;
+}
+
+/* the generic op a specialized barrel shifter op came from */
+static inline int uop_dp_shift_generic(int opcode)
+{
+    return (opcode >= DP_REG_SHIFT_LSL) ? DATA_PROCESSING_REG_SHIFT : DATA_PROCESSING_IMM_SHIFT;
+}
+
+/* the opcode the first op of a fused pair had on its own */
+static inline int uop_unfused_opcode(int opcode)
+{
+    switch (opcode) {
+        case CMP_IMM_BRANCH_LOCAL: return CMP_IMM_S;
+        case CMP_REG_BRANCH_LOCAL: return CMP_REG_S;
+        case ADD_IMM_S_BRANCH_LOCAL: return ADD_IMM_S;
+        case LOAD_ADD_IMM: return LOAD_IMMEDIATE_OFFSET;
+        case MOV_IMM_MOV: return MOV_IMM;
+        case MOV_REG_MOV: return MOV_REG;
+        default: return opcode;
+    }
+}
+
+/*
+ * description for the internal opcode format and decoder routines
+ * 24 bytes on a 64 bit host, the branch ops keep codepage pointers in the union
+ */
 struct uop {
     halfword opcode;
     byte cond; // 4 bits of condition
     byte flags; // up to 8 flags
+    byte cond_run; // number of ops after this one that share its condition, see uop_cond_run()
+    byte reads_pc; // r15 is an operand, r[PC] is only brought up to date for these ops (see uop_reads_pc())
     union {
         struct {
             // undecoded, arm or thumb
@@ -146,6 +224,7 @@ struct uop {
         struct {
             word reg;
             word link_offset;
+            struct uop_codepage *target_cp; // codepage of the last nonlocal target, see ibc_branch()
         } b_reg;
         struct {
             word reg;
@@ -295,15 +374,32 @@ struct uop {
     };
 };
 
-#define CODEPAGE_HASHSIZE 1024
+/* codepages cover an aligned CODEPAGE_SIZE piece of an mmu page, and are only made for the pieces that run */
+#define CODEPAGE_SIZE (1 << CODEPAGE_SHIFT)
+
+/* two level directory of codepages by address, see lookup_codepage() */
+#define CODEPAGE_DIR_SHIFT  22
+#define CODEPAGE_DIR_SIZE   (1 << (32 - CODEPAGE_DIR_SHIFT))
+#define CODEPAGE_TABLE_SIZE (1 << (CODEPAGE_DIR_SHIFT - CODEPAGE_SHIFT))
+
+#define NUM_CODEPAGE_INS_ARM    (CODEPAGE_SIZE / 4)
+#define NUM_CODEPAGE_INS_THUMB  (CODEPAGE_SIZE / 2)
 
-#define NUM_CODEPAGE_INS_ARM    (MMU_PAGESIZE / 4)
-#define NUM_CODEPAGE_INS_THUMB  (MMU_PAGESIZE / 2)
+/* granularity stores into a codepage are checked at, see codepage_written() */
+#define CODEPAGE_LINE_SHIFT 6
+#define CODEPAGE_LINE_SIZE  (1 << CODEPAGE_LINE_SHIFT)
 
 /* a page of uops at a time */
 struct uop_codepage {
     struct uop_codepage *next;
-    armaddr_t address;
+    armaddr_t address; // same as vaddr while it's known to be mapped there, see lookup_codepage()
+    armaddr_t vaddr;   // where it was loaded from
+    armaddr_t paddr;
+    struct uop_codepage *pnext; // next codepage loaded from the same physical page
+
+    dword decoded; // bitmap of the CODEPAGE_LINE_SIZE lines that have decoded ops in them
+    dword hash;    // of the instructions it was loaded from, see map_codepage()
+    unsigned int epoch;
 
     bool thumb; /* arm or thumb */
 
@@ -314,6 +410,15 @@ struct uop_codepage {
     int pc_inc;
     int pc_shift; // number of bits the real pc should be shifted to get to the codepage index (2 for arm, 1 for thumb)
 
+    bool referenced; // entered since the eviction clock last went past, see evict_codepage()
+
+#if WITH_JIT
+    void **jit_entry;   // translated entry point per op, NULL if not translated yet
+    int jit_gen;        // translation buffer generation jit_entry belongs to
+    int jit_stale;      // an op was decoded since the last translation
+    void *jit_chain_in; // branches from other codepages linked into this translation
+#endif
+
     struct uop ops[0]; /* we will allocate a different amount of space if it's arm or thumb */
 };
 
@@ -324,4 +429,66 @@ const char *uop_opcode_to_str(int opcode);
 
 void uop_init(void);
 
+/* select the execution engine, "interp" or "jit" */
+void uop_set_engine(const char *engine);
+void uop_set_dispatch(const char *variant);
+void uop_set_codecache_size(int mb);
+void uop_set_predecode(bool enable);
+void uop_set_decode_cache(const char *path);
+extern bool uop_count_cycles;
+extern bool uop_predecode;
+extern bool uop_decode_cache;
+
+/* x86-64 translator, see uop_jit.c */
+int jit_init(void);
+bool jit_run(void);
+void jit_flush(void);
+void jit_unmap(struct uop_codepage *cp);
+void jit_evict(struct uop_codepage *cp);
+int uop_execute_one(struct uop_codepage *cp, int index);
+void uop_push_return(armaddr_t pc);
+
+#if WITH_PREDECODE
+/* how many far branch targets are passed back from a codepage to be predecoded in turn */
+#define PREDECODE_TARGETS 4
+
+/* a codepage on its way through the predecode thread, see uop_predecode.c */
+struct uop_predecode {
+    struct uop_codepage *cp;
+    armaddr_t address; // cp->vaddr when it was queued, the codepage may have been reused since
+    bool thumb;
+    bool follow; // queue the codepages at targets[] too
+
+    int num_targets;
+    armaddr_t targets[PREDECODE_TARGETS];
+
+    word raw[NUM_CODEPAGE_INS_THUMB];      // the instructions the ops were decoded from
+    struct uop ops[NUM_CODEPAGE_INS_THUMB]; // undecoded ops in, decoded ones out where it could
+};
+
+struct uop_predecode *predecode_slot(void);
+void predecode_queue(void);
+struct uop_predecode *predecode_result(void);
+void predecode_retire(void);
+#endif
+
+#if WITH_DECODE_CACHE
+/* a codepage in the decode cache file, followed by its raw instructions and its ops, see uop_cache.c */
+struct decode_cache_entry {
+    dword hash;    // cp->hash, of the raw instructions
+    dword decoded; // cp->decoded
+    armaddr_t vaddr;
+    word thumb;
+};
+
+#define DECODE_CACHE_RAW(e) ((const word *)((e) + 1))
+#define DECODE_CACHE_OPS(e, count) ((const struct uop *)(DECODE_CACHE_RAW(e) + (count)))
+
+const struct decode_cache_entry *decode_cache_find(armaddr_t vaddr, bool thumb, dword hash);
+bool decode_cache_save_begin(unsigned int count);
+void decode_cache_save(const struct uop_codepage *cp, const word *raw);
+void decode_cache_save_end(void);
+void uop_save_decode_cache(void);
+#endif
+
 #endif
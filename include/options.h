@@ -39,16 +39,31 @@
 
 #define DUMP_STATS      0 // should we run a thread that dumps stats once a second
 
+#define THREADED_DISPATCH 1 // use computed goto to thread the uop handlers together (gcc), 0 falls back to a switch
+#define WITH_JIT        1 // build the x86-64 translator, selected with 'engine = jit' in the [cpu] section of the config
+#define WITH_PREDECODE  1 // build the thread that decodes new codepages ahead of the cpu, turned on with 'predecode = yes' in [cpu]
+#define WITH_DECODE_CACHE 1 // build the cache of decoded codepages kept on disk between runs, named with 'decode_cache = <file>' in [cpu]
+
+#define LAZY_FLAGS      1 // only work out the NZCV flags when something reads them
+#define DEAD_FLAGS_PASS 1 // drop flag updates that are always overwritten before being read, at decode time
+#define FUSE_UOPS       1 // fuse common pairs of ops (cmp + branch, ldr + add, ...) into one at decode time
+#define COND_RUNS       1 // check the condition once for a run of ops that share it
+#define CODEPAGE_SHIFT  10 // codepages cover 1 << CODEPAGE_SHIFT bytes of guest code, 8 (256 bytes) up to 12 (an mmu page)
+
 #define COUNT_CYCLES    1 // should we try to accurately count cycles
 #define COUNT_ARM_OPS   0
 #define COUNT_UOPS      0
 #define COUNT_ARITH_UOPS 0
+#define COUNT_FUSED_UOPS 0 // how often each kind of fused pair runs
 #define COUNT_MMU_OPS   0
 
 // compiler hints
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #define __ALWAYS_INLINE __attribute__((always_inline))
+#define __NO_INLINE __attribute__((noinline))
+#define __COLD __attribute__((cold))
+#define __THREAD_LOCAL __thread
 
 // systemwide asserts
 #if 0
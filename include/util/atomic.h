@@ -23,11 +23,75 @@
 #ifndef __ATOMIC_H
 #define __ATOMIC_H
 
+/*
+ * All of these return the old value. test_and_set() only stores set_to if
+ * the old value was test_val.
+ *
+ * Compilers that have the __atomic builtins get inline versions of them, so
+ * raising an interrupt line from a device thread is a single locked
+ * instruction. The read-modify-write ops are full barriers either way.
+ * atomic_get() and atomic_put() are the acquire load and release store to
+ * pair with them.
+ */
+#if defined(__ATOMIC_SEQ_CST)
+
+static inline int atomic_add(volatile int *val, int incr)
+{
+    return __atomic_fetch_add(val, incr, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomic_and(volatile int *val, int incr)
+{
+    return __atomic_fetch_and(val, incr, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomic_or(volatile int *val, int incr)
+{
+    return __atomic_fetch_or(val, incr, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomic_set(volatile int *val, int set_to)
+{
+    return __atomic_exchange_n(val, set_to, __ATOMIC_SEQ_CST);
+}
+
+static inline int test_and_set(volatile int *val, int set_to, int test_val)
+{
+    __atomic_compare_exchange_n(val, &test_val, set_to, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return test_val;
+}
+
+static inline int atomic_get(volatile int *val)
+{
+    return __atomic_load_n(val, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_put(volatile int *val, int set_to)
+{
+    __atomic_store_n(val, set_to, __ATOMIC_RELEASE);
+}
+
+#else
+
+/* per host processor versions in atomic_asm.S */
 int atomic_add(volatile int *val, int incr);
 int atomic_and(volatile int *val, int incr);
 int atomic_or(volatile int *val, int incr);
 int atomic_set(volatile int *val, int set_to);
 int test_and_set(volatile int *val, int set_to, int test_val);
 
+/* aligned word accesses are atomic on all the hosts above, the asm ops fence them */
+static inline int atomic_get(volatile int *val)
+{
+    return *val;
+}
+
+static inline void atomic_put(volatile int *val, int set_to)
+{
+    atomic_set(val, set_to);
+}
+
+#endif
+
 #endif
 
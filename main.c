@@ -40,7 +40,7 @@ static struct termios oldstdout;
 
 static void usage(int argc, char **argv)
 {
-    fprintf(stderr, "usage: %s [-b binary] [-c cpu type] [-r romfile] [-n cycle count]\n", argv[0]);
+    fprintf(stderr, "usage: %s [-b binary] [-c cpu type] [-r romfile] [-n cycle count] [-d fast|count|trace]\n", argv[0]);
 
     exit(1);
 }
@@ -98,10 +98,11 @@ int main(int argc, char **argv)
         static struct option long_options[] = {
             {"rom", 1, 0, 'r'},
             {"cpu", 1, 0, 'c'},
+            {"dispatch", 1, 0, 'd'},
             {0, 0, 0, 0},
         };
 
-        c = getopt_long(argc, argv, "r:c:", long_options, &option_index);
+        c = getopt_long(argc, argv, "r:c:d:", long_options, &option_index);
         if (c == -1)
             break;
 
@@ -114,6 +115,10 @@ int main(int argc, char **argv)
                 printf("cpu core option: '%s'\n", optarg);
                 add_config_key("cpu", "core", optarg);
                 break;
+            case 'd':
+                printf("dispatch option: '%s'\n", optarg);
+                add_config_key("cpu", "dispatch", optarg);
+                break;
             default:
                 usage(argc, argv);
                 break;
@@ -25,40 +25,50 @@
 #include <string.h>
 #include <sys/types.h>
 
-#include <SDL/SDL.h>
-#include <SDL/SDL_thread.h>
-
 #include <arm/arm.h>
 #include <sys/sys.h>
 #include <util/endian.h>
+#include <util/atomic.h>
 #include "sys_p.h"
 
+/*
+ * No lock: device threads only set and clear their bits in vector_active, and
+ * vector_mask is only written by the cpu thread through the registers. Whoever
+ * changes either one recomputes the irq line afterwards.
+ */
 static struct pic {
-    SDL_mutex *mutex;
-    bool irq_active;
-    uint32_t vector_active;    // 1 if active
-    uint32_t vector_mask;      // 1 if the interrupt is masked
+    volatile int vector_active;    // 1 if active
+    volatile int vector_mask;      // 1 if the interrupt is masked
 } pic;
 
-/* set cpu irq status based off of current interrupt controller inputs */
+static uint32_t get_ready_ints(void)
+{
+    return (uint32_t)atomic_get(&pic.vector_active) & ~(uint32_t)atomic_get(&pic.vector_mask);
+}
+
+/*
+ * set cpu irq status based off of current interrupt controller inputs.
+ * Two threads can race in here with different views of the inputs, so
+ * whoever drove the line last looks again and fixes it up if it lost.
+ */
 static void set_irq_status(void)
 {
-    if (pic.vector_active & ~pic.vector_mask) {
-        if (!pic.irq_active)
+    bool active;
+
+    do {
+        active = get_ready_ints() != 0;
+        if (active)
             raise_irq();
-        pic.irq_active = TRUE;
-    } else {
-        if (pic.irq_active)
+        else
             lower_irq();
-        pic.irq_active = FALSE;
-    }
+    } while (active != (get_ready_ints() != 0));
 }
 
 static int get_current_interrupt(void)
 {
     int i;
 
-    uint32_t ready_ints = pic.vector_active & ~pic.vector_mask;
+    uint32_t ready_ints = get_ready_ints();
     if (ready_ints == 0)
         return -1;
 
@@ -75,14 +85,13 @@ int pic_assert_level(int vector)
     if (vector < 0 || vector >= PIC_MAX_INT)
         return -1;
 
-    SDL_LockMutex(pic.mutex);
-
     SYS_TRACE(5, "sys: pic_assert_level %d\n", vector);
 
-    pic.vector_active |= (1<<vector);
-    set_irq_status();
+    // already up, nothing to do
+    if (atomic_or(&pic.vector_active, (1<<vector)) & (1<<vector))
+        return 0;
 
-    SDL_UnlockMutex(pic.mutex);
+    set_irq_status();
 
     return 0;
 }
@@ -92,14 +101,12 @@ int pic_deassert_level(int vector)
     if (vector < 0 || vector >= PIC_MAX_INT)
         return -1;
 
-    SDL_LockMutex(pic.mutex);
-
     SYS_TRACE(5, "sys: pic_deassert_level %d\n", vector);
 
-    pic.vector_active &= ~(1<<vector);
-    set_irq_status();
+    if (!(atomic_and(&pic.vector_active, ~(1<<vector)) & (1<<vector)))
+        return 0;
 
-    SDL_UnlockMutex(pic.mutex);
+    set_irq_status();
 
     return 0;
 }
@@ -114,8 +121,6 @@ static word pic_regs_get_put(armaddr_t address, word data, int size, int put)
     if (size < 4)
         return 0; /* only word accesses supported */
 
-    SDL_LockMutex(pic.mutex);
-
     switch (address) {
         /* read/write to the current interrupt mask */
         case PIC_MASK_LATCH: /* 1s are latched into the current mask */
@@ -126,7 +131,7 @@ static word pic_regs_get_put(armaddr_t address, word data, int size, int put)
 set_mask:
         case PIC_MASK:
             if (put) {
-                pic.vector_mask = data;
+                atomic_put(&pic.vector_mask, data);
                 val = 0;
                 set_irq_status();
             } else {
@@ -136,7 +141,7 @@ set_mask:
 
         /* each bit corresponds to the current status of the interrupt line */
         case PIC_STAT:
-            val = pic.vector_active;
+            val = atomic_get(&pic.vector_active);
             break;
 
         /* one bit set for the highest priority non-masked active interrupt */
@@ -158,8 +163,6 @@ set_mask:
             val = 0;
     }
 
-    SDL_UnlockMutex(pic.mutex);
-
     return val;
 }
 
@@ -167,9 +170,6 @@ int initialize_pic(void)
 {
     memset(&pic, 0, sizeof(pic));
 
-    // create a mutex to lock us
-    pic.mutex = SDL_CreateMutex();
-
 //  pic.vector_mask = 0xffffffff; /* everything starts out masked */
 
     // install the pic register handlers
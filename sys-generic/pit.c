@@ -26,47 +26,62 @@
 #include <sys/types.h>
 
 #include <SDL/SDL.h>
-#include <SDL/SDL_thread.h>
 
 #include <arm/arm.h>
 #include <sys/sys.h>
 #include <util/endian.h>
+#include <util/atomic.h>
 #include "sys_p.h"
 
-static struct pit {
-    SDL_mutex *mutex;
-    SDL_TimerID curr_timer;
+/*
+ * The timer callback runs in its own thread and takes no lock. Each timer the
+ * guest starts gets a new generation number in pit.timer along with its mode,
+ * and passes the whole word to its callback. A callback that finds pit.timer
+ * has moved on belongs to a timer that was cleared or restarted, and cancels
+ * itself by returning 0, instead of the cpu thread removing it.
+ */
+#define PIT_TIMER_ACTIVE    0x1
+#define PIT_TIMER_PERIODIC  0x2
+#define PIT_TIMER_GEN       0x4
 
+static struct pit {
+    volatile int timer;     // generation | PIT_TIMER_* of the current timer
+    volatile int status;    // PIT_STATUS_INT_PEND
     reg_t curr_interval;
-    bool periodic;
-    reg_t status;
 } pit;
 
 static Uint32 pit_callback(Uint32 interval, void *param)
 {
-    SYS_TRACE(5, "pit_callback: interval %d\n", interval);
+    int timer = (int)(intptr_t)param;
 
-    SDL_LockMutex(pit.mutex);
+    SYS_TRACE(5, "pit_callback: interval %d\n", interval);
 
-    // make sure there is still an active timer
-    if (pit.curr_timer == NULL)
-        goto exit;
+    if (timer & PIT_TIMER_PERIODIC) {
+        // make sure this is still the active timer
+        if (atomic_get(&pit.timer) != timer)
+            return 0;
+    } else {
+        // one shot, retire it unless something else already has
+        if (test_and_set(&pit.timer, timer & ~PIT_TIMER_ACTIVE, timer) != timer)
+            return 0;
+        interval = 0;
+    }
 
     // level trigger an interrupt
-    pit.status |= PIT_STATUS_INT_PEND;
+    atomic_or(&pit.status, PIT_STATUS_INT_PEND);
     pic_assert_level(INT_PIT);
 
-    if (!pit.periodic) {
-        // cancel the timer
-        SDL_RemoveTimer(pit.curr_timer);
-        pit.curr_timer = NULL;
-        pit.status &= ~PIT_STATUS_ACTIVE;
-    }
+    return interval;
+}
 
-exit:
-    SDL_UnlockMutex(pit.mutex);
+/* retire the current timer, start a new one if mode says so */
+static void pit_set_timer(int mode)
+{
+    int timer = ((pit.timer & ~(PIT_TIMER_GEN - 1)) + PIT_TIMER_GEN) | mode;
 
-    return interval;
+    atomic_set(&pit.timer, timer);
+    if (mode & PIT_TIMER_ACTIVE)
+        SDL_AddTimer(pit.curr_interval, &pit_callback, (void *)(intptr_t)timer);
 }
 
 static word pit_regs_get_put(armaddr_t address, word data, int size, int put)
@@ -79,11 +94,11 @@ static word pit_regs_get_put(armaddr_t address, word data, int size, int put)
     if (size < 4)
         return 0; /* only word accesses supported */
 
-    SDL_LockMutex(pit.mutex);
-
     switch (address) {
         case PIT_STATUS: // status bit
-            val = pit.status;
+            val = atomic_get(&pit.status);
+            if (atomic_get(&pit.timer) & PIT_TIMER_ACTIVE)
+                val |= PIT_STATUS_ACTIVE;
             break;
         case PIT_INTERVAL:
             if (put && data != 0) {
@@ -92,44 +107,25 @@ static word pit_regs_get_put(armaddr_t address, word data, int size, int put)
             val = pit.curr_interval;
             break;
         case PIT_START_ONESHOT:
-            if (put && data != 0) {
-                pit.periodic = FALSE;
-                goto set_timer;
-            }
+            if (put && data != 0)
+                pit_set_timer(PIT_TIMER_ACTIVE);
             break;
         case PIT_START_PERIODIC:
-            if (put && data != 0) {
-                pit.periodic = TRUE;
-                goto set_timer;
-            }
-            break;
-
-set_timer:
-            // clear any old timer
-            if (pit.curr_timer != NULL) {
-                SDL_RemoveTimer(pit.curr_timer);
-                pit.curr_timer = NULL;
-            }
-            pit.curr_timer = SDL_AddTimer(pit.curr_interval, &pit_callback, NULL);
-            pit.status |= PIT_STATUS_ACTIVE;
+            if (put && data != 0)
+                pit_set_timer(PIT_TIMER_ACTIVE | PIT_TIMER_PERIODIC);
             break;
         case PIT_CLEAR:
-            if (put && data != 0 && pit.curr_timer != NULL) {
-                SDL_RemoveTimer(pit.curr_timer);
-                pit.curr_timer = NULL;
-                pit.status &= ~PIT_STATUS_ACTIVE;
-            }
+            if (put && data != 0 && (pit.timer & PIT_TIMER_ACTIVE))
+                pit_set_timer(0);
             break;
         case PIT_CLEAR_INT:
             if (put && data != 0) {
-                pit.status &= ~PIT_STATUS_INT_PEND;
+                atomic_and(&pit.status, ~PIT_STATUS_INT_PEND);
                 pic_deassert_level(INT_PIT);
             }
             break;
     }
 
-    SDL_UnlockMutex(pit.mutex);
-
     return val;
 }
 
@@ -137,9 +133,6 @@ int initialize_pit(void)
 {
     memset(&pit, 0, sizeof(pit));
 
-    // create a mutex to lock us
-    pit.mutex = SDL_CreateMutex();
-
     // install the pic register handlers
     install_mem_handler(PIT_REGS_BASE, PIT_REGS_SIZE, &pit_regs_get_put, NULL);
 
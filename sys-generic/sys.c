@@ -83,6 +83,11 @@ int initialize_system(void)
 
     // create a cpu
     initialize_cpu(get_config_key_string("cpu", "core", "arm7tdmi"));
+    uop_set_engine(get_config_key_string("cpu", "engine", "interp"));
+    uop_set_dispatch(get_config_key_string("cpu", "dispatch", "count"));
+    uop_set_codecache_size(atoi(get_config_key_string("cpu", "codecache_mb", "64")));
+    uop_set_predecode(get_config_key_bool("cpu", "predecode", 0));
+    uop_set_decode_cache(get_config_key_string("cpu", "decode_cache", NULL));
 
     memset(&sys, 0, sizeof(sys));
 
@@ -22,6 +22,8 @@
  */
 #include <util/atomic.h>
 
+#if !defined(__ATOMIC_SEQ_CST)
+
 #if __i386__ || __I386__
 
 /* defined in atomic_asm.S */
@@ -38,3 +40,5 @@
 #error implement SPARC atomic_* ops
 #endif
 
+#endif
+